@@ -0,0 +1,352 @@
+/* Ahead-of-time recompiler. Reads a ROM, discovers its blocks by following
+ * the control flow from 0x200, and writes to stdout a C file with one
+ * function per block. That file is compiled together with the interpreter
+ * (see the aot target of the makefile), and run_cycles() runs the block at pc
+ * through aot_execute() instead of dispatching instruction by instruction.
+ *
+ * A block is a run of instructions that ends on a jump, call, return or
+ * skip. Instructions that depend on the timers or that draw, wait for a
+ * key or write memory are left to the interpreter, so a block ends right
+ * before them. Indirect jumps (BNNN) end the block, and execution continues
+ * in whatever block starts at the target, or in the interpreter if there is none.
+ *
+ * Every block checks first that the bytes it was translated from are still
+ * in memory. If the program modified itself (or a different ROM was
+ * loaded), the block returns 0 and the interpreter runs the instruction.
+ * Returns with an empty stack and calls with a full one are checked too:
+ * the block returns right before them, and the interpreter faults */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "chip8.h"
+
+#define AOT_MAX_BLOCK 64        /* Max instructions per block */
+#define AOT_BODY_SIZE (AOT_MAX_BLOCK * 2048)
+
+/* What happened when translating an instruction */
+enum {
+    AOT_NEXT,           /* Translated, keep going */
+    AOT_EXIT,           /* Translated, and it ends the block */
+    AOT_INTERPRET       /* Must be run by the interpreter */
+};
+
+static uint8_t memory[CHIP8_MEMSIZE];
+static bool is_block[CHIP8_MEMSIZE];    /* A block starts at this address */
+static bool visited[CHIP8_MEMSIZE];     /* Already queued for discovery */
+static uint16_t pending[CHIP8_MEMSIZE]; /* Addresses still to be walked */
+static int pending_count;
+
+/* Code of the block being translated. Nothing is written while discovering */
+static char body[AOT_BODY_SIZE];
+static size_t body_len;
+static bool emitting;
+
+static void emit(const char *fmt, ...)
+{
+    if (!emitting)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    body_len += vsnprintf(body + body_len, AOT_BODY_SIZE - body_len, fmt, args);
+    va_end(args);
+}
+
+/* Queues addr to be walked, if it can hold an instruction */
+static void follow(uint16_t addr)
+{
+    if (addr < 0x200 || addr + 1 >= CHIP8_MEMSIZE || visited[addr])
+        return;
+
+    visited[addr] = true;
+    pending[pending_count++] = addr;
+}
+
+/* Emits a skip: pc goes to addr + 4 if cond is true, or to addr + 2 */
+static int emit_skip(uint16_t addr, const char *cond, int count)
+{
+    emit("    chip8->pc = (%s) ? 0x%03X : 0x%03X;\n", cond, addr + 4, addr + 2);
+    emit("    return %d;\n", count);
+    follow(addr + 2);
+    follow(addr + 4);
+    return AOT_EXIT;
+}
+
+/* Emits a check that leaves the instruction at addr, the count-th of the
+ * block, to the interpreter if cond is true. The block returns right
+ * before it, and the interpreter runs it (and faults, see Fault) */
+static void emit_fallback(uint16_t addr, const char *cond, int count)
+{
+    emit("    if (%s) {\n", cond);
+    emit("        chip8->pc = 0x%03X;\n", addr);
+    emit("        return %d;\n", count - 1);
+    emit("    }\n");
+}
+
+/* Emits the C code of the instruction at addr, which is the count-th of
+ * the block. The code follows the handlers of opcode_functions.c
+ * statement by statement, so the results are the same */
+static int emit_instruction(uint16_t addr, int count)
+{
+    uint16_t opcode = (memory[addr] << 8) | memory[addr + 1];
+    uint16_t nnn = opcode & 0x0FFF;
+    uint8_t nn = opcode & 0x00FF;
+    uint8_t n = opcode & 0x000F;
+    uint8_t x = (opcode & 0x0F00) >> 8;
+    uint8_t y = (opcode & 0x00F0) >> 4;
+    char cond[96];
+
+    emit("    /* 0x%03X: %04X */\n", addr, opcode);
+
+    switch (opcode >> 12) {
+        case 0x0:
+            if (opcode != 0x00EE)
+                return AOT_INTERPRET;
+            emit_fallback(addr, "chip8->sp == 0", count);
+            emit("    chip8->pc = chip8->stack[--chip8->sp] + 2;\n");
+            emit("    return %d;\n", count);
+            return AOT_EXIT;
+
+        /* Jumps and calls outside of the program are left to the
+         * interpreter, which faults */
+        case 0x1:
+            if (nnn < 0x200)
+                return AOT_INTERPRET;
+            emit("    chip8->pc = 0x%03X;\n", nnn);
+            emit("    return %d;\n", count);
+            follow(nnn);
+            return AOT_EXIT;
+
+        case 0x2:
+            if (nnn < 0x200)
+                return AOT_INTERPRET;
+            emit_fallback(addr, "chip8->sp == MAX_STACK_LEVELS", count);
+            emit("    chip8->stack[chip8->sp] = 0x%03X;\n", addr);
+            emit("    chip8->sp++;\n");
+            emit("    chip8->pc = 0x%03X;\n", nnn);
+            emit("    return %d;\n", count);
+            follow(nnn);
+            follow(addr + 2);
+            return AOT_EXIT;
+
+        case 0x3:
+        case 0x4:
+            sprintf(cond, "chip8->V[0x%X] %s 0x%02X", x, (opcode >> 12) == 0x3 ? "==" : "!=", nn);
+            return emit_skip(addr, cond, count);
+
+        case 0x5:
+        case 0x9:
+            sprintf(cond, "chip8->V[0x%X] %s chip8->V[0x%X]", x, (opcode >> 12) == 0x5 ? "==" : "!=", y);
+            return emit_skip(addr, cond, count);
+
+        case 0x6:
+            emit("    chip8->V[0x%X] = 0x%02X;\n", x, nn);
+            return AOT_NEXT;
+
+        case 0x7:
+            emit("    chip8->V[0x%X] += 0x%02X;\n", x, nn);
+            return AOT_NEXT;
+
+        case 0x8:
+            switch (n) {
+                case 0x0:
+                    emit("    chip8->V[0x%X] = chip8->V[0x%X];\n", x, y);
+                    break;
+                case 0x1:
+                    emit("    chip8->V[0x%X] |= chip8->V[0x%X];\n", x, y);
+                    break;
+                case 0x2:
+                    emit("    chip8->V[0x%X] &= chip8->V[0x%X];\n", x, y);
+                    break;
+                case 0x3:
+                    emit("    chip8->V[0x%X] ^= chip8->V[0x%X];\n", x, y);
+                    break;
+                case 0x4:
+                    emit("    chip8->V[0xF] = (chip8->V[0x%X] + chip8->V[0x%X]) > 0xFF;\n", x, y);
+                    emit("    chip8->V[0x%X] += chip8->V[0x%X];\n", x, y);
+                    break;
+                case 0x5:
+                    emit("    chip8->V[0xF] = !(chip8->V[0x%X] > chip8->V[0x%X]);\n", y, x);
+                    emit("    chip8->V[0x%X] -= chip8->V[0x%X];\n", x, y);
+                    break;
+                case 0x6:
+                    emit("    chip8->V[0xF] = chip8->V[0x%X] & 0x01;\n", x);
+                    emit("    chip8->V[0x%X] >>= 1;\n", y);
+                    emit("    chip8->V[0x%X] = chip8->V[0x%X];\n", x, y);
+                    break;
+                case 0x7:
+                    emit("    chip8->V[0xF] = !(chip8->V[0x%X] > chip8->V[0x%X]);\n", x, y);
+                    emit("    chip8->V[0x%X] = chip8->V[0x%X] - chip8->V[0x%X];\n", x, y, x);
+                    break;
+                case 0xE:
+                    emit("    chip8->V[0xF] = chip8->V[0x%X] & 0x80;\n", x);
+                    emit("    chip8->V[0x%X] <<= 1;\n", y);
+                    emit("    chip8->V[0x%X] = chip8->V[0x%X];\n", x, y);
+                    break;
+                default:
+                    return AOT_INTERPRET;
+            }
+            return AOT_NEXT;
+
+        case 0xA:
+            emit("    chip8->I = 0x%03X;\n", nnn);
+            return AOT_NEXT;
+
+        /* The target depends on V0, so the block ends here */
+        case 0xB:
+            emit("    chip8->pc = 0x%03X + chip8->V[0];\n", nnn);
+            emit("    return %d;\n", count);
+            return AOT_EXIT;
+
+        case 0xC:
+            emit("    chip8->V[0x%X] = chip8_random(chip8) & 0x%02X;\n", x, nn);
+            return AOT_NEXT;
+
+        /* There are no keys past F, and they are never pressed */
+        case 0xE:
+            if (nn == 0x9E)
+                sprintf(cond, "chip8->V[0x%X] < MAX_KEYPAD_KEYS && chip8->key[chip8->V[0x%X]] != 0", x, x);
+            else if (nn == 0xA1)
+                sprintf(cond, "chip8->V[0x%X] >= MAX_KEYPAD_KEYS || chip8->key[chip8->V[0x%X]] == 0", x, x);
+            else
+                return AOT_INTERPRET;
+            return emit_skip(addr, cond, count);
+
+        case 0xF:
+            switch (nn) {
+                case 0x1E:
+                    emit("    chip8->V[0xF] = (chip8->I + chip8->V[0x%X]) > 0xFFF;\n", x);
+                    emit("    chip8->I += chip8->V[0x%X];\n", x);
+                    break;
+                case 0x29:
+                    emit("    chip8->I = chip8->V[0x%X] * 0x5;\n", x);
+                    break;
+                case 0x65:
+                    for (int i = 0; i <= x; i++) {
+                        emit("    chip8->V[0x%X] = chip8->memory[(chip8->I + %d) & (CHIP8_MEMSIZE - 1)];\n", i, i);
+                    }
+                    emit("    chip8->I = chip8->I + %d;\n", x + 1);
+                    break;
+                default:
+                    return AOT_INTERPRET;
+            }
+            return AOT_NEXT;
+
+        default:
+            return AOT_INTERPRET;
+    }
+}
+
+/* Walks (and emits, if emitting) the block at start. Returns the number
+ * of instructions in it and, in end, the address after the last one */
+static int walk_block(uint16_t start, uint16_t *end)
+{
+    uint16_t addr = start;
+    int count = 0;
+
+    body_len = 0;
+    while (count < AOT_MAX_BLOCK && addr + 1 < CHIP8_MEMSIZE) {
+        size_t len = body_len;
+        int result = emit_instruction(addr, count + 1);
+
+        if (result == AOT_INTERPRET) {
+            body_len = len;
+            /* The interpreter continues at addr + 2 (or stays at addr) */
+            follow(addr + 2);
+            break;
+        }
+
+        addr += 2;
+        count++;
+
+        if (result == AOT_EXIT) {
+            *end = addr;
+            return count;
+        }
+    }
+
+    /* Fell through into an instruction for the interpreter */
+    emit("    chip8->pc = 0x%03X;\n", addr);
+    emit("    return %d;\n", count);
+    *end = addr;
+    return count;
+}
+
+/* Finds every block reachable from 0x200 */
+static void discover(void)
+{
+    uint16_t end;
+
+    follow(0x200);
+    while (pending_count > 0) {
+        uint16_t addr = pending[--pending_count];
+        if (walk_block(addr, &end) > 0)
+            is_block[addr] = true;
+    }
+}
+
+static void write_block(uint16_t start)
+{
+    uint16_t end;
+
+    walk_block(start, &end);
+
+    printf("/* 0x%03X - 0x%03X */\n", start, end - 1);
+    printf("static int block_%03X(Chip8 *chip8)\n{\n", start);
+    printf("    static const uint8_t code[] = {");
+    for (int i = start; i < end; i++) {
+        printf("%s0x%02X", i == start ? " " : ", ", memory[i]);
+    }
+    printf(" };\n\n");
+    printf("    if (memcmp(&chip8->memory[0x%03X], code, sizeof(code)) != 0)\n", start);
+    printf("        return 0;\n\n");
+    fwrite(body, 1, body_len, stdout);
+    printf("}\n\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <ROM FILE> > <C FILE>\n", *argv);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *rom = fopen(argv[1], "rb");
+    if (!rom) {
+        fprintf(stderr, "ERROR: COULD NOT OPEN ROM FILE \'%s\'\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    size_t rom_size = fread(memory + 0x200, 1, CHIP8_MEMSIZE - 0x200, rom);
+    fclose(rom);
+
+    discover();
+
+    printf("/* Generated by chip8-aot from %s (%zu bytes). Do not edit */\n\n", argv[1], rom_size);
+    printf("#include <stdlib.h>\n#include <string.h>\n#include \"aot.h\"\n\n");
+
+    emitting = true;
+    int blocks = 0;
+    for (int addr = 0x200; addr < CHIP8_MEMSIZE; addr++) {
+        if (is_block[addr]) {
+            write_block(addr);
+            blocks++;
+        }
+    }
+
+    printf("/* Runs the block at pc. Returns the number of instructions executed,\n");
+    printf(" * or 0 if the interpreter must run the instruction at pc */\n");
+    printf("int aot_execute(Chip8 *chip8)\n{\n");
+    printf("    switch (chip8->pc) {\n");
+    for (int addr = 0x200; addr < CHIP8_MEMSIZE; addr++) {
+        if (is_block[addr])
+            printf("        case 0x%03X: return block_%03X(chip8);\n", addr, addr);
+    }
+    printf("        default: return 0;\n");
+    printf("    }\n}\n");
+
+    fprintf(stderr, "%s: %d BLOCKS TRANSLATED\n", argv[1], blocks);
+    return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef _AOT_HEADER_
+#define _AOT_HEADER_
+
+#include "chip8.h"
+
+/* Defined in the C file generated by chip8-aot for a specific ROM */
+int aot_execute(Chip8 *);
+
+#endif /* _AOT_HEADER_ */
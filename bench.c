@@ -0,0 +1,682 @@
+/* Measures how fast the interpreter runs the ROMs given in the command line,
+ * without any graphics or delays. Run it with make bench, which builds it
+ * once for every dispatch method so they can be compared, and once with the
+ * recompiler of jit.c (which only translates on x86-64). The fused builds
+ * also print which sequences fired (see fusion.c), and the lockstep build
+ * compares many machines run one after another with the same machines run
+ * in lockstep (see lockstep.c). The fork build explores a tree of inputs
+ * with forked branches (see fork.c) and with copies of the machine.
+ *
+ * Every ROM runs --runs times (from the start each time), and the mean and
+ * the standard deviation of the runs are printed. The keys come from an
+ * input script (--script, in the format of headless.c) or, without one,
+ * change every BENCH_KEY_PERIOD instructions. --micro also times each
+ * handler of opcode_functions.c on its own, with the operands that make it
+ * take different paths, and the conversion of frames to pixels that
+ * update_screen() does. --output appends every result to a CSV file, one
+ * line each, to compare them between versions:
+ *
+ *     build,kind,name,runs,count,per_second,per_second_stddev,ns,ns_stddev
+ *
+ * where kind is rom (count instructions per run), opcode (count calls) or
+ * render (count frames), and ns is the time each of them took. The lockstep
+ * and fork builds only print their results */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "chip8.h"
+#include "opcode_functions.h"
+#ifdef FUSION
+#include "fusion.h"
+#endif
+#ifdef LOCKSTEP
+#include "lockstep.h"
+#endif
+#ifdef FORK
+#include "fork.h"
+#endif
+#ifdef JIT
+#include "jit.h"
+#endif
+
+#define BENCH_INSTRUCTIONS 20000000UL  /* Instructions to run per ROM */
+#define BENCH_KEY_PERIOD   500UL       /* Instructions between key changes */
+#define BENCH_LANES        256         /* Machines of the lockstep build */
+#define BENCH_FORK_DEPTH   5           /* Levels of the tree of the fork build */
+#define BENCH_FORK_WIDTH   4           /* Children of each branch of the tree */
+#define BENCH_FORK_STEP    2000UL      /* Instructions each branch runs */
+#define BENCH_RUNS         5           /* Default runs of every benchmark */
+#define BENCH_MAX_RUNS     100
+#define BENCH_MAX_EVENTS   1024        /* Lines per input script */
+#define BENCH_CALLS        1000000UL   /* Calls per run of a handler */
+#define BENCH_FRAMES       100000UL    /* Frames per run of the renderer */
+
+#if defined(LOCKSTEP)
+#define DISPATCH_METHOD "lockstep"
+#elif defined(FORK)
+#define DISPATCH_METHOD "fork"
+#elif defined(FUSION) && defined(THREADED)
+#define DISPATCH_METHOD "threaded+fused"
+#elif defined(FUSION)
+#define DISPATCH_METHOD "fused"
+#elif defined(THREADED)
+#define DISPATCH_METHOD "threaded"
+#elif defined(JIT)
+#define DISPATCH_METHOD "jit"
+#else
+#define DISPATCH_METHOD "table"
+#endif
+
+/* Keys held down from an instruction on */
+typedef struct key_event {
+    unsigned long at;
+    uint16_t keys;
+} KeyEvent;
+
+/* The time of every run of a benchmark */
+typedef struct samples {
+    double seconds[BENCH_MAX_RUNS];
+    unsigned long counts[BENCH_MAX_RUNS]; /* Of what was timed in each run */
+    int runs;
+} Samples;
+
+static int runs = BENCH_RUNS;
+static KeyEvent events[BENCH_MAX_EVENTS];
+static int event_count = -1;           /* -1 without an input script */
+static FILE *output;                   /* NULL without --output */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_script(const char * const filename)
+{
+    FILE *script = fopen(filename, "r");
+    if (!script) {
+        fprintf(stderr, "ERROR: COULD NOT OPEN INPUT SCRIPT '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[256];
+    event_count = 0;
+    while (fgets(line, sizeof(line), script)) {
+        unsigned long at;
+        unsigned int keys;
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (sscanf(line, "%lu %x", &at, &keys) != 2 || keys > 0xFFFF ||
+                event_count == BENCH_MAX_EVENTS) {
+            fprintf(stderr, "ERROR: BAD INPUT SCRIPT '%s'\n", filename);
+            exit(EXIT_FAILURE);
+        }
+
+        events[event_count].at = at;
+        events[event_count].keys = keys;
+        event_count++;
+    }
+    fclose(script);
+}
+
+#if !defined(LOCKSTEP) && !defined(FORK)
+/* Prints the mean and the standard deviation of the runs of a benchmark,
+ * in what per second and in ns per what, and appends them to the output */
+static void report(const char * const kind, const char * const name,
+        const char * const what, const Samples *samples)
+{
+    double rate = 0, rate_squares = 0, ns = 0, ns_squares = 0;
+    unsigned long count = 0;
+
+    for (int i = 0; i < samples->runs; i++) {
+        double run_rate = samples->counts[i] / samples->seconds[i];
+        double run_ns = samples->counts[i] ? samples->seconds[i] * 1e9 / samples->counts[i] : 0;
+        rate += run_rate;
+        rate_squares += run_rate * run_rate;
+        ns += run_ns;
+        ns_squares += run_ns * run_ns;
+        count += samples->counts[i];
+    }
+
+    /* Sample standard deviation, 0 for a single run */
+    const int n = samples->runs;
+    double rate_deviation = 0, ns_deviation = 0;
+    if (n > 1) {
+        rate_deviation = sqrt(fmax(0, (rate_squares - rate * rate / n) / (n - 1)));
+        ns_deviation = sqrt(fmax(0, (ns_squares - ns * ns / n) / (n - 1)));
+    }
+    rate /= n;
+    ns /= n;
+
+    printf("BENCH %s %s: %.2f M %sS/s +- %.2f (%.2f +- %.2f ns PER %s), %d RUNS\n",
+            DISPATCH_METHOD, name, rate / 1e6, what, rate_deviation / 1e6,
+            ns, ns_deviation, what, n);
+    if (output) {
+        fprintf(output, "%s,%s,%s,%d,%lu,%.0f,%.0f,%.3f,%.3f\n", DISPATCH_METHOD, kind, name,
+                n, count / n, rate, rate_deviation, ns, ns_deviation);
+    }
+}
+#endif
+
+/* Keys held down from instruction i on: a different one every now and then,
+ * so the games don't get stuck waiting for input */
+static uint16_t bench_keys(unsigned long i)
+{
+    if ((i / BENCH_KEY_PERIOD) % 3 != 0)
+        return 0;
+    return 1 << (i / (3 * BENCH_KEY_PERIOD)) % MAX_KEYPAD_KEYS;
+}
+
+#ifdef LOCKSTEP
+/* Runs BENCH_LANES machines with different seeds for BENCH_INSTRUCTIONS
+ * instructions in all, first one after another with run_cycles() and then
+ * in lockstep, and checks that both end up the same */
+static void bench_rom(const char * const filename)
+{
+    static Chip8 chip8;
+    static uint64_t hashes[BENCH_LANES];
+    static uint16_t pcs[BENCH_LANES];
+    const unsigned long instructions = BENCH_INSTRUCTIONS / BENCH_LANES;
+
+    init_chip8(&chip8);
+    if (!load_rom(&chip8, filename))
+        exit(EXIT_FAILURE);
+
+    /* The rest of memory is zero, so loading all of it is the same */
+    static uint8_t program[CHIP8_MEMSIZE - 512];
+    memcpy(program, chip8.memory + 512, sizeof(program));
+
+    /* Only running them is timed, not setting them up. Idle loops are
+     * skipped, which the lanes don't do, so the instructions skipped are
+     * not counted as executed */
+    double scalar = 0;
+    unsigned long skipped = 0;
+    for (int lane = 0; lane < BENCH_LANES; lane++) {
+        init_chip8(&chip8);
+        load_program(&chip8, program, sizeof(program));
+        chip8.rng = 1 + lane;
+
+        double start = now();
+        unsigned long done = 0;
+        while (done < instructions) {
+            for (int key = 0; key < MAX_KEYPAD_KEYS; key++) {
+                chip8.key[key] = (bench_keys(done) >> key) & 1;
+            }
+
+            unsigned long until = (done / BENCH_KEY_PERIOD + 1) * BENCH_KEY_PERIOD;
+            if (until > instructions)
+                until = instructions;
+
+            unsigned long executed;
+            run_cycles(&chip8, until - done, &executed);
+            chip8.shouldDraw = false;
+            done += executed;
+        }
+        scalar += now() - start;
+        skipped += chip8.idle_skipped;
+        hashes[lane] = frame_hash(&chip8);
+        pcs[lane] = chip8.pc;
+    }
+
+    Lockstep *lockstep = lockstep_create(BENCH_LANES, program, sizeof(program), 1);
+    if (!lockstep) {
+        fprintf(stderr, "NOT ENOUGH MEMORY TO RUN IN LOCKSTEP\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now();
+    for (unsigned long done = 0; done < instructions; done += BENCH_KEY_PERIOD) {
+        for (int lane = 0; lane < BENCH_LANES; lane++) {
+            lockstep->keys[lane] = bench_keys(done);
+        }
+        lockstep_run(lockstep, done + BENCH_KEY_PERIOD > instructions ?
+                instructions - done : BENCH_KEY_PERIOD);
+    }
+    double elapsed = now() - start;
+
+    int mismatches = 0;
+    for (int lane = 0; lane < BENCH_LANES; lane++) {
+        lockstep_export(lockstep, lane, &chip8);
+        if (lockstep->faulted[lane] || frame_hash(&chip8) != hashes[lane] || chip8.pc != pcs[lane])
+            mismatches++;
+    }
+
+    const unsigned long total = instructions * BENCH_LANES;
+    printf("BENCH %s %s: %d LANES, %.2f MIPS (%.2f MIPS ONE AFTER ANOTHER), "
+            "%.1f LANES PER STEP, %d MISMATCHES\n",
+            DISPATCH_METHOD, filename, BENCH_LANES, total / elapsed / 1e6, (total - skipped) / scalar / 1e6,
+            lockstep->steps ? (double)lockstep->executed / lockstep->steps : 0, mismatches);
+
+    lockstep_destroy(lockstep);
+}
+#elif defined(FORK)
+/* Keys held down by child n of a branch */
+static const uint16_t fork_keys[BENCH_FORK_WIDTH] = { 0, 1 << 4, 1 << 5, 1 << 6 };
+
+/* The machine of the tree, running branch */
+static Chip8 *enter(Branch *branch)
+{
+    Chip8 *machine = branch_enter(branch);
+    if (!machine) {
+        fprintf(stderr, "NOT ENOUGH MEMORY TO FORK\n");
+        exit(EXIT_FAILURE);
+    }
+    return machine;
+}
+
+/* Runs machine for BENCH_FORK_STEP instructions holding keys down */
+static void run_branch(Chip8 *machine, uint16_t keys)
+{
+    for (int key = 0; key < MAX_KEYPAD_KEYS; key++) {
+        machine->key[key] = (keys >> key) & 1;
+    }
+
+    unsigned long done = 0;
+    while (done < BENCH_FORK_STEP) {
+        unsigned long executed;
+        run_cycles(machine, BENCH_FORK_STEP - done, &executed);
+        machine->shouldDraw = false;
+        done += executed;
+    }
+}
+
+/* Explores every combination of the keys of fork_keys for BENCH_FORK_DEPTH
+ * steps of BENCH_FORK_STEP instructions, from the state of the ROM after
+ * BENCH_INSTRUCTIONS / 100. Level by level, every branch of a level is
+ * forked into a child per key. It's done once with forked branches and
+ * once with a copy of the whole machine per branch, and the screens of
+ * both must end up the same */
+static void bench_rom(const char * const filename)
+{
+    static Chip8 start;
+    static uint64_t hashes[1 << (2 * BENCH_FORK_DEPTH)];
+    Chip8 **machines = malloc(sizeof(hashes) / sizeof(*hashes) * sizeof(Chip8 *));
+    Branch **branches = malloc(sizeof(hashes) / sizeof(*hashes) * sizeof(Branch *));
+    ForkTree *tree = fork_tree_create();
+    if (!machines || !branches || !tree) {
+        fprintf(stderr, "NOT ENOUGH MEMORY TO FORK\n");
+        exit(EXIT_FAILURE);
+    }
+
+    init_chip8(&start);
+    if (!load_rom(&start, filename))
+        exit(EXIT_FAILURE);
+    start.rng = 1;
+    run_branch(&start, 0);
+    for (unsigned long i = 0; i < BENCH_INSTRUCTIONS / 100; i += BENCH_FORK_STEP) {
+        run_branch(&start, bench_keys(i));
+    }
+
+    /* With copies of the machine. The tree is built in place: the children
+     * of branch n of a level are n * WIDTH to n * WIDTH + WIDTH - 1 of the
+     * next one, so it's done from the last branch to the first */
+    double copy_time = 0;
+    int count = 1;
+    double started = now();
+    machines[0] = malloc(sizeof(Chip8));
+    *machines[0] = start;
+    for (int depth = 0; depth < BENCH_FORK_DEPTH; depth++) {
+        for (int n = count - 1; n >= 0; n--) {
+            Chip8 *parent = machines[n];
+            for (int k = BENCH_FORK_WIDTH - 1; k >= 0; k--) {
+                double forked = now();
+                Chip8 *child = malloc(sizeof(Chip8));
+                if (!child) {
+                    fprintf(stderr, "NOT ENOUGH MEMORY TO COPY THE MACHINE\n");
+                    exit(EXIT_FAILURE);
+                }
+                *child = *parent;
+                copy_time += now() - forked;
+
+                run_branch(child, fork_keys[k]);
+                machines[n * BENCH_FORK_WIDTH + k] = child;
+            }
+            free(parent);
+        }
+        count *= BENCH_FORK_WIDTH;
+    }
+    double copying = now() - started;
+    for (int n = 0; n < count; n++) {
+        hashes[n] = frame_hash(machines[n]);
+        free(machines[n]);
+    }
+
+    /* With forked branches */
+    double fork_time = 0;
+    count = 1;
+    started = now();
+    branches[0] = branch_create(tree, &start);
+    if (!branches[0]) {
+        fprintf(stderr, "NOT ENOUGH MEMORY TO FORK\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int depth = 0; depth < BENCH_FORK_DEPTH; depth++) {
+        for (int n = count - 1; n >= 0; n--) {
+            Branch *parent = branches[n];
+            for (int k = BENCH_FORK_WIDTH - 1; k >= 0; k--) {
+                double forked = now();
+                Branch *child = branch_fork(parent);
+                if (!child) {
+                    fprintf(stderr, "NOT ENOUGH MEMORY TO FORK\n");
+                    exit(EXIT_FAILURE);
+                }
+                fork_time += now() - forked;
+
+                run_branch(enter(child), fork_keys[k]);
+                branches[n * BENCH_FORK_WIDTH + k] = child;
+            }
+            branch_destroy(parent);
+        }
+        count *= BENCH_FORK_WIDTH;
+    }
+    double forking = now() - started;
+
+    int mismatches = 0;
+    for (int n = 0; n < count; n++) {
+        if (frame_hash(enter(branches[n])) != hashes[n])
+            mismatches++;
+    }
+
+    printf("BENCH %s %s: %d BRANCHES IN %.3f s (%.3f s COPYING THE MACHINE), "
+            "%.0f ns PER FORK (%.0f ns PER COPY), %d MISMATCHES\n",
+            DISPATCH_METHOD, filename, count, forking, copying,
+            fork_time * 1e9 / tree->forks, copy_time * 1e9 / tree->forks, mismatches);
+    fork_report(tree, stdout);
+
+    for (int n = 0; n < count; n++) {
+        branch_destroy(branches[n]);
+    }
+    fork_tree_destroy(tree);
+    free(branches);
+    free(machines);
+}
+#else
+/* Runs the ROM once for BENCH_INSTRUCTIONS instructions, pressing the keys
+ * of the input script or, without one, a different key every now and then
+ * so the games don't get stuck waiting for input. Idle loops skipped (see
+ * chip8.c) took no time, so they are taken out of the instructions. If the
+ * ROM faults, only the instructions before count */
+static void run_rom(Chip8 *chip8, const char * const filename, bool last, Samples *samples)
+{
+    init_chip8(chip8);
+    if (!load_rom(chip8, filename))
+        exit(EXIT_FAILURE);
+    chip8->rng = 1;
+#ifdef FUSION
+    if (!fusion_enable(chip8, false)) {
+        fprintf(stderr, "NOT ENOUGH MEMORY TO FUSE INSTRUCTIONS\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+#ifdef JIT
+    if (!jit_enable(chip8)) {
+        fprintf(stderr, "JIT NOT AVAILABLE\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    unsigned long done = 0;
+    int next = 0;
+    double start = now();
+    while (done < BENCH_INSTRUCTIONS && chip8->fault == FAULT_NONE) {
+        uint16_t keys = 0;
+        unsigned long until;
+
+        if (event_count < 0) {
+            keys = bench_keys(done);
+            until = (done / BENCH_KEY_PERIOD + 1) * BENCH_KEY_PERIOD;
+        } else {
+            while (next < event_count && events[next].at <= done) {
+                next++;
+            }
+            keys = next ? events[next - 1].keys : 0;
+            until = next < event_count ? events[next].at : BENCH_INSTRUCTIONS;
+        }
+        if (until > BENCH_INSTRUCTIONS)
+            until = BENCH_INSTRUCTIONS;
+
+        for (int key = 0; key < MAX_KEYPAD_KEYS; key++) {
+            chip8->key[key] = (keys >> key) & 1;
+        }
+
+        /* run_cycles() returns early on draws, key waits and timers */
+        while (done < until) {
+            unsigned long executed;
+            if (run_cycles(chip8, until - done, &executed) == RUN_FAULT)
+                break;
+            chip8->shouldDraw = false;
+            done += executed;
+        }
+    }
+    double elapsed = now() - start;
+
+    samples->seconds[samples->runs] = elapsed;
+    samples->counts[samples->runs] = done - chip8->idle_skipped;
+    samples->runs++;
+
+    if (last && chip8->fault != FAULT_NONE)
+        printf("%s: %s AT 0x%03X AFTER %lu INSTRUCTIONS\n", filename, fault_name(chip8->fault),
+                chip8->pc, done);
+#ifdef FUSION
+    if (last)
+        fusion_report(chip8, stdout);
+    fusion_disable(chip8);
+#else
+    (void)last;
+#endif
+#ifdef JIT
+    jit_disable(chip8);
+#endif
+}
+
+static void bench_rom(const char * const filename)
+{
+    static Chip8 chip8;
+    Samples samples = { .runs = 0 };
+
+    for (int i = 0; i < runs; i++) {
+        run_rom(&chip8, filename, i == runs - 1, &samples);
+    }
+    report("rom", filename, "INSTRUCTION", &samples);
+}
+
+/* A handler called with the machine in some state. x and y are the values
+ * of V0 and V1, which are the X and Y of every opcode */
+typedef struct handler_case {
+    const char *name;
+    uint16_t opcode;
+    uint8_t x;
+    uint8_t y;
+} HandlerCase;
+
+static const HandlerCase handler_cases[] = {
+    { "00E0",                      0x00E0, 3, 7 },
+    { "00EE",                      0x00EE, 3, 7 },
+    { "1NNN",                      0x1200, 3, 7 },
+    { "2NNN",                      0x2200, 3, 7 },
+    { "3XNN taken",                0x3003, 3, 7 },
+    { "3XNN not taken",            0x3004, 3, 7 },
+    { "4XNN",                      0x4003, 3, 7 },
+    { "5XY0",                      0x5010, 3, 7 },
+    { "6XNN",                      0x6042, 3, 7 },
+    { "7XNN",                      0x7001, 3, 7 },
+    { "8XY0",                      0x8010, 3, 7 },
+    { "8XY1",                      0x8011, 3, 7 },
+    { "8XY2",                      0x8012, 3, 7 },
+    { "8XY3",                      0x8013, 3, 7 },
+    { "8XY4",                      0x8014, 3, 7 },
+    { "8XY5",                      0x8015, 3, 7 },
+    { "8XY6",                      0x8016, 3, 7 },
+    { "8XY7",                      0x8017, 3, 7 },
+    { "8XYE",                      0x801E, 3, 7 },
+    { "9XY0",                      0x9010, 3, 7 },
+    { "ANNN",                      0xA300, 3, 7 },
+    { "BNNN",                      0xB200, 3, 7 },
+    { "CXNN",                      0xC0FF, 3, 7 },
+    { "DXYN 1 row",                0xD011, 0, 0 },
+    { "DXYN 5 rows",               0xD015, 8, 8 },
+    { "DXYN 5 rows unaligned",     0xD015, 13, 10 },
+    { "DXYN 15 rows unaligned",    0xD01F, 13, 10 },
+    { "DXYN 15 rows right edge",   0xD01F, 60, 10 },
+    { "DXYN 15 rows bottom edge",  0xD01F, 13, 28 },
+    { "EX9E",                      0xE09E, 3, 7 },
+    { "EXA1",                      0xE0A1, 3, 7 },
+    { "FX07",                      0xF007, 3, 7 },
+    { "FX0A",                      0xF00A, 3, 7 },
+    { "FX15",                      0xF015, 3, 7 },
+    { "FX18",                      0xF018, 3, 7 },
+    { "FX1E",                      0xF01E, 3, 7 },
+    { "FX29",                      0xF029, 3, 7 },
+    { "FX33",                      0xF033, 3, 7 },
+    { "FX55 1 register",           0xF055, 3, 7 },
+    { "FX55 8 registers",          0xF755, 3, 7 },
+    { "FX55 16 registers",         0xFF55, 3, 7 },
+    { "FX65 1 register",           0xF065, 3, 7 },
+    { "FX65 8 registers",          0xF765, 3, 7 },
+    { "FX65 16 registers",         0xFF65, 3, 7 },
+};
+
+/* Calls the handler of each case BENCH_CALLS times per run. Every call
+ * starts from the same pc, I and stack, so jumps, calls and returns can be
+ * repeated, and I points to sprites in memory. Those three stores are
+ * timed too, they are a small part of any handler */
+static void bench_handlers(void)
+{
+    static Chip8 chip8;
+
+    for (size_t c = 0; c < sizeof(handler_cases) / sizeof(*handler_cases); c++) {
+        const HandlerCase *test = &handler_cases[c];
+        const Instruction *ins = &decode_table[test->opcode];
+        Samples samples = { .runs = 0 };
+
+        for (int run = 0; run < runs; run++) {
+            init_chip8(&chip8);
+            chip8.rng = 1;
+            memset(chip8.memory + 0x300, 0xA5, 16);
+            chip8.V[0] = test->x;
+            chip8.V[1] = test->y;
+            chip8.stack[0] = 0x200;
+
+            double start = now();
+            for (unsigned long i = 0; i < BENCH_CALLS; i++) {
+                chip8.pc = 0x200;
+                chip8.I = 0x300;
+                chip8.sp = 1;
+                ins->execute(&chip8, ins);
+            }
+            samples.seconds[run] = now() - start;
+            samples.counts[run] = BENCH_CALLS;
+            samples.runs++;
+        }
+        report("opcode", test->name, "CALL", &samples);
+    }
+}
+
+/* Renders frames that alternate with another one that differs in every
+ * row, in the rows of a sprite, or not at all, which are the dirty rows
+ * after the first frame. It's what update_screen() in main.c does with a
+ * frame before handing it to SDL, which needs a window and is not timed */
+static void bench_renderer(void)
+{
+    static const struct { const char *name; int first; int rows; } changes[] = {
+        { "render every row", 0, CHIP8_DISPLAY_HEIGHT },
+        { "render a sprite", 12, 5 },
+        { "render nothing", 0, 0 },
+    };
+    static uint64_t frames[2][CHIP8_DISPLAY_HEIGHT];
+    static uint64_t shown[CHIP8_DISPLAY_HEIGHT];
+    static uint32_t pixels[CHIP8_DISPLAY_SIZE];
+
+    for (size_t c = 0; c < sizeof(changes) / sizeof(*changes); c++) {
+        Samples samples = { .runs = 0 };
+
+        for (int row = 0; row < CHIP8_DISPLAY_HEIGHT; row++) {
+            frames[0][row] = frames[1][row] = 0x0123456789ABCDEFULL * (row + 1);
+        }
+        for (int row = changes[c].first; row < changes[c].first + changes[c].rows; row++) {
+            frames[1][row] = ~frames[0][row];
+        }
+
+        const uint32_t dirty = (uint32_t)((1ULL << changes[c].rows) - 1) << changes[c].first;
+
+        for (int run = 0; run < runs; run++) {
+            memset(shown, 0, sizeof(shown));
+            double start = now();
+            for (unsigned long i = 0; i < BENCH_FRAMES; i++) {
+                int first, last;
+                if (changed_rows(frames[i & 1], shown, i == 0 ? 0xFFFFFFFF : dirty, &first, &last))
+                    expand_rows(frames[i & 1], shown, first, last, &pixels[first * CHIP8_DISPLAY_WIDTH],
+                            CHIP8_DISPLAY_WIDTH * sizeof(uint32_t), 0xFFFFFFFF, 0xFF000000);
+            }
+            samples.seconds[run] = now() - start;
+            samples.counts[run] = BENCH_FRAMES;
+            samples.runs++;
+        }
+        report("render", changes[c].name, "FRAME", &samples);
+    }
+}
+#endif
+
+static void usage(const char * const program)
+{
+    printf("Usage: %s [--runs N] [--script FILE] [--output FILE] [--micro] [<ROM FILE>...]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    bool micro = false;
+    int first = argc;
+
+    for (int i = 1; i < argc && first == argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n < 1 || n > BENCH_MAX_RUNS)
+                usage(*argv);
+            runs = n;
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            read_script(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = fopen(argv[++i], "a");
+            if (!output) {
+                fprintf(stderr, "ERROR: COULD NOT OPEN OUTPUT FILE '%s'\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            if (ftell(output) == 0)
+                fprintf(output, "build,kind,name,runs,count,per_second,per_second_stddev,ns,ns_stddev\n");
+        } else if (strcmp(argv[i], "--micro") == 0) {
+            micro = true;
+        } else if (argv[i][0] == '-') {
+            usage(*argv);
+        } else {
+            first = i;
+        }
+    }
+    if (first == argc && !micro)
+        usage(*argv);
+
+#if !defined(LOCKSTEP) && !defined(FORK)
+    if (micro) {
+        bench_handlers();
+        bench_renderer();
+    }
+#endif
+    for (int i = first; i < argc; i++) {
+        bench_rom(argv[i]);
+    }
+
+    if (output && fclose(output) != 0) {
+        fprintf(stderr, "ERROR WRITING THE OUTPUT FILE\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -4,12 +4,64 @@
 #include <time.h>
 #include "chip8.h"
 #include "opcode_functions.h"
+#ifdef JIT
+#include "jit.h"
+#endif
+#ifdef AOT
+#include "aot.h"
+#endif
+#ifdef FUSION
+#include "fusion.h"
+#endif
+#ifdef PROFILE
+#include "profile.h"
+#endif
+#ifdef TRACER
+#include "tracer.h"
+#endif
+#ifdef DEBUG
+#include "debugger.h"
+#endif
 
 #define CHIP8_FONTSET_LEN 80
 
-#define OPCODE_FAMILY(opcode) ((opcode) & (0xF000))
-#define HIGH_BYTE(chip8) (chip8->memory[chip8->pc] << 8)
-#define LOW_BYTE(chip8) (chip8->memory[chip8->pc+1])
+#define HIGH_BYTE(chip8, addr) (chip8->memory[(addr)] << 8)
+#define LOW_BYTE(chip8, addr) (chip8->memory[((addr) + 1) & (CHIP8_MEMSIZE - 1)])
+
+/* Instructions run by the dispatch of ins. More than one if ins is a fused
+ * sequence */
+#ifdef FUSION
+#define INSTRUCTIONS_RUN(chip8, ins) fusion_account(chip8, ins)
+#else
+#define INSTRUCTIONS_RUN(chip8, ins) 1
+#endif
+
+/* Hooks of the profiler (see profile.h), compiled out unless profiling */
+#ifdef PROFILE
+#define PROFILE_INSTRUCTION(chip8, ins, pc, count) profile_instruction(chip8, ins, pc, count)
+#define PROFILE_BLOCK(chip8, pc, count) profile_block(chip8, pc, count)
+#define PROFILE_SKIP(chip8, count, idle) profile_skip(chip8, count, idle)
+#define PROFILE_TICK(chip8) profile_tick(chip8)
+#else
+#define PROFILE_INSTRUCTION(chip8, ins, pc, count)
+#define PROFILE_BLOCK(chip8, pc, count)
+#define PROFILE_SKIP(chip8, count, idle)
+#define PROFILE_TICK(chip8)
+#endif
+
+/* Hook of the tracer (see tracer.h), compiled out unless tracing */
+#ifdef TRACER
+#define TRACER_RECORD(chip8, ins, pc, count, kind) tracer_record(chip8, ins, pc, count, kind)
+#else
+#define TRACER_RECORD(chip8, ins, pc, count, kind)
+#endif
+
+/* Hook of the debugger (see debugger.h), compiled out unless debugging */
+#ifdef DEBUG
+#define DEBUGGER_RELEASE(chip8) debugger_release(chip8)
+#else
+#define DEBUGGER_RELEASE(chip8)
+#endif
 
 /* Fontset of the CHIP-8 interpreter */
 static unsigned char chip8_fontset[CHIP8_FONTSET_LEN] =
@@ -32,49 +84,17 @@ static unsigned char chip8_fontset[CHIP8_FONTSET_LEN] =
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-/* Table of functions to call in the cycle. We'll call one of these
- * functions based on the "family" (the first nibble, most significant 4 bits)
- * of the upper byte of the opcode */
-void (*opcodes_table[])(Chip8 * const) =
-{
-    family_0,
-    opcode_1,
-    opcode_2,
-    opcode_3,
-    opcode_4,
-    opcode_5,
-    opcode_6,
-    opcode_7,
-    family_8,
-    opcode_9,
-    opcode_A,
-    opcode_B,
-    opcode_C,
-    opcode_D,
-    family_E,
-    family_F
-};
-
-#ifdef DEBUG
-/* Prints the registers of the Chip8 to the screen */
-static void debug_status(Chip8 *chip8)
-{
-    puts("SYSTEM STATUS:");
-    for (int i = 0; i <= 0xF; i++) {
-        if (i < 0xA) {
-            printf("V%d = %d\n", i, chip8->V[i]);
-        } else {
-            printf("V%c = %d\n", 'A' + i - 10, chip8->V[i]);
-        }
-    }
-    printf("PC = 0x%X\n", chip8->pc);
-    printf("I = 0x%X\n", chip8->I);
-    printf("SP = 0x%X\n\n", *(chip8->stack + chip8->sp));
-}
-#endif
 
 static long get_rom_size(FILE * const);
-static inline uint16_t fetch_opcode(const Chip8 * const);
+static inline uint16_t fetch_opcode(const Chip8 * const, uint16_t);
+static const Instruction *decode(Chip8 * const, uint16_t);
+static bool update_timers(Chip8 * const, int);
+static unsigned long skip_idle_loop(Chip8 * const, const Instruction * const, uint16_t, unsigned long);
+static inline bool key_pressed(const Chip8 * const);
+static RunReason wait_key(Chip8 * const, unsigned long, unsigned long *);
+#if defined(THREADED) && !defined(JIT) && !defined(AOT)
+static RunReason run_threaded(Chip8 * const, unsigned long, unsigned long *);
+#endif
 
 /* Initializes the interpreter */
 void init_chip8(Chip8 *chip8)
@@ -89,9 +109,30 @@ void init_chip8(Chip8 *chip8)
     chip8->I = 0;
     chip8->sp = 0;
     chip8->shouldDraw = false;
+#ifdef JIT
+    /* Enabled with jit_enable() once the interpreter is initialized */
+    chip8->jit = NULL;
+#endif
+#ifdef FUSION
+    /* Enabled with fusion_enable() once the interpreter is initialized */
+    chip8->fusion = NULL;
+#endif
+#ifdef PROFILE
+    /* Enabled with profile_enable() */
+    chip8->profile = NULL;
+#endif
+#ifdef TRACER
+    /* Started with tracer_start() */
+    chip8->tracer = NULL;
+#endif
+#ifdef DEBUG
+    /* Attached with debugger_attach() */
+    chip8->debugger = NULL;
+#endif
 
     /* Clear display */
     memset(chip8->gfx, 0, sizeof(chip8->gfx));
+    chip8->dirty_rows = 0xFFFFFFFF;
 
     /* Clear stack */
     for (int i = 0; i < MAX_STACK_LEVELS; i++) {
@@ -103,25 +144,71 @@ void init_chip8(Chip8 *chip8)
         chip8->V[i] = chip8->key[i] = 0;
     }
 
-    /* Clear memory  */
+    /* Clear memory. This is the memory as cleared, nothing was written yet */
     memset(chip8->memory, 0, CHIP8_MEMSIZE);
+    invalidate_instructions(chip8, 0, CHIP8_MEMSIZE);
+    chip8->written_chunks = 0;
 
     /* Load fontset */
     memcpy(chip8->memory, chip8_fontset, CHIP8_FONTSET_LEN);
 
     /* Reset timers */
     chip8->delay_timer = chip8->sound_timer = 0;
-    srand(time(NULL));
+    chip8->ips = CHIP8_DEFAULT_IPS;
+    chip8->timer_phase = 0;
+    chip8->ticks = 0;
+    chip8->idle_skipped = 0;
+    chip8->waiting_key = false;
+    chip8->fault = FAULT_NONE;
+    chip8->rng = time(NULL);
+}
+
+/* Puts chip8 back in the state of template, much faster than init_chip8()
+ * and loading the program again: template has to be a machine that chip8
+ * was copied from (or reset to) and that didn't run since. Only the chunks
+ * of memory written since then (see written_chunks, which must not have
+ * been cleared meanwhile) are copied back, and the instructions decoded
+ * from the rest are kept, as they are still the same. Whatever the machine
+ * has besides its state (the JIT, fusion...) stays as it is */
+void reset_chip8(Chip8 *chip8, const Chip8 *template)
+{
+    uint64_t written = chip8->written_chunks;
+
+    for (int chunk = 0; written; chunk++, written >>= 1) {
+        if (!(written & 1))
+            continue;
+        memcpy(&chip8->memory[chunk * CHIP8_CHUNK_SIZE], &template->memory[chunk * CHIP8_CHUNK_SIZE],
+                CHIP8_CHUNK_SIZE);
+        invalidate_instructions(chip8, chunk * CHIP8_CHUNK_SIZE, CHIP8_CHUNK_SIZE);
+    }
+
+    /* The registers, the screen, the timers... written_chunks too */
+    memcpy((uint8_t *)chip8 + CHIP8_STATE_START, (const uint8_t *)template + CHIP8_STATE_START,
+            CHIP8_STATE_SIZE);
+    chip8->opcode = template->opcode;
 }
 
-/* Loads the ROM into memory */
-void load_rom(Chip8 *chip8, const char * const filename)
+const char *fault_name(Fault fault)
+{
+    static const char * const names[] = {
+        [FAULT_NONE] = "NO FAULT",
+        [FAULT_INVALID_OPCODE] = "OPCODE NOT RECOGNIZED",
+        [FAULT_BAD_ADDRESS] = "ADDRESS OUT OF VALID RANGE",
+        [FAULT_STACK_OVERFLOW] = "STACK OVERFLOW",
+        [FAULT_STACK_UNDERFLOW] = "STACK UNDERFLOW"
+    };
+    return fault < sizeof(names) / sizeof(*names) ? names[fault] : "UNKNOWN FAULT";
+}
+
+/* Loads the ROM into memory. Returns false (after printing why) if it
+ * can't, leaving the memory as it was */
+bool load_rom(Chip8 *chip8, const char * const filename)
 {
     FILE *rom = fopen(filename, "r");
 
     if (!rom) {
         fprintf(stderr, "%s:%d:%s(): ERROR: COULD NOT OPEN ROM FILE \'%s\'.\n", __FILE__, __LINE__, __func__, filename);
-        exit(1);
+        return false;
     } else {
         printf("%s(): ROM FILE \'%s\' OPENED SUCCESFULLY\n", __func__, filename);
     }
@@ -134,52 +221,510 @@ void load_rom(Chip8 *chip8, const char * const filename)
     /* As the first 512 bytes are reserved, we only have 4096 - 512 = 3584
      * bytes for application memory. If the rom is larger than that, it
      * will not fit into memory */
-    if (rom_size > (CHIP8_MEMSIZE - 512)) {
+    if (rom_size < 0 || rom_size > (CHIP8_MEMSIZE - 512)) {
         fprintf(stderr, "%s(): ROM IS TOO BIG TO FIT INTO MEMORY (%ld bytes)\n", __func__, rom_size);
-        exit(1);
+        fclose(rom);
+        return false;
     }
 
-    /* Read the program into working memory. As we are reading chars, make
-     * sure that the amount read equals file lenght */
-    size_t bytes_read = fread(chip8->memory+0x200, sizeof(uint8_t), rom_size, rom);
+    /* Read the program. As we are reading chars, make sure that the amount
+     * read equals file lenght */
+    uint8_t program[CHIP8_MEMSIZE - 512];
+    size_t bytes_read = fread(program, sizeof(uint8_t), rom_size, rom);
 
     if (bytes_read != rom_size) {
         fprintf(stderr, "%s(): ERROR READING ROM FILE\n", __func__);
         fclose(rom);
-        exit(1);
+        return false;
     }
 
+    load_program(chip8, program, rom_size);
+
     /* Clean up */
     fclose(rom);
+    return true;
 }
 
 /* Function to emulate a cycle of the interpreter */
 void cycle(Chip8 *chip8)
 {
-    /* Fetch */
-    chip8->opcode = fetch_opcode(chip8);
+    run_cycles(chip8, 1, NULL);
+}
+
+/* Instructions that may start an idle loop (see skip_idle_loop()) */
+static const bool loop_heads[OPCODE_COUNT] = {
+    [OP_1NNN] = true, [OP_EX9E] = true, [OP_EXA1] = true, [OP_FX07] = true
+};
+
+/* Returns why run_cycles() has to stop after running ins, which started at
+ * address pc, or RUN_BUDGET if it doesn't. ins is NULL for a translated
+ * block, which never faults or waits for a key. drawing tells whether
+ * shouldDraw was already set when run_cycles() was called */
+static inline RunReason stop_reason(const Chip8 * const chip8, const Instruction * const ins,
+        uint16_t pc, bool drawing, bool timer_expired)
+{
+    if (ins && chip8->fault)
+        return RUN_FAULT;
+    if (ins && chip8->waiting_key)
+        return RUN_KEY_WAIT;
+    if (!drawing && chip8->shouldDraw)
+        return RUN_DRAW;
+    if (timer_expired)
+        return RUN_TIMER;
+    return RUN_BUDGET;
+}
+
+/* Executes up to budget instructions, stopping earlier after an instruction
+ * that draws, starts waiting for a key, faults, or makes a timer reach
+ * zero. While waiting for a key nothing is executed, see wait_key(). Once
+ * the machine faulted nothing is ever executed again, and every call
+ * returns RUN_FAULT as if it ran all of budget. A draw only
+ * stops it if shouldDraw was clear when called, so callers are expected to
+ * clear it once they draw the screen. A translated block or a fused
+ * sequence is never split, so it may run a few instructions past budget.
+ *
+ * The number of instructions executed is stored in executed (unless it's
+ * NULL), and the reason it stopped is returned. It's a batch entry point:
+ * what it saves over calling cycle() is a call and these checks per
+ * instruction, not memory traffic. pc, I and the registers stay in chip8,
+ * where the handlers read and write them. Keeping pc in a local instead,
+ * written back before calling a handler and read after it, was measured
+ * 4 to 10% slower with both the table and the threaded code, even with
+ * the hot instructions run in place. Only opcode is deferred: it's written
+ * back once, when it returns */
+RunReason run_cycles(Chip8 *chip8, unsigned long budget, unsigned long *executed)
+{
+    /* A machine that faulted doesn't run anymore, the time just passes */
+    if (chip8->fault) {
+        if (executed)
+            *executed = budget;
+        return RUN_FAULT;
+    }
+    if (chip8->waiting_key && !key_pressed(chip8))
+        return wait_key(chip8, budget, executed);
+
+#if defined(THREADED) && !defined(JIT) && !defined(AOT)
+    RunReason reason = run_threaded(chip8, budget, executed);
+#else
+    const bool drawing = chip8->shouldDraw;
+    const Instruction *ins = NULL;
+    RunReason reason = RUN_BUDGET;
+    unsigned long done = 0;
+
+    while (done < budget) {
+        uint16_t pc = chip8->pc;
+
+        /* Fetch and decode. Both are skipped if the instruction at this
+         * address was already decoded. Idle loops are looked for before
+         * translated blocks, which would run every iteration */
+        ins = decode(chip8, pc);
+
+        if (loop_heads[ins->op]) {
+            unsigned long skipped = skip_idle_loop(chip8, ins, pc, budget - done);
+            if (skipped > 0) {
+                PROFILE_SKIP(chip8, skipped, true);
+                TRACER_RECORD(chip8, ins, pc, skipped, TRACE_IDLE);
+                done += skipped;
+                reason = stop_reason(chip8, NULL, pc, drawing, update_timers(chip8, skipped));
+                if (reason != RUN_BUDGET)
+                    break;
+                continue;
+            }
+        }
+
+#if defined(JIT) || defined(AOT)
+        /* Run a whole translated block if there is one at pc */
+#ifdef JIT
+        int block = jit_execute(chip8);
+#else
+        int block = aot_execute(chip8);
+#endif
+        if (block > 0) {
+            PROFILE_BLOCK(chip8, pc, block);
+            TRACER_RECORD(chip8, NULL, pc, block, TRACE_BLOCK);
+            done += block;
+            reason = stop_reason(chip8, NULL, pc, drawing, update_timers(chip8, block));
+            if (reason != RUN_BUDGET)
+                break;
+            continue;
+        }
+#endif
+
+        /* Execute */
+        ins->execute(chip8, ins);
+
+        int count = INSTRUCTIONS_RUN(chip8, ins);
+        PROFILE_INSTRUCTION(chip8, ins, pc, count);
+        TRACER_RECORD(chip8, ins, pc, count, TRACE_EXECUTED);
+        done += count;
+        reason = stop_reason(chip8, ins, pc, drawing, update_timers(chip8, count));
+        if (reason != RUN_BUDGET)
+            break;
+    }
+
+    if (ins)
+        chip8->opcode = ins->opcode;
+    if (executed)
+        *executed = done;
+#endif
+
+    /* Now that none of its entries is running */
+    DEBUGGER_RELEASE(chip8);
+    return reason;
+}
+
+#if defined(THREADED) && !defined(JIT) && !defined(AOT)
+/* run_cycles() for the threaded interpreter. Instead of going back to a
+ * loop that calls the function of every instruction through a pointer,
+ * the code of each instruction jumps directly to the code of the next one
+ * ("threaded" code, using the labels as values extension of GCC). This way
+ * every instruction has its own indirect jump, which the CPU predicts much
+ * better than a single one shared by all of them. The most common
+ * instructions, which only change registers, jump and skip, are run in
+ * place instead of calling their handlers */
+static RunReason run_threaded(Chip8 * const chip8, unsigned long budget, unsigned long *executed)
+{
+    static void * const labels[OPCODE_COUNT] = {
+        [OP_INVALID] = &&op_invalid,
+        [OP_00E0] = &&op_00E0, [OP_00EE] = &&op_00EE,
+        [OP_1NNN] = &&op_1NNN, [OP_2NNN] = &&op_2NNN, [OP_3XNN] = &&op_3XNN,
+        [OP_4XNN] = &&op_4XNN, [OP_5XY0] = &&op_5XY0, [OP_6XNN] = &&op_6XNN,
+        [OP_7XNN] = &&op_7XNN,
+        [OP_8XY0] = &&op_8XY0, [OP_8XY1] = &&op_8XY1, [OP_8XY2] = &&op_8XY2,
+        [OP_8XY3] = &&op_8XY3, [OP_8XY4] = &&op_8XY4, [OP_8XY5] = &&op_8XY5,
+        [OP_8XY6] = &&op_8XY6, [OP_8XY7] = &&op_8XY7, [OP_8XYE] = &&op_8XYE,
+        [OP_9XY0] = &&op_9XY0, [OP_ANNN] = &&op_ANNN, [OP_BNNN] = &&op_BNNN,
+        [OP_CXNN] = &&op_CXNN, [OP_DXYN] = &&op_DXYN,
+        [OP_EX9E] = &&op_EX9E, [OP_EXA1] = &&op_EXA1,
+        [OP_FX07] = &&op_FX07, [OP_FX0A] = &&op_FX0A, [OP_FX15] = &&op_FX15,
+        [OP_FX18] = &&op_FX18, [OP_FX1E] = &&op_FX1E, [OP_FX29] = &&op_FX29,
+        [OP_FX33] = &&op_FX33, [OP_FX55] = &&op_FX55, [OP_FX65] = &&op_FX65,
+        [OP_FUSED] = &&op_fused, [OP_DEBUG] = &&op_debug
+    };
+    const bool drawing = chip8->shouldDraw;
+    const Instruction *ins = NULL;
+    RunReason reason = RUN_BUDGET;
+    unsigned long done = 0, skipped;
+    uint16_t pc;
+    int count;
+
+/* Fetches and decodes the next instruction and jumps to its code */
+#define DISPATCH()                                  \
+    do {                                            \
+        if (done >= budget)                         \
+            goto out;                               \
+        pc = chip8->pc;                             \
+        ins = decode(chip8, pc);                    \
+        if (loop_heads[ins->op])                    \
+            goto idle;                              \
+        goto *labels[ins->op];                      \
+    } while (0)
+
+/* Executes the current instruction with its handler and dispatches the
+ * next one */
+#define EXECUTE(function)                           \
+    function(chip8, ins);                           \
+    NEXT()
+
+/* Executes in place an instruction that only changes registers (see
+ * exec_6() and the rest in opcode_functions.h) */
+#define INLINE(body)                                \
+    body(chip8, ins);                               \
+    chip8->pc = pc + 2;                             \
+    NEXT()
 
-    /* Decode */
-    uint8_t family = OPCODE_FAMILY(chip8->opcode) >> 12;
+/* Executes a skip in place */
+#define SKIP(skips)                                 \
+    if (skips(chip8, ins))                          \
+        chip8->pc = pc + 4;                         \
+    else                                            \
+        chip8->pc = pc + 2;                         \
+    NEXT()
 
-    /* Execute */
-    opcodes_table[family](chip8);
+/* Accounts for the current instruction, which was just executed, and
+ * dispatches the next one */
+#define NEXT()                                      \
+    count = INSTRUCTIONS_RUN(chip8, ins);           \
+    PROFILE_INSTRUCTION(chip8, ins, pc, count);     \
+    TRACER_RECORD(chip8, ins, pc, count, TRACE_EXECUTED); \
+    done += count;                                  \
+    reason = stop_reason(chip8, ins, pc, drawing, update_timers(chip8, count)); \
+    if (reason != RUN_BUDGET)                       \
+        goto out;                                   \
+    DISPATCH()
+
+    DISPATCH();
+
+idle:
+    skipped = skip_idle_loop(chip8, ins, pc, budget - done);
+    if (skipped > 0) {
+        PROFILE_SKIP(chip8, skipped, true);
+        TRACER_RECORD(chip8, ins, pc, skipped, TRACE_IDLE);
+        done += skipped;
+        reason = stop_reason(chip8, NULL, pc, drawing, update_timers(chip8, skipped));
+        if (reason != RUN_BUDGET)
+            goto out;
+        DISPATCH();
+    }
+    goto *labels[ins->op];
+
+op_invalid: EXECUTE(opcode_invalid);
+op_00E0:    EXECUTE(opcode_00E0);
+op_00EE:    EXECUTE(opcode_00EE);
+op_1NNN:    if (!valid_target(ins)) {
+                EXECUTE(opcode_1);      /* Which faults */
+            }
+            chip8->pc = ins->nnn;
+            NEXT();
+op_2NNN:    EXECUTE(opcode_2);
+op_3XNN:    SKIP(skips_3);
+op_4XNN:    SKIP(skips_4);
+op_5XY0:    SKIP(skips_5);
+op_6XNN:    INLINE(exec_6);
+op_7XNN:    INLINE(exec_7);
+op_8XY0:    INLINE(exec_8XY0);
+op_8XY1:    INLINE(exec_8XY1);
+op_8XY2:    INLINE(exec_8XY2);
+op_8XY3:    INLINE(exec_8XY3);
+op_8XY4:    INLINE(exec_8XY4);
+op_8XY5:    INLINE(exec_8XY5);
+op_8XY6:    INLINE(exec_8XY6);
+op_8XY7:    INLINE(exec_8XY7);
+op_8XYE:    INLINE(exec_8XYE);
+op_9XY0:    SKIP(skips_9);
+op_ANNN:    INLINE(exec_A);
+op_BNNN:    EXECUTE(opcode_B);
+op_CXNN:    EXECUTE(opcode_C);
+op_DXYN:    EXECUTE(opcode_D);
+op_EX9E:    EXECUTE(opcode_EX9E);
+op_EXA1:    EXECUTE(opcode_EXA1);
+op_FX07:    EXECUTE(opcode_FX07);
+op_FX0A:    EXECUTE(opcode_FX0A);
+op_FX15:    EXECUTE(opcode_FX15);
+op_FX18:    EXECUTE(opcode_FX18);
+op_FX1E:    EXECUTE(opcode_FX1E);
+op_FX29:    EXECUTE(opcode_FX29);
+op_FX33:    EXECUTE(opcode_FX33);
+op_FX55:    EXECUTE(opcode_FX55);
+op_FX65:    EXECUTE(opcode_FX65);
+op_fused:   EXECUTE(ins->execute);
+op_debug:   EXECUTE(ins->execute);
+
+out:
+    if (ins)
+        chip8->opcode = ins->opcode;
+    if (executed)
+        *executed = done;
+    return reason;
+
+#undef DISPATCH
+#undef EXECUTE
+#undef INLINE
+#undef SKIP
+#undef NEXT
+}
+#endif
+
+/* Updates timers after executing the given number of instructions. They
+ * count down at 60 Hz of emulated time, which is measured in instructions:
+ * ips of them are a second, so there is a tick every ips / 60 instructions
+ * (the remainder is carried in timer_phase, so the rate is exact on
+ * average). Returns true if one of them reached zero */
+static bool update_timers(Chip8 * const chip8, int executed)
+{
+    bool expired = false;
 
+    chip8->timer_phase += executed * CHIP8_TIMER_HZ;
+    while (chip8->timer_phase >= chip8->ips) {
+        chip8->timer_phase -= chip8->ips;
+        chip8->ticks++;
+        PROFILE_TICK(chip8);
+
+        if (chip8->delay_timer > 0 && --chip8->delay_timer == 0)
+            expired = true;
+
+        /* Makes sound while it's not zero */
+        if (chip8->sound_timer > 0 && --chip8->sound_timer == 0)
+            expired = true;
+    }
+
+    return expired;
+}
+
+static inline bool key_pressed(const Chip8 * const chip8)
+{
+    for (int i = 0; i < MAX_KEYPAD_KEYS; i++) {
+        if (chip8->key[i] != 0)
+            return true;
+    }
+    return false;
+}
+
+/* Called by run_cycles() while the machine waits for a key (FX0A) and none
+ * is pressed (once there is one, FX0A runs again and takes it). No
+ * instruction is executed: the time of budget instructions just passes for
+ * the timers, stopping earlier when one of them expires. Returns
+ * RUN_KEY_WAIT (or RUN_TIMER), so the caller can block until the keys
+ * change */
+static RunReason wait_key(Chip8 * const chip8, unsigned long budget, unsigned long *executed)
+{
+    /* Timers tick every ips / 60 instructions. Pass the time up to each
+     * tick, as a timer may expire on it */
+    unsigned long done = 0;
+    RunReason reason = RUN_KEY_WAIT;
+    while (done < budget && reason == RUN_KEY_WAIT) {
+        unsigned long step = (chip8->ips - chip8->timer_phase + CHIP8_TIMER_HZ - 1) / CHIP8_TIMER_HZ;
+        if (step > budget - done)
+            step = budget - done;
+        done += step;
+        PROFILE_SKIP(chip8, step, false);
+        TRACER_RECORD(chip8, NULL, chip8->pc, step, TRACE_WAIT);
+        if (update_timers(chip8, step))
+            reason = RUN_TIMER;
+    }
+
+    if (executed)
+        *executed = done;
+    return reason;
+}
+
+#define IDLE_MAX_SKIP (1UL << 20)    /* Most instructions skipped at once */
+
+/* Timer ticks in the next count instructions */
+static inline unsigned long ticks_in(const Chip8 * const chip8, unsigned long count)
+{
+    return (chip8->timer_phase + (uint64_t)count * CHIP8_TIMER_HZ) / chip8->ips;
+}
+
+/* Instructions until the tick on which a timer reaches zero, which is when
+ * run_cycles() has to stop (see update_timers()), or limit if it's later */
+static inline unsigned long until_expired(const Chip8 * const chip8, unsigned long limit)
+{
+    unsigned ticks = chip8->delay_timer;
+
+    if (chip8->sound_timer > 0 && (ticks == 0 || chip8->sound_timer < ticks))
+        ticks = chip8->sound_timer;
+    if (ticks == 0)
+        return limit;
+
+    uint64_t until = ((uint64_t)ticks * chip8->ips - chip8->timer_phase + CHIP8_TIMER_HZ - 1) / CHIP8_TIMER_HZ;
+    return until < limit ? until : limit;
+}
+
+/* Many programs wait in a loop that does nothing but poll the delay timer
+ * or the keys:
+ *
+ *     FX07, 3XNN (or 4XNN), 1NNN back to FX07    until the timer is NN
+ *     EX9E (or EXA1), 1NNN back to it            until a key is pressed
+ *     1NNN to itself                             forever
+ *
+ * Called with the instruction head about to be run at pc. If it starts
+ * one of these loops, runs at once the iterations that would not leave it,
+ * up to limit instructions: the keys don't change while run_cycles() runs,
+ * and the timer only changes on ticks, which are known in advance. The
+ * only thing those iterations change is VX (the timers are updated by the
+ * caller, as if they were executed), so the program can't tell. Returns
+ * the number of instructions skipped, 0 if this is not an idle loop or it
+ * is about to leave it */
+static unsigned long skip_idle_loop(Chip8 * const chip8, const Instruction * const head,
+        uint16_t pc, unsigned long limit)
+{
+    unsigned long iterations, length;
+
+    if (limit > IDLE_MAX_SKIP)
+        limit = IDLE_MAX_SKIP;
+
+    /* Skipping past a timer expiring would stop run_cycles() later than
+     * executing the loop does */
+    limit = until_expired(chip8, limit);
+    if (pc < 0x200 || pc + 5 >= CHIP8_MEMSIZE)
+        return 0;
 #ifdef DEBUG
-    printf("OPCODE 0x%04X\n", chip8->opcode);
-    debug_status(chip8);
+    if (!debugger_skips_idle(chip8))
+        return 0;
 #endif
 
-    /* Updates timers */
-    if (chip8->delay_timer > 0)
-        --chip8->delay_timer;
+    const Instruction *next = &decode_table[fetch_opcode(chip8, pc + 2)];
+
+    switch (head->op) {
+        case OP_1NNN:
+            if (head->nnn != pc)
+                return 0;
+            length = 1;
+            iterations = limit;
+            break;
+
+        case OP_EX9E:
+        case OP_EXA1:
+            if (next->op != OP_1NNN || next->nnn != pc || chip8->V[head->x] >= MAX_KEYPAD_KEYS)
+                return 0;
+            /* EX9E leaves the loop if the key is pressed, EXA1 if not */
+            if ((chip8->key[chip8->V[head->x]] != 0) == (head->op == OP_EX9E))
+                return 0;
+            length = 2;
+            iterations = limit / length;
+            break;
+
+        case OP_FX07: {
+            const Instruction *jump = &decode_table[fetch_opcode(chip8, pc + 4)];
+            if ((next->op != OP_3XNN && next->op != OP_4XNN) || next->x != head->x ||
+                    jump->op != OP_1NNN || jump->nnn != pc)
+                return 0;
 
-    if (chip8->sound_timer > 0) {
-        if (chip8->sound_timer == 1) {
-            /* Makes sound */
-            --chip8->sound_timer;
+            /* 3XNN leaves the loop if the timer is NN, 4XNN if it's not */
+            const bool leave_if_equal = next->op == OP_3XNN;
+            const uint8_t delay = chip8->delay_timer;
+            if ((delay == next->nn) == leave_if_equal)
+                return 0;
+
+            length = 3;
+            iterations = limit / length;
+
+            /* Unless it waits forever, find the first iteration that reads
+             * a value of the timer that leaves the loop, one tick later
+             * (4XNN) or when it gets down to NN (3XNN) */
+            unsigned long ticks = leave_if_equal ? delay - next->nn : 1;
+            if ((leave_if_equal && next->nn < delay) || (!leave_if_equal && delay > 0)) {
+                uint64_t until_tick = ((uint64_t)ticks * chip8->ips - chip8->timer_phase +
+                        CHIP8_TIMER_HZ - 1) / CHIP8_TIMER_HZ;
+                unsigned long leaving = (until_tick + length - 1) / length;
+
+                /* With very few instructions per second there may be more
+                 * than one tick per iteration, and the value may be missed */
+                if (leave_if_equal && delay - ticks_in(chip8, leaving * length) != next->nn)
+                    return 0;
+                if (leaving < iterations)
+                    iterations = leaving;
+            }
+            if (iterations == 0)
+                return 0;
+
+            /* VX keeps the value read by the last iteration skipped */
+            unsigned long elapsed = ticks_in(chip8, (iterations - 1) * length);
+            chip8->V[head->x] = elapsed < delay ? delay - elapsed : 0;
+            break;
         }
+
+        default:
+            return 0;
     }
+
+    chip8->idle_skipped += iterations * length;
+    return iterations * length;
+}
+
+/* Copies a program already in memory (size bytes) to the memory of the
+ * machine, at 0x200. Returns false, and copies nothing, if it doesn't fit */
+bool load_program(Chip8 *chip8, const uint8_t *program, size_t size)
+{
+    if (size > CHIP8_MEMSIZE - 512)
+        return false;
+
+    memcpy(chip8->memory + 0x200, program, size);
+
+    /* The program replaced whatever was decoded before */
+    invalidate_instructions(chip8, 0x200, size);
+    return true;
 }
 
 /* Gets the size (in bytes) of the rom file */
@@ -191,10 +736,123 @@ static long get_rom_size(FILE * const rom)
     return file_size;
 }
 
-/* Returns the next opcode of the program */
-static inline uint16_t fetch_opcode(const Chip8 * const chip8)
+/* Marks the instructions that overlap memory[addr] to memory[addr + len - 1]
+ * as not decoded, and the chunks of memory they are in as written. Must be
+ * called after every write to memory, so self modifying programs don't
+ * execute stale instructions */
+void invalidate_instructions(Chip8 *chip8, uint16_t addr, uint16_t len)
+{
+    /* The instruction that starts one byte before addr uses memory[addr]
+     * as its low byte. With fusion, so does the last instruction of a
+     * sequence of three that starts five bytes before */
+#ifdef FUSION
+    int first = (int)addr - 5;
+#else
+    int first = (int)addr - 1;
+#endif
+    int last = (int)addr + len - 1;
+
+    if (first < 0)
+        first = 0;
+    if (last >= CHIP8_MEMSIZE)
+        last = CHIP8_MEMSIZE - 1;
+
+    for (int i = first; i <= last; i++) {
+        chip8->icache[i] = NULL;
+    }
+
+    /* Whatever writes to memory invalidates what it wrote. Translated
+     * blocks are tracked by byte, so only the bytes written matter */
+    if (len > 0 && addr < CHIP8_MEMSIZE) {
+        for (int chunk = addr / CHIP8_CHUNK_SIZE; chunk <= last / CHIP8_CHUNK_SIZE; chunk++) {
+            chip8->written_chunks |= 1ULL << chunk;
+        }
+#ifdef JIT
+        jit_invalidate(chip8, addr, last);
+#endif
+    }
+}
+
+/* Writes the pixels of a row of the screen (bits, as stored in gfx) to
+ * pixels, one per element, as on if they are set or off if not */
+void expand_row(uint64_t bits, uint32_t *pixels, uint32_t on, uint32_t off)
+{
+    /* Without branches, so the compiler can do several pixels at once */
+    for (int x = 0; x < CHIP8_DISPLAY_WIDTH; x++) {
+        uint32_t set = -(uint32_t)((bits >> (CHIP8_DISPLAY_WIDTH - 1 - x)) & 1);
+        pixels[x] = (on & set) | (off & ~set);
+    }
+}
+
+/* Finds the rows of gfx that differ from shown, the screen last shown.
+ * Only the dirty ones (bit n is row n, see dirty_rows) are compared, as the
+ * rest can't have changed. Returns false if none does, or stores the first
+ * and the last that do in first and last */
+bool changed_rows(const uint64_t *gfx, const uint64_t *shown, uint32_t dirty, int *first, int *last)
+{
+    if (dirty == 0)
+        return false;
+
+    *first = 0;
+    while (!(dirty >> *first & 1) || gfx[*first] == shown[*first]) {
+        if (++*first == CHIP8_DISPLAY_HEIGHT)
+            return false;
+    }
+
+    *last = CHIP8_DISPLAY_HEIGHT - 1;
+    while (!(dirty >> *last & 1) || gfx[*last] == shown[*last])
+        (*last)--;
+    return true;
+}
+
+/* Writes rows first to last of gfx to pixels, which holds row first on,
+ * pitch bytes apart, with expand_row(). They are copied to shown too */
+void expand_rows(const uint64_t *gfx, uint64_t *shown, int first, int last,
+        void *pixels, int pitch, uint32_t on, uint32_t off)
+{
+    for (int row = first; row <= last; row++) {
+        expand_row(gfx[row], (uint32_t *)((uint8_t *)pixels + (row - first) * pitch), on, off);
+        shown[row] = gfx[row];
+    }
+}
+
+/* Returns a hash of the contents of the screen, so frames can be told
+ * apart without comparing them */
+uint64_t frame_hash(const Chip8 *chip8)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (int row = 0; row < CHIP8_DISPLAY_HEIGHT; row++) {
+        hash = (hash ^ chip8->gfx[row]) * 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/* Returns the opcode stored at address addr */
+static inline uint16_t fetch_opcode(const Chip8 * const chip8, uint16_t addr)
 {
     /* Get the first byte, move it to the left to make room for the second one
      * and OR them to form a short */
-    return HIGH_BYTE(chip8) | LOW_BYTE(chip8);
+    return HIGH_BYTE(chip8, addr) | LOW_BYTE(chip8, addr);
+}
+
+/* Returns the instruction at address addr, decoding it first if it's not
+ * in the cache. Every opcode is already decoded in decode_table (generated
+ * when building), so decoding is just looking it up */
+static const Instruction *decode(Chip8 * const chip8, uint16_t addr)
+{
+    const Instruction **ins = &chip8->icache[addr & (CHIP8_MEMSIZE - 1)];
+
+    if (!*ins) {
+        *ins = &decode_table[fetch_opcode(chip8, addr & (CHIP8_MEMSIZE - 1))];
+#ifdef FUSION
+        *ins = fuse(chip8, addr & (CHIP8_MEMSIZE - 1), *ins);
+#endif
+#ifdef DEBUG
+        *ins = debugger_patch(chip8, addr & (CHIP8_MEMSIZE - 1), *ins);
+#endif
+    }
+
+    return *ins;
 }
@@ -2,6 +2,7 @@
 #define _CHIP8_HEADER_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define CHIP8_DISPLAY_WIDTH  64
@@ -11,6 +12,31 @@
 #define REGISTERS            16
 #define MAX_STACK_LEVELS     16
 #define MAX_KEYPAD_KEYS      16
+#define CHIP8_TIMER_HZ       60      /* Rate at which the timers count down */
+#define CHIP8_DEFAULT_IPS    700     /* Instructions per second */
+#define CHIP8_CHUNK_SIZE     (CHIP8_MEMSIZE / 64) /* Memory writes are tracked by chunks of this size */
+
+/* Whether the pixel at (x, y) is set. The leftmost pixel of a row is the
+ * most significant bit of its word */
+#define CHIP8_PIXEL(chip8, x, y) (((chip8)->gfx[(y)] >> (CHIP8_DISPLAY_WIDTH - 1 - (x))) & 1)
+
+struct chip8;
+
+/* A predecoded instruction: the handler and the operands of an opcode. There
+ * is one for every possible opcode in decode_table (see gen_decode_table.c),
+ * and the interpreter keeps a pointer to the one of each address, so it
+ * doesn't have to fetch and decode the same bytes every time it executes
+ * them */
+typedef struct instruction {
+	void (*execute)(struct chip8 * const, const struct instruction * const);
+	uint16_t opcode;                   /* The raw opcode */
+	uint16_t nnn;                      /* Lowest 12 bits (address) */
+	uint8_t  x;                        /* Lower 4 bits of the high byte */
+	uint8_t  y;                        /* Upper 4 bits of the low byte */
+	uint8_t  n;                        /* Lowest 4 bits */
+	uint8_t  nn;                       /* Lowest 8 bits */
+	uint8_t  op;                       /* OP_* index (see opcode_functions.h) */
+} Instruction;
 
 typedef struct chip8 {
 	uint16_t opcode;                   /* The current opcode */
@@ -18,17 +44,86 @@ typedef struct chip8 {
 	uint8_t  V[REGISTERS];             /* The V registers (V0-VF) */
 	uint16_t I;                        /* I register (Address register). 16 bits wide */
 	uint16_t pc;			 /* Program counter */
-	uint8_t  gfx[CHIP8_DISPLAY_SIZE];  /* Graphics */
+	uint64_t gfx[CHIP8_DISPLAY_HEIGHT]; /* Graphics. One bit per pixel, a word per row (see CHIP8_PIXEL) */
 	uint8_t  delay_timer;
 	uint8_t  sound_timer;
+	uint32_t ips;                      /* Instructions per second. The timers tick every ips / 60 instructions */
+	uint32_t timer_phase;              /* Instructions since the last tick, times 60 */
+	unsigned long ticks;               /* Timer ticks since the start (emulated time, in 1/60 s) */
+	unsigned long idle_skipped;        /* Instructions of idle loops not executed (see chip8.c) */
 	uint16_t stack[MAX_STACK_LEVELS];  /* Stack. We support maximum 16 levels of nesting */
 	uint16_t sp;                       /* Stack pointer. Points to the next FREE frame of the stack */
 	uint8_t  key[MAX_KEYPAD_KEYS];     /* Keypad */
 	bool shouldDraw;                         /* To indicate wether we have to redraw the screen or not */
+	bool waiting_key;                  /* Stopped at FX0A (pc points to it) until a key is pressed */
+	uint8_t  fault;                    /* Why it stopped for good (pc points to the culprit). FAULT_NONE while it runs */
+	uint32_t dirty_rows;               /* Rows changed since the screen was drawn. Bit n is row n */
+	uint64_t written_chunks;           /* Chunks of memory changed since cleared. Bit n is chunk n (see fork.c) */
+	uint32_t rng;                      /* State of the random number generator (CXNN). Seeded from the time */
+	/* reset_chip8() and fork.c copy everything from V to here at once (see CHIP8_STATE_START) */
+	const Instruction *icache[CHIP8_MEMSIZE]; /* Predecoded instructions, indexed by address. NULL if not decoded yet */
+#ifdef JIT
+	struct jit *jit;                   /* Translated blocks. NULL if the JIT is disabled */
+#endif
+#ifdef FUSION
+	struct fusion *fusion;             /* Fused instructions. NULL if fusion is disabled */
+#endif
+#ifdef PROFILE
+	struct profile *profile;           /* Execution counts. NULL if not profiling */
+#endif
+#ifdef TRACER
+	struct tracer *tracer;             /* Where executed instructions are traced. NULL if not tracing */
+#endif
+#ifdef DEBUG
+	struct debugger *debugger;         /* Breakpoints and watchpoints. NULL if not debugging */
+#endif
 } Chip8;
 
+/* The state of a machine that is copied as a whole: the registers, the
+ * screen, the timers... From V up to icache */
+#define CHIP8_STATE_START offsetof(Chip8, V)
+#define CHIP8_STATE_SIZE  (offsetof(Chip8, icache) - CHIP8_STATE_START)
+
+/* Why run_cycles() returned */
+typedef enum run_reason {
+	RUN_BUDGET,                        /* Executed all the instructions it was asked for */
+	RUN_DRAW,                          /* The last instruction changed the screen */
+	RUN_KEY_WAIT,                      /* Waiting for a key press (FX0A) */
+	RUN_TIMER,                         /* A timer reached zero on a tick */
+	RUN_FAULT                          /* The machine faulted (see Fault), now or before */
+} RunReason;
+
+/* What stops a machine for good: an instruction that can't be run */
+typedef enum fault {
+	FAULT_NONE,
+	FAULT_INVALID_OPCODE,              /* Not part of the instruction set */
+	FAULT_BAD_ADDRESS,                 /* Jump or call below 0x200 */
+	FAULT_STACK_OVERFLOW,              /* Call with MAX_STACK_LEVELS levels of nesting */
+	FAULT_STACK_UNDERFLOW              /* Return outside of any subroutine */
+} Fault;
+
+extern const Instruction decode_table[65536];
+
+/* Returns the next random byte of the machine. Each machine has its own
+ * generator, so several can run at once, and setting rng after
+ * init_chip8() makes a run repeatable */
+static inline uint8_t chip8_random(struct chip8 *chip8)
+{
+    chip8->rng = chip8->rng * 1664525u + 1013904223u;
+    return chip8->rng >> 24;
+}
+
 void init_chip8(Chip8 *);
-void load_rom(Chip8 *, const char * const);
+void reset_chip8(Chip8 *, const Chip8 *);
+bool load_rom(Chip8 *, const char * const);
+bool load_program(Chip8 *, const uint8_t *, size_t);
 void cycle(Chip8 *);
+RunReason run_cycles(Chip8 *, unsigned long, unsigned long *);
+void invalidate_instructions(Chip8 *, uint16_t, uint16_t);
+void expand_row(uint64_t, uint32_t *, uint32_t, uint32_t);
+bool changed_rows(const uint64_t *, const uint64_t *, uint32_t, int *, int *);
+void expand_rows(const uint64_t *, uint64_t *, int, int, void *, int, uint32_t, uint32_t);
+uint64_t frame_hash(const Chip8 *);
+const char *fault_name(Fault);
 
 #endif /* _CHIP8_HEADER_ */
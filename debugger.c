@@ -0,0 +1,396 @@
+/* A debugger for the interpreter, driven by commands read from a stream
+ * (stdin in the debug build): breakpoints, watchpoints on writes to
+ * memory and registers, stepping and inspecting the machine.
+ *
+ * It doesn't check anything between instructions. Instead, like fusion
+ * does for sequences, it hooks the decoder (see debugger_patch()): the
+ * addresses it has to look at get a dispatch entry of their own, OP_DEBUG,
+ * which stops if needed, executes the instruction and checks whether it
+ * wrote something watched. Those are the addresses with a breakpoint, the
+ * instructions that can write a watched register or watched memory (only
+ * FX33 and FX55 write memory), and all of them while stepping. Every
+ * other address keeps its usual entry, so with nothing set the
+ * interpreter runs at full speed. Whenever that changes, the instruction
+ * cache is emptied so every address is decoded (and patched) again.
+ *
+ * Idle loops are not skipped while something is set, as their iterations
+ * would not go through the dispatch, and fused sequences are split back
+ * into their instructions. The instructions of translated blocks don't go
+ * through it either, so the debugger is built without JIT (make debug) */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "debugger.h"
+#include "disasm.h"
+#include "opcode_functions.h"
+
+#define DEFAULT_MEMORY_BYTES  64
+#define DEFAULT_LIST_LENGTH   8
+
+static void debugger_execute(Chip8 * const, const Instruction * const);
+
+/* Starts debugging chip8, reading commands from in and writing to out. It
+ * stops before running the next instruction. Returns false if there is no
+ * memory for it */
+bool debugger_attach(Chip8 *chip8, FILE *in, FILE *out)
+{
+    if (!chip8->debugger) {
+        chip8->debugger = calloc(1, sizeof(Debugger));
+        if (!chip8->debugger)
+            return false;
+    }
+
+    chip8->debugger->in = in;
+    chip8->debugger->out = out;
+    debugger_interrupt(chip8);
+    return true;
+}
+
+/* Decodes every address again, patching the ones the debugger looks at */
+static void repatch(Chip8 *chip8)
+{
+    memset(chip8->icache, 0, sizeof(chip8->icache));
+}
+
+/* Stops debugging chip8, forgetting breakpoints and watchpoints */
+void debugger_detach(Chip8 *chip8)
+{
+    free(chip8->debugger);
+    chip8->debugger = NULL;
+    repatch(chip8);
+}
+
+/* Frees the debugger if it ran out of commands. Called by run_cycles()
+ * before it returns, when none of its entries is running */
+void debugger_release(Chip8 *chip8)
+{
+    if (chip8->debugger && chip8->debugger->detached)
+        debugger_detach(chip8);
+}
+
+/* Makes chip8 stop before the next instruction */
+void debugger_interrupt(Chip8 *chip8)
+{
+    if (!chip8->debugger || chip8->debugger->detached)
+        return;
+
+    chip8->debugger->steps = 1;
+    repatch(chip8);
+}
+
+/* Whether there is a step, breakpoint or watchpoint set */
+static bool anything_set(const Debugger *debugger)
+{
+    return debugger->steps > 0 || debugger->breakpoint_count > 0 ||
+        debugger->watched_bytes > 0 || debugger->watched_registers != 0;
+}
+
+/* Whether run_cycles() may skip the iterations of idle loops, which it
+ * can't if the debugger has to see any instruction */
+bool debugger_skips_idle(const Chip8 *chip8)
+{
+    return !chip8->debugger || !anything_set(chip8->debugger);
+}
+
+/* Registers ins writes, bit n for Vn */
+static uint16_t registers_written(const Instruction *ins)
+{
+    switch (ins->op) {
+        case OP_6XNN: case OP_7XNN: case OP_8XY0: case OP_8XY1: case OP_8XY2: case OP_8XY3:
+        case OP_CXNN: case OP_FX07: case OP_FX0A:
+            return 1 << ins->x;
+        case OP_8XY4: case OP_8XY5: case OP_8XY7:
+            return 1 << ins->x | 1 << 0xF;
+        /* The shifts write VY too */
+        case OP_8XY6: case OP_8XYE:
+            return 1 << ins->x | 1 << ins->y | 1 << 0xF;
+        case OP_DXYN: case OP_FX1E:
+            return 1 << 0xF;
+        case OP_FX65:
+            return (2 << ins->x) - 1;
+        default:
+            return 0;
+    }
+}
+
+/* Memory ins writes, from I */
+static int bytes_written(const Instruction *ins)
+{
+    switch (ins->op) {
+        case OP_FX33: return 3;
+        case OP_FX55: return ins->x + 1;
+        default:      return 0;
+    }
+}
+
+/* Called by the decoder with the instruction it decoded at addr. Returns
+ * the entry of the debugger for it if it has to look at it, or ins if
+ * not. While anything is set, a fused sequence (see fusion.c) is split
+ * back into its instructions, as it would hide all but the first */
+const Instruction *debugger_patch(Chip8 *chip8, uint16_t addr, const Instruction *ins)
+{
+    Debugger * const debugger = chip8->debugger;
+
+    if (!debugger || !anything_set(debugger))
+        return ins;
+
+    const Instruction * const original = &decode_table[ins->opcode];
+    if (debugger->steps == 0 && !debugger->breakpoints[addr] &&
+            !(registers_written(original) & debugger->watched_registers) &&
+            !(debugger->watched_bytes > 0 && bytes_written(original) > 0))
+        return original;
+
+    Instruction * const patched = &debugger->patched[addr];
+    *patched = *original;
+    patched->execute = debugger_execute;
+    patched->op = OP_DEBUG;
+    return patched;
+}
+
+static void print_instruction(const Chip8 *chip8, FILE *out, uint16_t addr)
+{
+    uint16_t opcode = chip8->memory[addr] << 8 | chip8->memory[(addr + 1) & (CHIP8_MEMSIZE - 1)];
+    char text[32];
+
+    disassemble(opcode, text, sizeof(text));
+    fprintf(out, "%c%c 0x%03X: %04X  %s\n", addr == chip8->pc ? '>' : ' ',
+            chip8->debugger->breakpoints[addr] ? '*' : ' ', addr, opcode, text);
+}
+
+/* Prints the registers, the timers and the stack */
+static void print_state(const Chip8 *chip8, FILE *out)
+{
+    for (int i = 0; i < REGISTERS; i++) {
+        fprintf(out, "V%X=%02X%s", i, chip8->V[i], i % 8 == 7 ? "\n" : "  ");
+    }
+    fprintf(out, "I=%03X  PC=%03X  SP=%X  DT=%02X  ST=%02X  KEYS=", chip8->I, chip8->pc, chip8->sp,
+            chip8->delay_timer, chip8->sound_timer);
+    for (int i = 0; i < MAX_KEYPAD_KEYS; i++) {
+        if (chip8->key[i])
+            fprintf(out, "%X", i);
+    }
+    fprintf(out, "%s\nSTACK:", chip8->waiting_key ? "  (WAITING FOR A KEY)" : "");
+    for (int i = chip8->sp - 1; i >= 0; i--) {
+        fprintf(out, " %03X", chip8->stack[i]);
+    }
+    fprintf(out, "\n");
+}
+
+static void print_points(const Debugger *debugger, FILE *out)
+{
+    fprintf(out, "BREAKPOINTS:");
+    for (int addr = 0; addr < CHIP8_MEMSIZE; addr++) {
+        if (debugger->breakpoints[addr])
+            fprintf(out, " %03X", addr);
+    }
+    fprintf(out, "\nWATCHED:");
+    for (int i = 0; i < REGISTERS; i++) {
+        if (debugger->watched_registers & 1 << i)
+            fprintf(out, " V%X", i);
+    }
+    for (int addr = 0; addr < CHIP8_MEMSIZE; addr++) {
+        if (debugger->watched[addr])
+            fprintf(out, " %03X", addr);
+    }
+    fprintf(out, "\n");
+}
+
+static void print_memory(const Chip8 *chip8, FILE *out, int addr, int length)
+{
+    for (int i = 0; i < length && addr + i < CHIP8_MEMSIZE; i++) {
+        if (i % 16 == 0)
+            fprintf(out, "%s0x%03X:", i ? "\n" : "", addr + i);
+        fprintf(out, " %02X", chip8->memory[addr + i]);
+    }
+    fprintf(out, "\n");
+}
+
+static void help(FILE *out)
+{
+    fprintf(out,
+            "c, continue            Run until a breakpoint or a watchpoint\n"
+            "s, step [N]            Execute N instructions (1) and stop\n"
+            "b, break ADDR          Stop before executing the instruction at ADDR\n"
+            "d, delete ADDR         Delete the breakpoint at ADDR\n"
+            "w, watch VX | ADDR[-ADDR]\n"
+            "                       Stop after an instruction writes VX or the memory\n"
+            "u, unwatch VX | ADDR[-ADDR]\n"
+            "i, info                Print the registers, breakpoints and watchpoints\n"
+            "m, memory [ADDR] [N]   Print N bytes (%d) of memory from ADDR (I)\n"
+            "l, list [ADDR] [N]     Disassemble N instructions (%d) from ADDR (PC)\n"
+            "q, quit                Exit\n"
+            "An empty line repeats the last command. Numbers are hexadecimal\n",
+            DEFAULT_MEMORY_BYTES, DEFAULT_LIST_LENGTH);
+}
+
+/* Parses a hexadecimal address. Returns -1 if it isn't one */
+static int parse_address(const char *text)
+{
+    char *end;
+    long addr = text ? strtol(text, &end, 16) : -1;
+
+    return text && *end == '\0' && addr >= 0 && addr < CHIP8_MEMSIZE ? addr : -1;
+}
+
+/* Sets (or clears, if set is false) a watchpoint on what text says: a
+ * register (VX) or a range of addresses. Returns false if it says neither */
+static bool watch(Debugger *debugger, char *text, bool set)
+{
+    if (!text)
+        return false;
+
+    if (toupper((unsigned char)text[0]) == 'V' && isxdigit((unsigned char)text[1]) && text[2] == '\0') {
+        int x = strtol(text + 1, NULL, 16);
+        debugger->watched_registers = set ? debugger->watched_registers | 1 << x :
+            debugger->watched_registers & ~(1 << x);
+        return true;
+    }
+
+    char *dash = strchr(text, '-');
+    if (dash)
+        *dash = '\0';
+    int first = parse_address(text), last = dash ? parse_address(dash + 1) : first;
+    if (first < 0 || last < first)
+        return false;
+
+    for (int addr = first; addr <= last; addr++) {
+        debugger->watched_bytes += set - debugger->watched[addr];
+        debugger->watched[addr] = set;
+    }
+    return true;
+}
+
+/* Reads and runs commands until one makes the machine go on */
+static void command_loop(Chip8 *chip8)
+{
+    Debugger * const debugger = chip8->debugger;
+    FILE * const out = debugger->out;
+    static char last[256];
+    char line[256];
+
+    for (;;) {
+        fprintf(out, "(chip8) ");
+        fflush(out);
+        if (!fgets(line, sizeof(line), debugger->in)) {
+            /* Nobody to take commands from. It can't be freed while its
+             * entry runs, so it lets everything run and run_cycles() frees
+             * it (see debugger_release()) */
+            fprintf(out, "\n");
+            memset(debugger->breakpoints, 0, sizeof(debugger->breakpoints));
+            memset(debugger->watched, 0, sizeof(debugger->watched));
+            debugger->breakpoint_count = 0;
+            debugger->watched_bytes = 0;
+            debugger->watched_registers = 0;
+            debugger->steps = 0;
+            debugger->detached = true;
+            break;
+        }
+
+        if (strspn(line, " \t\r\n") == strlen(line))
+            strcpy(line, last);
+        else
+            strcpy(last, line);
+
+        char *command = strtok(line, " \t\r\n");
+        char *first = strtok(NULL, " \t\r\n");
+        char *second = strtok(NULL, " \t\r\n");
+        if (!command)
+            continue;
+
+        if (strcmp(command, "c") == 0 || strcmp(command, "continue") == 0) {
+            debugger->steps = 0;
+            break;
+        } else if (strcmp(command, "s") == 0 || strcmp(command, "step") == 0) {
+            long steps = first ? strtol(first, NULL, 16) : 1;
+            debugger->steps = steps > 0 ? steps : 1;
+            break;
+        } else if (strcmp(command, "b") == 0 || strcmp(command, "break") == 0 ||
+                strcmp(command, "d") == 0 || strcmp(command, "delete") == 0) {
+            int addr = parse_address(first);
+            if (addr < 0) {
+                fprintf(out, "WHICH ADDRESS?\n");
+                continue;
+            }
+            bool set = command[0] == 'b';
+            debugger->breakpoint_count += set - debugger->breakpoints[addr];
+            debugger->breakpoints[addr] = set;
+        } else if (strcmp(command, "w") == 0 || strcmp(command, "watch") == 0 ||
+                strcmp(command, "u") == 0 || strcmp(command, "unwatch") == 0) {
+            if (!watch(debugger, first, command[0] == 'w'))
+                fprintf(out, "WHICH REGISTER OR ADDRESSES?\n");
+        } else if (strcmp(command, "i") == 0 || strcmp(command, "info") == 0) {
+            print_state(chip8, out);
+            print_points(debugger, out);
+        } else if (strcmp(command, "m") == 0 || strcmp(command, "memory") == 0) {
+            int addr = first ? parse_address(first) : chip8->I;
+            long length = second ? strtol(second, NULL, 16) : DEFAULT_MEMORY_BYTES;
+            if (addr < 0)
+                fprintf(out, "WHICH ADDRESS?\n");
+            else
+                print_memory(chip8, out, addr, length);
+        } else if (strcmp(command, "l") == 0 || strcmp(command, "list") == 0) {
+            int addr = first ? parse_address(first) : chip8->pc;
+            long length = second ? strtol(second, NULL, 16) : DEFAULT_LIST_LENGTH;
+            if (addr < 0)
+                fprintf(out, "WHICH ADDRESS?\n");
+            for (long i = 0; addr >= 0 && i < length && addr + 2 * i < CHIP8_MEMSIZE; i++) {
+                print_instruction(chip8, out, addr + 2 * i);
+            }
+        } else if (strcmp(command, "q") == 0 || strcmp(command, "quit") == 0) {
+            exit(EXIT_SUCCESS);
+        } else {
+            help(out);
+        }
+    }
+
+    /* What to patch may have changed */
+    repatch(chip8);
+}
+
+/* Says why the machine stopped and takes commands */
+static void stop(Chip8 *chip8, const char * const why)
+{
+    fprintf(chip8->debugger->out, "%s\n", why);
+    print_instruction(chip8, chip8->debugger->out, chip8->pc);
+    command_loop(chip8);
+}
+
+/* Handler of the patched entries. Stops before executing the instruction
+ * if there is a breakpoint or the last step was taken, and after it if it
+ * wrote something watched */
+static void debugger_execute(Chip8 * const chip8, const Instruction * const ins)
+{
+    const Instruction * const original = &decode_table[ins->opcode];
+    const uint16_t pc = chip8->pc, I = chip8->I;
+    uint8_t V[REGISTERS];
+    char why[64];
+
+    if (chip8->debugger->steps > 0 && --chip8->debugger->steps == 0)
+        stop(chip8, "STEPPED");
+    else if (chip8->debugger->breakpoints[pc & (CHIP8_MEMSIZE - 1)])
+        stop(chip8, "BREAKPOINT");
+
+    memcpy(V, chip8->V, sizeof(V));
+    original->execute(chip8, original);
+
+    Debugger * const debugger = chip8->debugger;
+    uint16_t registers = registers_written(original) & debugger->watched_registers;
+    for (int i = 0; i < REGISTERS; i++) {
+        if (registers & 1 << i) {
+            snprintf(why, sizeof(why), "V%X WRITTEN BY 0x%03X: %02X -> %02X", i, pc, V[i], chip8->V[i]);
+            stop(chip8, why);
+            return;
+        }
+    }
+
+    int bytes = debugger->watched_bytes > 0 ? bytes_written(original) : 0;
+    for (int i = 0; i < bytes; i++) {
+        const uint16_t addr = (I + i) & (CHIP8_MEMSIZE - 1);
+        if (debugger->watched[addr]) {
+            snprintf(why, sizeof(why), "0x%03X WRITTEN BY 0x%03X: %02X", addr, pc, chip8->memory[addr]);
+            stop(chip8, why);
+            return;
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef _DEBUGGER_HEADER_
+#define _DEBUGGER_HEADER_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "chip8.h"
+
+/* Breakpoints, watchpoints and stepping of a machine. The addresses where
+ * the debugger has to look at what happens get their own dispatch entry
+ * (see debugger.c), so the rest run as if there was no debugger */
+typedef struct debugger {
+	Instruction patched[CHIP8_MEMSIZE]; /* Dispatch entries of the addresses it looks at */
+	bool breakpoints[CHIP8_MEMSIZE];
+	int breakpoint_count;
+	bool watched[CHIP8_MEMSIZE];       /* Memory watched for writes */
+	int watched_bytes;
+	uint16_t watched_registers;        /* Bit n set if Vn is watched for writes */
+	unsigned long steps;               /* Instructions to execute before stopping. 0 if not stepping */
+	FILE *in;                          /* Where commands are read from */
+	FILE *out;
+	bool detached;                     /* Ran out of commands, freed by debugger_release() */
+} Debugger;
+
+bool debugger_attach(Chip8 *, FILE *, FILE *);
+void debugger_detach(Chip8 *);
+void debugger_release(Chip8 *);
+void debugger_interrupt(Chip8 *);
+const Instruction *debugger_patch(Chip8 *, uint16_t, const Instruction *);
+bool debugger_skips_idle(const Chip8 *);
+
+#endif /* _DEBUGGER_HEADER_ */
@@ -0,0 +1,78 @@
+/* Turns opcodes into text, with the mnemonics of Cowgod's Chip-8
+ * Technical Reference. The operands come from decode_table, so this
+ * reads opcodes exactly as the interpreter does */
+
+#include <stdio.h>
+#include "disasm.h"
+#include "chip8.h"
+#include "opcode_functions.h"
+
+static const char * const op_names[OPCODE_COUNT] =
+{
+    [OP_INVALID] = "????",
+    [OP_00E0] = "00E0", [OP_00EE] = "00EE",
+    [OP_1NNN] = "1NNN", [OP_2NNN] = "2NNN", [OP_3XNN] = "3XNN", [OP_4XNN] = "4XNN",
+    [OP_5XY0] = "5XY0", [OP_6XNN] = "6XNN", [OP_7XNN] = "7XNN",
+    [OP_8XY0] = "8XY0", [OP_8XY1] = "8XY1", [OP_8XY2] = "8XY2", [OP_8XY3] = "8XY3",
+    [OP_8XY4] = "8XY4", [OP_8XY5] = "8XY5", [OP_8XY6] = "8XY6", [OP_8XY7] = "8XY7",
+    [OP_8XYE] = "8XYE",
+    [OP_9XY0] = "9XY0", [OP_ANNN] = "ANNN", [OP_BNNN] = "BNNN", [OP_CXNN] = "CXNN",
+    [OP_DXYN] = "DXYN",
+    [OP_EX9E] = "EX9E", [OP_EXA1] = "EXA1",
+    [OP_FX07] = "FX07", [OP_FX0A] = "FX0A", [OP_FX15] = "FX15", [OP_FX18] = "FX18",
+    [OP_FX1E] = "FX1E", [OP_FX29] = "FX29", [OP_FX33] = "FX33", [OP_FX55] = "FX55",
+    [OP_FX65] = "FX65",
+    [OP_FUSED] = "FUSED", [OP_DEBUG] = "DEBUG"
+};
+
+/* Returns the name of an OP_* (see opcode_functions.h), like "8XY4" */
+const char *op_name(int op)
+{
+    return op >= 0 && op < OPCODE_COUNT ? op_names[op] : "????";
+}
+
+/* Writes the assembly of opcode to text, which takes up to size bytes.
+ * 20 are always enough */
+void disassemble(uint16_t opcode, char *text, size_t size)
+{
+    const Instruction * const ins = &decode_table[opcode];
+    const int x = ins->x, y = ins->y;
+
+    switch (ins->op) {
+        case OP_00E0: snprintf(text, size, "CLS"); break;
+        case OP_00EE: snprintf(text, size, "RET"); break;
+        case OP_1NNN: snprintf(text, size, "JP 0x%03X", ins->nnn); break;
+        case OP_2NNN: snprintf(text, size, "CALL 0x%03X", ins->nnn); break;
+        case OP_3XNN: snprintf(text, size, "SE V%X, 0x%02X", x, ins->nn); break;
+        case OP_4XNN: snprintf(text, size, "SNE V%X, 0x%02X", x, ins->nn); break;
+        case OP_5XY0: snprintf(text, size, "SE V%X, V%X", x, y); break;
+        case OP_6XNN: snprintf(text, size, "LD V%X, 0x%02X", x, ins->nn); break;
+        case OP_7XNN: snprintf(text, size, "ADD V%X, 0x%02X", x, ins->nn); break;
+        case OP_8XY0: snprintf(text, size, "LD V%X, V%X", x, y); break;
+        case OP_8XY1: snprintf(text, size, "OR V%X, V%X", x, y); break;
+        case OP_8XY2: snprintf(text, size, "AND V%X, V%X", x, y); break;
+        case OP_8XY3: snprintf(text, size, "XOR V%X, V%X", x, y); break;
+        case OP_8XY4: snprintf(text, size, "ADD V%X, V%X", x, y); break;
+        case OP_8XY5: snprintf(text, size, "SUB V%X, V%X", x, y); break;
+        case OP_8XY6: snprintf(text, size, "SHR V%X", x); break;
+        case OP_8XY7: snprintf(text, size, "SUBN V%X, V%X", x, y); break;
+        case OP_8XYE: snprintf(text, size, "SHL V%X", x); break;
+        case OP_9XY0: snprintf(text, size, "SNE V%X, V%X", x, y); break;
+        case OP_ANNN: snprintf(text, size, "LD I, 0x%03X", ins->nnn); break;
+        case OP_BNNN: snprintf(text, size, "JP V0, 0x%03X", ins->nnn); break;
+        case OP_CXNN: snprintf(text, size, "RND V%X, 0x%02X", x, ins->nn); break;
+        case OP_DXYN: snprintf(text, size, "DRW V%X, V%X, %d", x, y, ins->n); break;
+        case OP_EX9E: snprintf(text, size, "SKP V%X", x); break;
+        case OP_EXA1: snprintf(text, size, "SKNP V%X", x); break;
+        case OP_FX07: snprintf(text, size, "LD V%X, DT", x); break;
+        case OP_FX0A: snprintf(text, size, "LD V%X, K", x); break;
+        case OP_FX15: snprintf(text, size, "LD DT, V%X", x); break;
+        case OP_FX18: snprintf(text, size, "LD ST, V%X", x); break;
+        case OP_FX1E: snprintf(text, size, "ADD I, V%X", x); break;
+        case OP_FX29: snprintf(text, size, "LD F, V%X", x); break;
+        case OP_FX33: snprintf(text, size, "LD B, V%X", x); break;
+        case OP_FX55: snprintf(text, size, "LD [I], V%X", x); break;
+        case OP_FX65: snprintf(text, size, "LD V%X, [I]", x); break;
+        default:      snprintf(text, size, "DW 0x%04X", opcode); break;
+    }
+}
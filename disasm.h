@@ -0,0 +1,10 @@
+#ifndef _DISASM_HEADER_
+#define _DISASM_HEADER_
+
+#include <stddef.h>
+#include <stdint.h>
+
+const char *op_name(int);
+void disassemble(uint16_t, char *, size_t);
+
+#endif /* _DISASM_HEADER_ */
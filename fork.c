@@ -0,0 +1,262 @@
+/* Forks the state of a machine into branches, for searches that try many
+ * inputs from the same point of a game.
+ *
+ * Copying a whole Chip8 per branch would copy its memory, its screen and
+ * its predecoded instructions every time. Instead, a branch keeps the
+ * memory (in chunks of CHIP8_CHUNK_SIZE bytes) and the screen in chunks
+ * shared with the branches it was forked from or into, so a fork only
+ * copies the registers and takes a reference to every chunk. Branches run
+ * on the machine of their tree: branch_enter() copies into it the chunks
+ * it doesn't hold already, and when the branch leaves it, only the chunks
+ * the machine wrote (see Chip8.written_chunks, set by FX33 and FX55) are
+ * written back, into a new chunk if they were shared (copy on write). The
+ * screen, which DXYN and 00E0 write, is compared instead, as it's small */
+
+#include <stdlib.h>
+#include <string.h>
+#include "fork.h"
+
+#define SCREEN_SIZE sizeof(((Chip8 *)0)->gfx)
+
+/* Returns NULL if there is not enough memory */
+static ForkChunk *new_chunk(ForkTree *tree, const void *bytes, size_t size)
+{
+    ForkChunk *chunk = malloc(sizeof(ForkChunk) + size);
+    if (!chunk)
+        return NULL;
+
+    chunk->refs = 1;
+    chunk->id = ++tree->next_id;
+    chunk->size = size;
+    memcpy(chunk->bytes, bytes, size);
+    tree->chunks++;
+    tree->chunk_bytes += sizeof(ForkChunk) + size;
+    return chunk;
+}
+
+static void release(ForkTree *tree, ForkChunk *chunk)
+{
+    if (--chunk->refs == 0) {
+        tree->chunks--;
+        tree->chunk_bytes -= sizeof(ForkChunk) + chunk->size;
+        free(chunk);
+    }
+}
+
+/* Makes *chunk hold bytes. It is changed in place if no other branch
+ * shares it, or copied if one does. Returns false, leaving *chunk as it
+ * was, if there is not enough memory for the copy */
+static bool write_chunk(ForkTree *tree, ForkChunk **chunk, const void *bytes, size_t size)
+{
+    if ((*chunk)->refs > 1) {
+        ForkChunk *copy = new_chunk(tree, bytes, size);
+        if (!copy)
+            return false;
+        (*chunk)->refs--;
+        *chunk = copy;
+        tree->copies++;
+    } else {
+        memcpy((*chunk)->bytes, bytes, size);
+        (*chunk)->id = ++tree->next_id;
+    }
+    return true;
+}
+
+ForkTree *fork_tree_create(void)
+{
+    ForkTree *tree = calloc(1, sizeof(ForkTree));
+    if (!tree)
+        return NULL;
+
+    tree->machine = malloc(sizeof(Chip8));
+    if (!tree->machine) {
+        free(tree);
+        return NULL;
+    }
+    init_chip8(tree->machine);
+    return tree;
+}
+
+/* Destroys the tree. Its branches have to be destroyed first */
+void fork_tree_destroy(ForkTree *tree)
+{
+    if (!tree)
+        return;
+
+    free(tree->machine);
+    free(tree);
+}
+
+/* Copies the registers, the timers... of chip8 to branch */
+static void save_registers(Branch *branch, const Chip8 *chip8)
+{
+    memcpy(branch->state, (const uint8_t *)chip8 + CHIP8_STATE_START, CHIP8_STATE_SIZE);
+    branch->opcode = chip8->opcode;
+}
+
+/* Does not load the screen */
+static void load_registers(Chip8 *chip8, const Branch *branch)
+{
+    memcpy((uint8_t *)chip8 + CHIP8_STATE_START, branch->state, CHIP8_STATE_SIZE);
+    chip8->opcode = branch->opcode;
+}
+
+/* Creates a branch with the state of chip8, which is not changed. Returns
+ * NULL if there is not enough memory */
+Branch *branch_create(ForkTree *tree, const Chip8 *chip8)
+{
+    Branch *branch = malloc(sizeof(Branch));
+    if (!branch)
+        return NULL;
+
+    branch->tree = tree;
+    int chunks;
+    for (chunks = 0; chunks < FORK_CHUNKS; chunks++) {
+        branch->memory[chunks] = new_chunk(tree, &chip8->memory[chunks * CHIP8_CHUNK_SIZE], CHIP8_CHUNK_SIZE);
+        if (!branch->memory[chunks])
+            break;
+    }
+    branch->screen = chunks == FORK_CHUNKS ? new_chunk(tree, chip8->gfx, SCREEN_SIZE) : NULL;
+
+    /* Gives back the chunks it got */
+    if (!branch->screen) {
+        while (chunks > 0) {
+            release(tree, branch->memory[--chunks]);
+        }
+        free(branch);
+        return NULL;
+    }
+    save_registers(branch, chip8);
+
+    tree->branches++;
+    return branch;
+}
+
+/* Writes the state of the machine back to the branch it runs. Returns
+ * false if there is not enough memory for the chunks it has to copy. The
+ * machine still runs the branch then, and nothing it did is lost */
+static bool leave(ForkTree *tree)
+{
+    Branch *branch = tree->current;
+    Chip8 *machine = tree->machine;
+    uint64_t written = machine->written_chunks;
+
+    for (int i = 0; written; i++, written >>= 1) {
+        const uint8_t *bytes = &machine->memory[i * CHIP8_CHUNK_SIZE];
+
+        /* Writing the same bytes doesn't change anything */
+        if (!(written & 1) || memcmp(branch->memory[i]->bytes, bytes, CHIP8_CHUNK_SIZE) == 0)
+            continue;
+
+        if (!write_chunk(tree, &branch->memory[i], bytes, CHIP8_CHUNK_SIZE))
+            return false;
+        tree->loaded[i] = branch->memory[i]->id;
+    }
+
+    if (memcmp(branch->screen->bytes, machine->gfx, SCREEN_SIZE) != 0 &&
+            !write_chunk(tree, &branch->screen, machine->gfx, SCREEN_SIZE))
+        return false;
+
+    machine->written_chunks = 0;
+    save_registers(branch, machine);
+    return true;
+}
+
+/* Creates a branch with the same state as parent, sharing its memory and
+ * screen. Returns NULL if there is not enough memory */
+Branch *branch_fork(Branch *parent)
+{
+    ForkTree *tree = parent->tree;
+
+    /* The machine may be ahead of parent */
+    if (tree->current == parent && !leave(tree))
+        return NULL;
+
+    Branch *branch = malloc(sizeof(Branch));
+    if (!branch)
+        return NULL;
+
+    *branch = *parent;
+    for (int i = 0; i < FORK_CHUNKS; i++) {
+        branch->memory[i]->refs++;
+    }
+    branch->screen->refs++;
+
+    tree->branches++;
+    tree->forks++;
+    return branch;
+}
+
+/* Makes the machine of the tree run branch, and returns it. Whatever the
+ * machine does from then on happens to branch, until another branch is
+ * entered or forked from. The machine keeps the instructions it decoded
+ * for the chunks that are the same in both branches. Returns NULL if there
+ * is not enough memory to save the branch it ran before */
+Chip8 *branch_enter(Branch *branch)
+{
+    ForkTree *tree = branch->tree;
+    Chip8 *machine = tree->machine;
+
+    if (tree->current == branch)
+        return machine;
+    if (tree->current && !leave(tree))
+        return NULL;
+
+    for (int i = 0; i < FORK_CHUNKS; i++) {
+        if (tree->loaded[i] == branch->memory[i]->id)
+            continue;
+
+        memcpy(&machine->memory[i * CHIP8_CHUNK_SIZE], branch->memory[i]->bytes, CHIP8_CHUNK_SIZE);
+        invalidate_instructions(machine, i * CHIP8_CHUNK_SIZE, CHIP8_CHUNK_SIZE);
+        tree->loaded[i] = branch->memory[i]->id;
+        tree->loads++;
+    }
+
+    load_registers(machine, branch);
+    machine->written_chunks = 0;
+    memcpy(machine->gfx, branch->screen->bytes, SCREEN_SIZE);
+    machine->dirty_rows = 0xFFFFFFFF;
+    machine->shouldDraw = true;
+
+    tree->current = branch;
+    return machine;
+}
+
+/* Destroys branch, and the chunks no other branch shares */
+void branch_destroy(Branch *branch)
+{
+    if (!branch)
+        return;
+
+    ForkTree *tree = branch->tree;
+
+    /* What the machine wrote for branch is not in any chunk */
+    if (tree->current == branch) {
+        for (int i = 0; i < FORK_CHUNKS; i++) {
+            if (tree->machine->written_chunks & (1ULL << i))
+                tree->loaded[i] = 0;
+        }
+        tree->current = NULL;
+    }
+
+    for (int i = 0; i < FORK_CHUNKS; i++) {
+        release(tree, branch->memory[i]);
+    }
+    release(tree, branch->screen);
+
+    tree->branches--;
+    free(branch);
+}
+
+/* Prints how many forks there were, what they cost and how much memory
+ * each branch alive takes */
+void fork_report(const ForkTree *tree, FILE *out)
+{
+    size_t memory = tree->branches * sizeof(Branch) + tree->chunk_bytes;
+
+    fprintf(out, "FORKS: %lu (%zu BYTES COPIED EACH), %lu CHUNKS COPIED ON WRITE, %lu LOADED\n",
+            tree->forks, sizeof(Branch), tree->copies, tree->loads);
+    fprintf(out, "%lu BRANCHES ALIVE IN %.1f KB, %lu CHUNKS (%.0f BYTES EACH, %zu FOR A COPY OF THE MACHINE)\n",
+            tree->branches, memory / 1024.0, tree->chunks, tree->branches ? (double)memory / tree->branches : 0,
+            sizeof(Chip8));
+}
@@ -0,0 +1,59 @@
+#ifndef _FORK_HEADER_
+#define _FORK_HEADER_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8.h"
+
+#define FORK_CHUNKS (CHIP8_MEMSIZE / CHIP8_CHUNK_SIZE)
+
+/* Part of the memory or the screen of one or more branches */
+typedef struct fork_chunk {
+	int refs;                          /* Branches that share it */
+	uint64_t id;                       /* Different for every content it ever had */
+	uint32_t size;                     /* Of bytes */
+	uint8_t bytes[];
+} ForkChunk;
+
+struct fork_tree;
+
+/* The state of a machine at some point of a search. Branches share their
+ * memory and screen with the ones they were forked from until one of them
+ * writes to them (see fork.c) */
+typedef struct branch {
+	struct fork_tree *tree;
+	ForkChunk *memory[FORK_CHUNKS];    /* memory[n] holds addresses n * CHIP8_CHUNK_SIZE on */
+	ForkChunk *screen;                 /* gfx */
+
+	/* The rest of the machine, which is copied. Its gfx is not used: screen holds it */
+	uint8_t  state[CHIP8_STATE_SIZE]; /* From CHIP8_STATE_START on */
+	uint16_t opcode;
+} Branch;
+
+/* The branches of a search, and the machine that runs them one at a time.
+ * Nothing in it is thread safe: every thread needs its own tree */
+typedef struct fork_tree {
+	Chip8 *machine;
+	Branch *current;                   /* The branch the machine runs. NULL if none */
+	uint64_t loaded[FORK_CHUNKS];      /* Id of the chunk each part of the memory of machine holds */
+	uint64_t next_id;
+
+	/* Statistics */
+	unsigned long branches;            /* Alive */
+	unsigned long chunks;              /* Alive, screens included */
+	size_t chunk_bytes;                /* Taken by them */
+	unsigned long forks;
+	unsigned long copies;              /* Chunks copied because a branch wrote to a shared one */
+	unsigned long loads;               /* Chunks copied to the machine by branch_enter() */
+} ForkTree;
+
+ForkTree *fork_tree_create(void);
+void fork_tree_destroy(ForkTree *);
+Branch *branch_create(ForkTree *, const Chip8 *);
+Branch *branch_fork(Branch *);
+Chip8 *branch_enter(Branch *);
+void branch_destroy(Branch *);
+void fork_report(const ForkTree *, FILE *);
+
+#endif /* _FORK_HEADER_ */
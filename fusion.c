@@ -0,0 +1,339 @@
+/* Superinstructions. Some sequences of instructions appear again and again
+ * in CHIP-8 programs: loading a register and then the address of a sprite,
+ * skipping over a jump to build a loop, etc. When the decoder finds one of
+ * them it gives the address a single Instruction that executes the whole
+ * sequence, so the interpreter dispatches once instead of once per
+ * instruction.
+ *
+ * Only sequences that can't observe the timers or draw are fused, and the
+ * handlers report how many instructions they actually ran (a skip that is
+ * taken doesn't run the jump after it), so the timers advance exactly as if
+ * every instruction had been dispatched on its own. Jumping into the middle
+ * of a sequence just finds the Instruction of that address, which is
+ * decoded separately.
+ *
+ * fusion_report() tells which sequences fired and how many dispatches they
+ * saved. When profiling, every dispatch is counted too, so it also tells
+ * which pairs of instructions are executed one after the other most often
+ * without being fused (the candidates for new sequences) */
+
+#include <stdlib.h>
+#include "fusion.h"
+
+/* Records that the sequence ran the given number of instructions */
+static inline void fired(Chip8 * const chip8, const FusedInstruction * const fused, int executed)
+{
+    chip8->fusion->executed = executed;
+    chip8->fusion->fired[fused->kind]++;
+    chip8->fusion->saved[fused->kind] += executed - 1;
+}
+
+/* Executes the skip instruction at pc (3XNN if skip_if_equal, 4XNN if not)
+ * and the 1NNN that follows it unless it's skipped. Returns the number of
+ * instructions run */
+static inline int skip_jump(Chip8 * const chip8, const Instruction * const skip,
+        bool skip_if_equal, const Instruction * const jump)
+{
+    if ((chip8->V[skip->x] == skip->nn) == skip_if_equal) {
+        chip8->pc += 4;
+        return 1;
+    }
+
+    chip8->pc = jump->nnn;
+    return 2;
+}
+
+/* 6XNN 6XNN */
+static void fused_6XNN_6XNN(Chip8 * const chip8, const Instruction * const ins)
+{
+    const FusedInstruction * const fused = (const FusedInstruction *)ins;
+
+    chip8->V[ins->x] = ins->nn;
+    chip8->V[fused->next[0]->x] = fused->next[0]->nn;
+    chip8->pc += 4;
+    fired(chip8, fused, 2);
+}
+
+/* 6XNN ANNN */
+static void fused_6XNN_ANNN(Chip8 * const chip8, const Instruction * const ins)
+{
+    const FusedInstruction * const fused = (const FusedInstruction *)ins;
+
+    chip8->V[ins->x] = ins->nn;
+    chip8->I = fused->next[0]->nnn;
+    chip8->pc += 4;
+    fired(chip8, fused, 2);
+}
+
+/* ANNN FX65 */
+static void fused_ANNN_FX65(Chip8 * const chip8, const Instruction * const ins)
+{
+    const FusedInstruction * const fused = (const FusedInstruction *)ins;
+    const int x = fused->next[0]->x;
+
+    for (int i = 0; i <= x; i++) {
+        chip8->V[i] = chip8->memory[(ins->nnn + i) & (CHIP8_MEMSIZE - 1)];
+    }
+    chip8->I = ins->nnn + x + 1;
+    chip8->pc += 4;
+    fired(chip8, fused, 2);
+}
+
+/* 3XNN 1NNN */
+static void fused_3XNN_1NNN(Chip8 * const chip8, const Instruction * const ins)
+{
+    const FusedInstruction * const fused = (const FusedInstruction *)ins;
+
+    fired(chip8, fused, skip_jump(chip8, ins, true, fused->next[0]));
+}
+
+/* 4XNN 1NNN */
+static void fused_4XNN_1NNN(Chip8 * const chip8, const Instruction * const ins)
+{
+    const FusedInstruction * const fused = (const FusedInstruction *)ins;
+
+    fired(chip8, fused, skip_jump(chip8, ins, false, fused->next[0]));
+}
+
+/* 7XNN 3XNN 1NNN */
+static void fused_7XNN_3XNN_1NNN(Chip8 * const chip8, const Instruction * const ins)
+{
+    const FusedInstruction * const fused = (const FusedInstruction *)ins;
+
+    chip8->V[ins->x] += ins->nn;
+    chip8->pc += 2;
+    fired(chip8, fused, 1 + skip_jump(chip8, fused->next[0], true, fused->next[1]));
+}
+
+/* 7XNN 4XNN 1NNN */
+static void fused_7XNN_4XNN_1NNN(Chip8 * const chip8, const Instruction * const ins)
+{
+    const FusedInstruction * const fused = (const FusedInstruction *)ins;
+
+    chip8->V[ins->x] += ins->nn;
+    chip8->pc += 2;
+    fired(chip8, fused, 1 + skip_jump(chip8, fused->next[0], false, fused->next[1]));
+}
+
+static void (* const handlers[FUSION_KINDS])(Chip8 * const, const Instruction * const) =
+{
+    [FUSE_6XNN_6XNN] = fused_6XNN_6XNN,
+    [FUSE_6XNN_ANNN] = fused_6XNN_ANNN,
+    [FUSE_ANNN_FX65] = fused_ANNN_FX65,
+    [FUSE_3XNN_1NNN] = fused_3XNN_1NNN,
+    [FUSE_4XNN_1NNN] = fused_4XNN_1NNN,
+    [FUSE_7XNN_3XNN_1NNN] = fused_7XNN_3XNN_1NNN,
+    [FUSE_7XNN_4XNN_1NNN] = fused_7XNN_4XNN_1NNN
+};
+
+static const char * const fusion_names[FUSION_KINDS] =
+{
+    [FUSE_6XNN_6XNN] = "6XNN 6XNN",
+    [FUSE_6XNN_ANNN] = "6XNN ANNN",
+    [FUSE_ANNN_FX65] = "ANNN FX65",
+    [FUSE_3XNN_1NNN] = "3XNN 1NNN",
+    [FUSE_4XNN_1NNN] = "4XNN 1NNN",
+    [FUSE_7XNN_3XNN_1NNN] = "7XNN 3XNN 1NNN",
+    [FUSE_7XNN_4XNN_1NNN] = "7XNN 4XNN 1NNN"
+};
+
+static const char * const op_names[OPCODE_COUNT] =
+{
+    [OP_INVALID] = "????",
+    [OP_00E0] = "00E0", [OP_00EE] = "00EE",
+    [OP_1NNN] = "1NNN", [OP_2NNN] = "2NNN", [OP_3XNN] = "3XNN", [OP_4XNN] = "4XNN",
+    [OP_5XY0] = "5XY0", [OP_6XNN] = "6XNN", [OP_7XNN] = "7XNN",
+    [OP_8XY0] = "8XY0", [OP_8XY1] = "8XY1", [OP_8XY2] = "8XY2", [OP_8XY3] = "8XY3",
+    [OP_8XY4] = "8XY4", [OP_8XY5] = "8XY5", [OP_8XY6] = "8XY6", [OP_8XY7] = "8XY7",
+    [OP_8XYE] = "8XYE",
+    [OP_9XY0] = "9XY0", [OP_ANNN] = "ANNN", [OP_BNNN] = "BNNN", [OP_CXNN] = "CXNN",
+    [OP_DXYN] = "DXYN",
+    [OP_EX9E] = "EX9E", [OP_EXA1] = "EXA1",
+    [OP_FX07] = "FX07", [OP_FX0A] = "FX0A", [OP_FX15] = "FX15", [OP_FX18] = "FX18",
+    [OP_FX1E] = "FX1E", [OP_FX29] = "FX29", [OP_FX33] = "FX33", [OP_FX55] = "FX55",
+    [OP_FX65] = "FX65",
+    [OP_FUSED] = "FUSED", [OP_DEBUG] = "DEBUG"
+};
+
+/* Returns the FUSE_* sequence formed by the given instructions, or -1 if
+ * they don't form one. third is NULL if there is no room for it in memory */
+static int match(const Instruction * const first, const Instruction * const second,
+        const Instruction * const third)
+{
+    switch (first->op) {
+        case OP_6XNN:
+            if (second->op == OP_6XNN)
+                return FUSE_6XNN_6XNN;
+            if (second->op == OP_ANNN)
+                return FUSE_6XNN_ANNN;
+            break;
+        case OP_ANNN:
+            if (second->op == OP_FX65)
+                return FUSE_ANNN_FX65;
+            break;
+        /* Jumps out of range are left to opcode_1, which reports them */
+        case OP_3XNN:
+            if (second->op == OP_1NNN && second->nnn >= 0x200)
+                return FUSE_3XNN_1NNN;
+            break;
+        case OP_4XNN:
+            if (second->op == OP_1NNN && second->nnn >= 0x200)
+                return FUSE_4XNN_1NNN;
+            break;
+        case OP_7XNN:
+            if (!third || third->op != OP_1NNN || third->nnn < 0x200)
+                break;
+            if (second->op == OP_3XNN)
+                return FUSE_7XNN_3XNN_1NNN;
+            if (second->op == OP_4XNN)
+                return FUSE_7XNN_4XNN_1NNN;
+            break;
+    }
+    return -1;
+}
+
+/* Returns the decoded instruction at memory[addr] */
+static inline const Instruction *instruction_at(const Chip8 * const chip8, uint16_t addr)
+{
+    return &decode_table[(chip8->memory[addr] << 8) | chip8->memory[addr + 1]];
+}
+
+/* Called by the decoder with the instruction it decoded at addr. Returns
+ * the sequence that starts there if there is one, or first if not */
+const Instruction *fuse(Chip8 *chip8, uint16_t addr, const Instruction *first)
+{
+    Fusion * const fusion = chip8->fusion;
+
+    if (!fusion || addr + 4 > CHIP8_MEMSIZE)
+        return first;
+
+    const Instruction *second = instruction_at(chip8, addr + 2);
+    const Instruction *third = addr + 6 <= CHIP8_MEMSIZE ? instruction_at(chip8, addr + 4) : NULL;
+    int kind = match(first, second, third);
+
+    if (kind < 0)
+        return first;
+
+    FusedInstruction * const fused = &fusion->fused[addr];
+    fused->head = *first;
+    fused->head.execute = handlers[kind];
+    fused->head.op = OP_FUSED;
+    fused->next[0] = second;
+    fused->next[1] = third;
+    fused->kind = kind;
+    return &fused->head;
+}
+
+/* Starts fusing instructions, counting every dispatch if profile is true.
+ * Returns false if there is no memory for it */
+bool fusion_enable(Chip8 *chip8, bool profile)
+{
+    if (chip8->fusion) {
+        chip8->fusion->profile = profile;
+        return true;
+    }
+
+    chip8->fusion = calloc(1, sizeof(Fusion));
+    if (!chip8->fusion)
+        return false;
+    chip8->fusion->profile = profile;
+
+    /* Decode everything again, now looking for sequences */
+    invalidate_instructions(chip8, 0, CHIP8_MEMSIZE);
+    return true;
+}
+
+/* Stops fusing instructions and forgets the statistics */
+void fusion_disable(Chip8 *chip8)
+{
+    if (!chip8->fusion)
+        return;
+
+    free(chip8->fusion);
+    chip8->fusion = NULL;
+    invalidate_instructions(chip8, 0, CHIP8_MEMSIZE);
+}
+
+typedef struct pair_count {
+    unsigned long count;
+    uint8_t first;
+    uint8_t second;
+} PairCount;
+
+/* Sorts pairs from most to least executed */
+static int compare_pairs(const void *a, const void *b)
+{
+    const PairCount *pa = a, *pb = b;
+
+    if (pa->count != pb->count)
+        return pa->count < pb->count ? 1 : -1;
+    return 0;
+}
+
+/* Returns the number of dispatches saved by all the sequences */
+static unsigned long fusion_saved(const Chip8 *chip8)
+{
+    unsigned long saved = 0;
+
+    if (!chip8->fusion)
+        return 0;
+
+    for (int kind = 0; kind < FUSION_KINDS; kind++) {
+        saved += chip8->fusion->saved[kind];
+    }
+    return saved;
+}
+
+#define REPORT_TOP_PAIRS 10
+
+/* Prints which sequences fired, the dispatches they saved and, when
+ * profiling, the pairs of instructions that were executed one after the
+ * other most often */
+void fusion_report(const Chip8 *chip8, FILE *out)
+{
+    const Fusion * const fusion = chip8->fusion;
+
+    if (!fusion)
+        return;
+
+    if (fusion->profile && fusion->instructions > 0) {
+        fprintf(out, "FUSION: %lu INSTRUCTIONS IN %lu DISPATCHES (%lu SAVED, %.1f%%)\n",
+                fusion->instructions, fusion->dispatches, fusion_saved(chip8),
+                100.0 * fusion_saved(chip8) / fusion->instructions);
+    } else {
+        fprintf(out, "FUSION: %lu DISPATCHES SAVED\n", fusion_saved(chip8));
+    }
+
+    for (int kind = 0; kind < FUSION_KINDS; kind++) {
+        if (fusion->fired[kind] == 0)
+            continue;
+        fprintf(out, "  %-16s FIRED %10lu  SAVED %10lu\n", fusion_names[kind],
+                fusion->fired[kind], fusion->saved[kind]);
+    }
+
+    if (!fusion->profile || fusion->dispatches == 0)
+        return;
+
+    /* Pairs with a sequence in them say nothing about what to fuse next */
+    static PairCount pairs[OPCODE_COUNT * OPCODE_COUNT];
+    int count = 0;
+
+    for (int first = 0; first < OP_FUSED; first++) {
+        for (int second = 0; second < OP_FUSED; second++) {
+            if (fusion->pairs[first][second] == 0)
+                continue;
+            pairs[count].count = fusion->pairs[first][second];
+            pairs[count].first = first;
+            pairs[count].second = second;
+            count++;
+        }
+    }
+    qsort(pairs, count, sizeof(PairCount), compare_pairs);
+
+    fprintf(out, "  MOST EXECUTED UNFUSED PAIRS:\n");
+    for (int i = 0; i < count && i < REPORT_TOP_PAIRS; i++) {
+        fprintf(out, "  %s %s        %10lu (%.1f%%)\n", op_names[pairs[i].first],
+                op_names[pairs[i].second], pairs[i].count,
+                100.0 * pairs[i].count / fusion->dispatches);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef _FUSION_HEADER_
+#define _FUSION_HEADER_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "chip8.h"
+#include "opcode_functions.h"
+
+/* Sequences of instructions that are executed as a single one */
+enum {
+    FUSE_6XNN_6XNN,          /* Two register loads */
+    FUSE_6XNN_ANNN,          /* Register load and sprite address */
+    FUSE_ANNN_FX65,          /* Load registers from a fixed address */
+    FUSE_3XNN_1NNN,          /* Skip and jump */
+    FUSE_4XNN_1NNN,
+    FUSE_7XNN_3XNN_1NNN,     /* Loop counter */
+    FUSE_7XNN_4XNN_1NNN,
+    FUSION_KINDS
+};
+
+/* A sequence of instructions executed as one. The first instruction is
+ * copied and its handler replaced by the one of the sequence, which finds
+ * the operands of the rest of instructions in next */
+typedef struct fused_instruction {
+    Instruction head;
+    const Instruction *next[2];
+    uint8_t kind;                              /* FUSE_* */
+} FusedInstruction;
+
+typedef struct fusion {
+    FusedInstruction fused[CHIP8_MEMSIZE];     /* Sequence that starts at each address */
+    int executed;                              /* Instructions run by the last sequence */
+    unsigned long fired[FUSION_KINDS];         /* Times each sequence was executed */
+    unsigned long saved[FUSION_KINDS];         /* Dispatches each sequence avoided */
+
+    /* Only counted when profiling, as they cost more than fusion saves */
+    bool profile;
+    uint8_t last_op;                           /* OP_* of the last dispatch */
+    unsigned long instructions;
+    unsigned long dispatches;
+    unsigned long pairs[OPCODE_COUNT][OPCODE_COUNT]; /* Dispatches of each OP_* after each OP_* */
+} Fusion;
+
+bool fusion_enable(Chip8 *, bool);
+void fusion_disable(Chip8 *);
+const Instruction *fuse(Chip8 *, uint16_t, const Instruction *);
+void fusion_report(const Chip8 *, FILE *);
+
+/* Accounts for a dispatch of ins, which was just executed. Returns how many
+ * instructions it ran */
+static inline int fusion_account(Chip8 * const chip8, const Instruction * const ins)
+{
+    Fusion * const fusion = chip8->fusion;
+
+    if (!fusion)
+        return 1;
+
+    int executed = ins->op == OP_FUSED ? fusion->executed : 1;
+
+    if (fusion->profile) {
+        fusion->pairs[fusion->last_op][ins->op]++;
+        fusion->last_op = ins->op;
+        fusion->instructions += executed;
+        fusion->dispatches++;
+    }
+    return executed;
+}
+
+#endif /* _FUSION_HEADER_ */
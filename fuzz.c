@@ -0,0 +1,186 @@
+/* Runs programs made up by a fuzzer, to find inputs that crash the
+ * interpreter (or that a sanitizer complains about). Built with make fuzz,
+ * LLVMFuzzerTestOneInput() is the entry point of libFuzzer. Each input is
+ * a schedule of keys and a ROM:
+ *
+ *     events (1 byte)  events * { instructions (2 bytes)  keys (2) }  ROM
+ *
+ * all little endian. The ROM runs for FUZZ_INSTRUCTIONS instructions at
+ * most, and each event holds its keys down (bit n is key n) after the
+ * given number of instructions since the previous one. A fault (see Fault)
+ * just ends the run: it's the program that is wrong, not the interpreter.
+ *
+ * Every run starts from the same machine, so a crash can be reproduced
+ * with the input alone. Instead of initializing it again (which clears
+ * all the memory and all the decoded instructions), it's reset to a
+ * template with reset_chip8(), which only copies back what the last run
+ * wrote.
+ *
+ * Built with make fuzz-run instead (with FUZZ_STANDALONE defined), it
+ * doesn't need libFuzzer: it runs the inputs given in the command line,
+ * and with -n N also N random mutations of them, and prints how many runs
+ * per second it did */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chip8.h"
+
+#ifndef FUZZ_INSTRUCTIONS
+#define FUZZ_INSTRUCTIONS 512           /* Most instructions run per input */
+#endif
+#define FUZZ_SEED         1             /* Of the random number generator */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static inline unsigned get16(const uint8_t *bytes)
+{
+    return bytes[0] | bytes[1] << 8;
+}
+
+static void set_keys(Chip8 *chip8, uint16_t keys)
+{
+    for (int i = 0; i < MAX_KEYPAD_KEYS; i++) {
+        chip8->key[i] = (keys >> i) & 1;
+    }
+}
+
+/* Runs chip8 up to instruction until. Returns false if it faulted */
+static bool run_until(Chip8 *chip8, unsigned long *done, unsigned long until)
+{
+    while (*done < until) {
+        unsigned long executed;
+        if (run_cycles(chip8, until - *done, &executed) == RUN_FAULT)
+            return false;
+        chip8->shouldDraw = false;
+        *done += executed;
+    }
+    return true;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static Chip8 template, machine;
+    static bool ready = false;
+
+    if (!ready) {
+        init_chip8(&template);
+        template.rng = FUZZ_SEED;
+        machine = template;
+        ready = true;
+    } else {
+        reset_chip8(&machine, &template);
+    }
+
+    if (size < 1 || size < 1 + 4 * (size_t)data[0])
+        return 0;
+
+    const int events = data[0];
+    const uint8_t *event = data + 1;
+    const size_t header = 1 + 4 * events;
+    if (!load_program(&machine, data + header, size - header))
+        return 0;
+
+    unsigned long done = 0;
+    for (int i = 0; i < events; i++, event += 4) {
+        unsigned long until = done + get16(event);
+        if (until > FUZZ_INSTRUCTIONS)
+            until = FUZZ_INSTRUCTIONS;
+        if (!run_until(&machine, &done, until))
+            return 0;
+        set_keys(&machine, get16(event + 2));
+    }
+    run_until(&machine, &done, FUZZ_INSTRUCTIONS);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+#define FUZZ_MAX_INPUT (1 + 4 * 255 + CHIP8_MEMSIZE - 512)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads a whole input. Returns its size */
+static size_t read_input(const char * const filename, uint8_t *data)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "ERROR: COULD NOT OPEN INPUT '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size = fread(data, 1, FUZZ_MAX_INPUT, file);
+    if (ferror(file)) {
+        fprintf(stderr, "ERROR READING INPUT '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    return size;
+}
+
+/* Changes a few bytes of data at random, which is enough to measure how
+ * fast the inputs run and to shake out the simplest crashes. libFuzzer is
+ * much better at finding the rest */
+static void mutate(uint8_t *data, size_t size, uint32_t *rng)
+{
+    int changes = 1 + (*rng >> 28) % 4;
+
+    for (int i = 0; i < changes && size > 0; i++) {
+        *rng = *rng * 1664525u + 1013904223u;
+        data[(*rng >> 8) % size] ^= 1 << (*rng >> 29);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t inputs[64][FUZZ_MAX_INPUT], mutated[FUZZ_MAX_INPUT];
+    static size_t sizes[64];
+    unsigned long mutations = 0;
+    int count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            char *end;
+            mutations = strtoul(argv[++i], &end, 10);
+            if (*end != '\0')
+                count = -1;
+        } else if (argv[i][0] == '-' || count < 0 || count == 64) {
+            count = -1;
+        } else {
+            sizes[count] = read_input(argv[i], inputs[count]);
+            count++;
+        }
+    }
+    if (count <= 0) {
+        printf("Usage: %s [-n MUTATIONS] <INPUT FILE>... (64 at most)\n", *argv);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++) {
+        LLVMFuzzerTestOneInput(inputs[i], sizes[i]);
+    }
+
+    uint32_t rng = FUZZ_SEED;
+    double start = now();
+    for (unsigned long i = 0; i < mutations; i++) {
+        const int n = i % count;
+        memcpy(mutated, inputs[n], sizes[n]);
+        mutate(mutated, sizes[n], &rng);
+        LLVMFuzzerTestOneInput(mutated, sizes[n]);
+    }
+    double elapsed = now() - start;
+
+    printf("%d INPUTS AND %lu MUTATIONS RUN", count, mutations);
+    if (mutations)
+        printf(", %.0f RUNS PER SECOND", mutations / elapsed);
+    putchar('\n');
+    return 0;
+}
+#endif
@@ -0,0 +1,134 @@
+/* Generates decode_table.c, which holds the decoded Instruction of every
+ * possible opcode (all 65536 of them): the function that executes it and its
+ * operands already extracted. Decoding an opcode at run time is then just
+ * indexing the table with it. The makefile runs this program before building
+ * the interpreter */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "opcode_functions.h"
+
+/* Macros to get the arguments of the opcode */
+#define OPCODE_NNN(opcode) ((opcode)  & (0x0FFF))
+#define OPCODE_NN(opcode)  ((opcode)  & (0x00FF))
+#define OPCODE_N(opcode)   ((opcode)  & (0x000F))
+#define OPCODE_X(opcode)   (((opcode) & (0x0F00)) >> 8)
+#define OPCODE_Y(opcode)   (((opcode) & (0x00F0)) >> 4)
+
+/* Name of the function that executes each instruction */
+static const char * const handlers[OPCODE_COUNT] =
+{
+    [OP_INVALID] = "opcode_invalid",
+    [OP_00E0] = "opcode_00E0",
+    [OP_00EE] = "opcode_00EE",
+    [OP_1NNN] = "opcode_1",
+    [OP_2NNN] = "opcode_2",
+    [OP_3XNN] = "opcode_3",
+    [OP_4XNN] = "opcode_4",
+    [OP_5XY0] = "opcode_5",
+    [OP_6XNN] = "opcode_6",
+    [OP_7XNN] = "opcode_7",
+    [OP_8XY0] = "opcode_8XY0",
+    [OP_8XY1] = "opcode_8XY1",
+    [OP_8XY2] = "opcode_8XY2",
+    [OP_8XY3] = "opcode_8XY3",
+    [OP_8XY4] = "opcode_8XY4",
+    [OP_8XY5] = "opcode_8XY5",
+    [OP_8XY6] = "opcode_8XY6",
+    [OP_8XY7] = "opcode_8XY7",
+    [OP_8XYE] = "opcode_8XYE",
+    [OP_9XY0] = "opcode_9",
+    [OP_ANNN] = "opcode_A",
+    [OP_BNNN] = "opcode_B",
+    [OP_CXNN] = "opcode_C",
+    [OP_DXYN] = "opcode_D",
+    [OP_EX9E] = "opcode_EX9E",
+    [OP_EXA1] = "opcode_EXA1",
+    [OP_FX07] = "opcode_FX07",
+    [OP_FX0A] = "opcode_FX0A",
+    [OP_FX15] = "opcode_FX15",
+    [OP_FX18] = "opcode_FX18",
+    [OP_FX1E] = "opcode_FX1E",
+    [OP_FX29] = "opcode_FX29",
+    [OP_FX33] = "opcode_FX33",
+    [OP_FX55] = "opcode_FX55",
+    [OP_FX65] = "opcode_FX65"
+};
+
+/* Instruction of each "family" (the first nibble, most significant 4 bits
+ * of the opcode). The families 0, 8, E and F hold several instructions, so
+ * they are looked up again in their own table. Entries not listed are
+ * OP_INVALID */
+static const uint8_t families_table[16] =
+{
+    [0x1] = OP_1NNN, [0x2] = OP_2NNN, [0x3] = OP_3XNN, [0x4] = OP_4XNN,
+    [0x5] = OP_5XY0, [0x6] = OP_6XNN, [0x7] = OP_7XNN, [0x9] = OP_9XY0,
+    [0xA] = OP_ANNN, [0xB] = OP_BNNN, [0xC] = OP_CXNN, [0xD] = OP_DXYN
+};
+
+/* 00NN, indexed by NN */
+static const uint8_t family_0_table[256] =
+{
+    [0xE0] = OP_00E0, [0xEE] = OP_00EE
+};
+
+/* 8XYN, indexed by N */
+static const uint8_t family_8_table[16] =
+{
+    [0x0] = OP_8XY0, [0x1] = OP_8XY1, [0x2] = OP_8XY2, [0x3] = OP_8XY3,
+    [0x4] = OP_8XY4, [0x5] = OP_8XY5, [0x6] = OP_8XY6, [0x7] = OP_8XY7,
+    [0xE] = OP_8XYE
+};
+
+/* EXNN, indexed by NN */
+static const uint8_t family_E_table[256] =
+{
+    [0x9E] = OP_EX9E, [0xA1] = OP_EXA1
+};
+
+/* FXNN, indexed by NN */
+static const uint8_t family_F_table[256] =
+{
+    [0x07] = OP_FX07, [0x0A] = OP_FX0A, [0x15] = OP_FX15, [0x18] = OP_FX18,
+    [0x1E] = OP_FX1E, [0x29] = OP_FX29, [0x33] = OP_FX33, [0x55] = OP_FX55,
+    [0x65] = OP_FX65
+};
+
+/* Returns the OP_* index of the opcode */
+static int decode_op(uint16_t opcode)
+{
+    switch (opcode >> 12) {
+        case 0x0:
+            return family_0_table[OPCODE_NN(opcode)];
+        case 0x8:
+            return family_8_table[OPCODE_N(opcode)];
+        case 0xE:
+            return family_E_table[OPCODE_NN(opcode)];
+        case 0xF:
+            return family_F_table[OPCODE_NN(opcode)];
+        default:
+            return families_table[opcode >> 12];
+    }
+}
+
+int main(void)
+{
+    puts("/* Generated by gen_decode_table. Do not edit */\n");
+    puts("#include \"opcode_functions.h\"\n");
+    puts("const Instruction decode_table[65536] =\n{");
+
+    for (long i = 0; i <= 0xFFFF; i++) {
+        uint16_t opcode = i;
+        int op = decode_op(opcode);
+
+        /* { execute, opcode, nnn, x, y, n, nn, op } */
+        printf("    { %s, 0x%04X, 0x%03X, 0x%X, 0x%X, 0x%X, 0x%02X, %d }%s\n",
+                handlers[op], opcode, OPCODE_NNN(opcode), OPCODE_X(opcode),
+                OPCODE_Y(opcode), OPCODE_N(opcode), OPCODE_NN(opcode), op,
+                i < 0xFFFF ? "," : "");
+    }
+
+    puts("};");
+    return 0;
+}
@@ -1,3 +1,3 @@
 #!/bin/sh
 
-ctags main.c chip8.c chip8.h opcode_functions.c opcode_functions.h
+ctags main.c chip8.c chip8.h opcode_functions.c opcode_functions.h gen_decode_table.c jit.c jit.h aot.c aot.h fusion.c fusion.h headless.c libchip8.c libchip8.h lockstep.c lockstep.h snapshot.c snapshot.h fork.c fork.h replay.c replay.h profile.c profile.h disasm.c disasm.h tracer.c tracer.h trace.c debugger.c debugger.h fuzz.c
@@ -0,0 +1,345 @@
+/* Runs a list of ROMs without graphics, in parallel, and checks that each
+ * one ends up with the screen it is expected to. Run it with make check,
+ * which checks every ROM in roms/ against roms.manifest.
+ *
+ * Each line of the manifest is a job:
+ *
+ *     <ROM FILE> <INPUT SCRIPT> <INSTRUCTIONS> <HASH>
+ *
+ * The ROM runs for that many instructions, pressing the keys the input
+ * script says (- for none), and the hash of the screen at the end (see
+ * frame_hash()) must be HASH. A HASH of - is never a mismatch, and the
+ * hash found is printed so it can be pasted in the manifest. Lines
+ * starting with # are comments.
+ *
+ * Each line of an input script is an instruction count and the keys held
+ * down from then on, as a mask in hex (bit n is key n):
+ *
+ *     0     0000
+ *     5000  0020     (key 5 down after 5000 instructions)
+ *
+ * Every job runs on its own Chip8 with the random number generator always
+ * seeded the same way, so the results only change when the interpreter
+ * does. Jobs are spread among the threads of a pool, and a thread that
+ * runs out of them takes jobs from the others (work stealing) */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "chip8.h"
+
+#define MAX_JOBS        1024
+#define MAX_EVENTS      1024    /* Lines per input script */
+#define MAX_THREADS     64
+#define HEADLESS_SEED   1       /* Of the random number generator of every job */
+
+/* Keys held down from an instruction on */
+typedef struct key_event {
+    unsigned long at;
+    uint16_t keys;
+} KeyEvent;
+
+typedef struct job {
+    char rom[256];
+    char script[256];
+    unsigned long instructions;
+    bool check;                 /* Whether expected has to match */
+    uint64_t expected;
+
+    uint8_t program[CHIP8_MEMSIZE - 512];
+    size_t program_size;
+    KeyEvent events[MAX_EVENTS];
+    int event_count;
+
+    /* Results */
+    uint64_t hash;
+    unsigned long executed;
+    unsigned long idle_skipped;
+    double elapsed;
+    Fault fault;                /* Why the ROM stopped, FAULT_NONE if it didn't */
+} Job;
+
+/* Jobs left to a thread. It takes them from the tail, and other threads
+ * steal them from the head */
+typedef struct queue {
+    pthread_mutex_t lock;
+    int jobs[MAX_JOBS];
+    int head;
+    int tail;
+} Queue;
+
+typedef struct pool {
+    Job *jobs;
+    Queue queues[MAX_THREADS];
+    int threads;
+} Pool;
+
+typedef struct worker {
+    Pool *pool;
+    int id;
+} Worker;
+
+static void die(const char * const msg, const char * const what)
+{
+    fprintf(stderr, msg, what);
+    exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_program(Job *job)
+{
+    FILE *rom = fopen(job->rom, "rb");
+    if (!rom)
+        die("ERROR: COULD NOT OPEN ROM FILE '%s'\n", job->rom);
+
+    job->program_size = fread(job->program, 1, sizeof(job->program), rom);
+    if (ferror(rom) || fgetc(rom) != EOF)
+        die("ERROR: COULD NOT READ ROM FILE '%s' (OR IT IS TOO BIG)\n", job->rom);
+    fclose(rom);
+}
+
+static void read_script(Job *job)
+{
+    job->event_count = 0;
+    if (strcmp(job->script, "-") == 0)
+        return;
+
+    FILE *script = fopen(job->script, "r");
+    if (!script)
+        die("ERROR: COULD NOT OPEN INPUT SCRIPT '%s'\n", job->script);
+
+    char line[256];
+    while (fgets(line, sizeof(line), script)) {
+        unsigned long at;
+        unsigned int keys;
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (sscanf(line, "%lu %x", &at, &keys) != 2 || keys > 0xFFFF ||
+                job->event_count == MAX_EVENTS)
+            die("ERROR: BAD INPUT SCRIPT '%s'\n", job->script);
+
+        job->events[job->event_count].at = at;
+        job->events[job->event_count].keys = keys;
+        job->event_count++;
+    }
+    fclose(script);
+}
+
+/* Reads the manifest and everything its jobs need. Returns the number of
+ * jobs */
+static int read_manifest(const char * const filename, Job *jobs)
+{
+    FILE *manifest = fopen(filename, "r");
+    if (!manifest)
+        die("ERROR: COULD NOT OPEN MANIFEST '%s'\n", filename);
+
+    int count = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), manifest)) {
+        char hash[32];
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (count == MAX_JOBS)
+            die("ERROR: TOO MANY JOBS IN '%s'\n", filename);
+
+        Job *job = &jobs[count];
+        if (sscanf(line, "%255s %255s %lu %31s", job->rom, job->script,
+                    &job->instructions, hash) != 4)
+            die("ERROR: BAD LINE IN MANIFEST: %s", line);
+
+        job->check = strcmp(hash, "-") != 0;
+        if (job->check && sscanf(hash, "%" SCNx64, &job->expected) != 1)
+            die("ERROR: BAD HASH IN MANIFEST: %s", line);
+
+        read_program(job);
+        read_script(job);
+        count++;
+    }
+    fclose(manifest);
+    return count;
+}
+
+static void set_keys(Chip8 *chip8, uint16_t keys)
+{
+    for (int i = 0; i < MAX_KEYPAD_KEYS; i++) {
+        chip8->key[i] = (keys >> i) & 1;
+    }
+}
+
+/* Runs the ROM of a job for its instructions, changing the keys when the
+ * script says. run_cycles() is asked to stop right at every change */
+static void run_job(Job *job, Chip8 *chip8)
+{
+    init_chip8(chip8);
+    chip8->rng = HEADLESS_SEED;
+    load_program(chip8, job->program, job->program_size);
+
+    unsigned long done = 0;
+    int next = 0;
+    double start = now();
+
+    while (done < job->instructions) {
+        while (next < job->event_count && job->events[next].at <= done) {
+            set_keys(chip8, job->events[next++].keys);
+        }
+
+        unsigned long until = job->instructions;
+        if (next < job->event_count && job->events[next].at < until)
+            until = job->events[next].at;
+
+        unsigned long executed;
+        run_cycles(chip8, until - done, &executed);
+        chip8->shouldDraw = false;
+        done += executed;
+    }
+
+    job->elapsed = now() - start;
+    job->executed = done;
+    job->idle_skipped = chip8->idle_skipped;
+    job->fault = chip8->fault;
+    job->hash = frame_hash(chip8);
+}
+
+/* Takes the next job of the queue of the thread, or steals one from the
+ * others. Returns -1 when there are none left */
+static int next_job(Pool *pool, int id)
+{
+    Queue *own = &pool->queues[id];
+    int job = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail)
+        job = own->jobs[--own->tail];
+    pthread_mutex_unlock(&own->lock);
+
+    for (int i = 1; job < 0 && i < pool->threads; i++) {
+        Queue *victim = &pool->queues[(id + i) % pool->threads];
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail)
+            job = victim->jobs[victim->head++];
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return job;
+}
+
+static void *work(void *data)
+{
+    Worker *worker = data;
+    Chip8 *chip8 = malloc(sizeof(Chip8));
+    if (!chip8)
+        die("ERROR: %s\n", "NOT ENOUGH MEMORY");
+
+    int job;
+    while ((job = next_job(worker->pool, worker->id)) >= 0) {
+        run_job(&worker->pool->jobs[job], chip8);
+    }
+
+    free(chip8);
+    return NULL;
+}
+
+/* Runs all the jobs, dealt to the queues of the threads in turns */
+static void run_pool(Pool *pool, int count)
+{
+    pthread_t threads[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+
+    for (int i = 0; i < pool->threads; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        pool->queues[i].head = pool->queues[i].tail = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        Queue *queue = &pool->queues[i % pool->threads];
+        queue->jobs[queue->tail++] = i;
+    }
+
+    for (int i = 0; i < pool->threads; i++) {
+        workers[i].pool = pool;
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, work, &workers[i]) != 0)
+            die("ERROR: %s\n", "COULD NOT CREATE THREADS");
+    }
+    for (int i = 0; i < pool->threads; i++) {
+        pthread_join(threads[i], NULL);
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    }
+}
+
+static void usage(const char * const program)
+{
+    printf("Usage: %s [-j THREADS] <MANIFEST>\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    static Job jobs[MAX_JOBS];
+    const char *manifest = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            char *end;
+            threads = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || threads < 1)
+                usage(*argv);
+        } else if (argv[i][0] == '-' || manifest) {
+            usage(*argv);
+        } else {
+            manifest = argv[i];
+        }
+    }
+    if (!manifest)
+        usage(*argv);
+
+    int count = read_manifest(manifest, jobs);
+    static Pool pool;
+    pool.jobs = jobs;
+    pool.threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+    if (pool.threads > count && count > 0)
+        pool.threads = count;
+
+    double start = now();
+    run_pool(&pool, count);
+    double elapsed = now() - start;
+
+    int mismatches = 0;
+    unsigned long total = 0;
+    for (int i = 0; i < count; i++) {
+        Job *job = &jobs[i];
+        const char *result = !job->check ? "NEW " : job->hash == job->expected ? "OK  " : "FAIL";
+
+        printf("%s %s: %016" PRIx64 ", %lu INSTRUCTIONS (%lu IDLE) IN %.3f s, %.2f MIPS",
+                result, job->rom, job->hash, job->executed, job->idle_skipped, job->elapsed,
+                job->elapsed > 0 ? job->executed / job->elapsed / 1e6 : 0);
+        if (job->check && job->hash != job->expected) {
+            printf(", EXPECTED %016" PRIx64, job->expected);
+            mismatches++;
+        }
+        if (job->fault != FAULT_NONE)
+            printf(", %s", fault_name(job->fault));
+        putchar('\n');
+        total += job->executed;
+    }
+
+    printf("%d JOBS, %d MISMATCHES, %lu INSTRUCTIONS IN %.3f s ON %d THREADS (%.2f MIPS)\n",
+            count, mismatches, total, elapsed, pool.threads,
+            elapsed > 0 ? total / elapsed / 1e6 : 0);
+
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,653 @@
+/* Dynamic recompiler for x86-64. Translates blocks of CHIP-8 code into
+ * native code, which is then called directly by run_cycles() instead of
+ * dispatching every instruction through the opcodes table.
+ *
+ * A block is the code from an address on, in order. The instructions that
+ * touch registers (6XNN, 7XNN, 8XYN, ANNN, CXNN, FX1E and FX29) and the
+ * skips (3XNN, 4XNN, 5XY0, 9XY0, EX9E and EXA1) are translated in place. A
+ * skip is a conditional branch over the next instruction, so it doesn't end
+ * the block. Jumps (1NNN, BNNN), calls (2NNN), returns (00EE) and the
+ * instructions that draw (00E0, DXYN, which call the handler of the
+ * interpreter) leave the block, but the translation goes on after them as
+ * long as a skip before may land there. A block also ends right before any
+ * other instruction, which is left to the interpreter. That includes the
+ * ones that read or write memory, the timers, or wait for a key, so a block
+ * never has side effects that the interpreter must see in the middle of it.
+ *
+ * The generated code follows the System V calling convention: the only
+ * argument (RDI) is the pointer to the Chip8 struct, and the CHIP-8
+ * registers are read and written directly in it. ESI counts the skips
+ * taken, so every exit returns the number of instructions executed in EAX:
+ * the ones before it in the block, minus ESI. A call or a return that
+ * would fault leaves the block right before it, so the interpreter runs it
+ * and faults.
+ *
+ * The code buffer is never writable and executable at once: it's made
+ * writable to copy a block in, and executable again afterwards */
+
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE        (256 * 1024)  /* Executable memory per instance */
+#define JIT_MAX_BLOCK        64            /* Max instructions per block */
+#define JIT_MAX_BLOCK_BYTES  (JIT_MAX_BLOCK * 128)
+
+/* x86 registers, as encoded in the reg field of the ModRM byte */
+#define AL 0
+#define CL 1
+#define DL 2
+
+/* Condition codes of jcc (0x70 + cc for rel8, 0x0F 0x80 + cc for rel32) */
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+
+/* Displacements of the fields of the Chip8 struct from RDI */
+#define V_DISP(x)  ((uint32_t)(offsetof(Chip8, V) + (x)))
+#define I_DISP     ((uint32_t)offsetof(Chip8, I))
+#define PC_DISP    ((uint32_t)offsetof(Chip8, pc))
+#define SP_DISP    ((uint32_t)offsetof(Chip8, sp))
+#define STACK_DISP ((uint32_t)offsetof(Chip8, stack))
+#define KEY_DISP   ((uint32_t)offsetof(Chip8, key))
+#define RNG_DISP   ((uint32_t)offsetof(Chip8, rng))
+
+/* Returns the number of instructions executed */
+typedef int (*Block)(Chip8 *);
+
+typedef struct jit {
+    uint8_t *code;                          /* Code buffer, executable but not writable */
+    size_t used;                            /* Bytes of the buffer in use */
+    Block entry[CHIP8_MEMSIZE];             /* Block that starts at each address */
+    bool untranslatable[CHIP8_MEMSIZE];     /* Addresses left to the interpreter */
+    bool translated[CHIP8_MEMSIZE];         /* Bytes that belong to a block */
+} Jit;
+
+/* A branch of the block being translated to an instruction not emitted yet */
+typedef struct branch {
+    size_t at;                              /* Of its rel32 in the code */
+    uint16_t target;                        /* CHIP-8 address it goes to */
+} Branch;
+
+/* Code of a block being translated */
+typedef struct emitter {
+    uint8_t buf[JIT_MAX_BLOCK_BYTES];
+    size_t len;
+    uint16_t start;                         /* Address of the block */
+    Branch pending[JIT_MAX_BLOCK];          /* Branches waiting for their target */
+    int pending_count;
+} Emitter;
+
+/* What happened when translating an instruction */
+enum {
+    JIT_NEXT,            /* Translated, keep going */
+    JIT_EXIT,            /* Translated, and it leaves the block */
+    JIT_UNSUPPORTED      /* Must be run by the interpreter */
+};
+
+static void emit8(Emitter *e, uint8_t b)
+{
+    e->buf[e->len++] = b;
+}
+
+static void emit16(Emitter *e, uint16_t w)
+{
+    emit8(e, w & 0xFF);
+    emit8(e, w >> 8);
+}
+
+static void emit32(Emitter *e, uint32_t d)
+{
+    emit16(e, d & 0xFFFF);
+    emit16(e, d >> 16);
+}
+
+static void emit64(Emitter *e, uint64_t q)
+{
+    emit32(e, q & 0xFFFFFFFF);
+    emit32(e, q >> 32);
+}
+
+/* Emits <op> reg, [RDI + disp] (or the other way around, depending on op) */
+static void emit_mem(Emitter *e, uint8_t op, uint8_t reg, uint32_t disp)
+{
+    emit8(e, op);
+    emit8(e, 0x87 | (reg << 3));    /* mod = 10 (disp32), rm = 111 (RDI) */
+    emit32(e, disp);
+}
+
+/* Emits <op> reg, [RDI + RAX * scale + disp] */
+static void emit_indexed(Emitter *e, uint8_t op, uint8_t reg, uint8_t scale, uint32_t disp)
+{
+    emit8(e, op);
+    emit8(e, 0x84 | (reg << 3));    /* mod = 10 (disp32), rm = 100 (SIB) */
+    emit8(e, (scale == 2 ? 0x40 : 0x00) | 0x07);  /* index = RAX, base = RDI */
+    emit32(e, disp);
+}
+
+/* mov word [RDI + disp], imm16 */
+static void emit_store16(Emitter *e, uint32_t disp, uint16_t imm)
+{
+    emit8(e, 0x66);
+    emit_mem(e, 0xC7, 0, disp);
+    emit16(e, imm);
+}
+
+/* Emits a jcc rel8 whose target is set later with land() */
+static size_t emit_jcc8(Emitter *e, uint8_t cc)
+{
+    emit8(e, 0x70 | cc);
+    emit8(e, 0);
+    return e->len - 1;
+}
+
+/* Makes the rel8 at offset at jump to here */
+static void land(Emitter *e, size_t at)
+{
+    e->buf[at] = e->len - (at + 1);
+}
+
+/* Returns to run_cycles() the instructions executed: count, minus the
+ * ones skipped */
+static void emit_return(Emitter *e, int count)
+{
+    emit8(e, 0xB8), emit32(e, count);                   /* mov eax, count */
+    emit8(e, 0x29), emit8(e, 0xF0);                     /* sub eax, esi */
+    emit8(e, 0xC3);                                     /* ret */
+}
+
+/* Leaves the block at target, after count instructions of it */
+static void emit_exit(Emitter *e, uint16_t target, int count)
+{
+    emit_store16(e, PC_DISP, target);
+    emit_return(e, count);
+}
+
+/* Instructions of the block up to (not including) addr */
+static int before(const Emitter *e, uint16_t addr)
+{
+    return (addr - e->start) / 2;
+}
+
+/* Emits the jump taken by a skip at addr: counts the instruction skipped
+ * and goes to addr + 4 */
+static void emit_skip_taken(Emitter *e, uint16_t addr)
+{
+    emit8(e, 0xFF), emit8(e, 0xC6);                     /* inc esi */
+    emit8(e, 0xE9), emit32(e, 0);                       /* jmp rel32 */
+    e->pending[e->pending_count++] = (Branch){ e->len - 4, addr + 4 };
+}
+
+/* Emits a skip whose cmp already set the flags. The next instruction is
+ * skipped if the condition cc is false */
+static int emit_skip(Emitter *e, uint16_t addr, uint8_t cc)
+{
+    size_t taken = emit_jcc8(e, cc);
+    emit_skip_taken(e, addr);
+    land(e, taken);
+    return JIT_NEXT;
+}
+
+/* Emits EX9E (if pressed is true) or EXA1. Keys past F are never pressed */
+static int emit_skip_key(Emitter *e, uint16_t addr, uint8_t x, bool pressed)
+{
+    emit8(e, 0x0F), emit_mem(e, 0xB6, AL, V_DISP(x));   /* movzx eax, VX */
+    emit8(e, 0x3C), emit8(e, MAX_KEYPAD_KEYS);          /* cmp al, 16 */
+    size_t past = emit_jcc8(e, CC_AE);
+    emit_indexed(e, 0x80, 7, 1, KEY_DISP);              /* cmp byte [key + rax], 0 */
+    emit8(e, 0);
+
+    if (pressed) {
+        size_t released = emit_jcc8(e, CC_E);
+        emit_skip_taken(e, addr);
+        land(e, past);
+        land(e, released);
+    } else {
+        size_t held = emit_jcc8(e, CC_NE);
+        land(e, past);
+        emit_skip_taken(e, addr);
+        land(e, held);
+    }
+    return JIT_NEXT;
+}
+
+/* Leaves the block through the handler of the interpreter, which runs the
+ * instruction at addr and sets pc */
+static int emit_handler_exit(Emitter *e, uint16_t opcode, uint16_t addr)
+{
+    const Instruction * const ins = &decode_table[opcode];
+
+    emit_store16(e, PC_DISP, addr);
+    emit8(e, 0xB8), emit32(e, before(e, addr) + 1);     /* mov eax, count */
+    emit8(e, 0x29), emit8(e, 0xF0);                     /* sub eax, esi */
+    emit8(e, 0x50);                                     /* push rax, which aligns the stack */
+    emit8(e, 0x48), emit8(e, 0xBE), emit64(e, (uintptr_t)ins);            /* mov rsi, ins */
+    emit8(e, 0x48), emit8(e, 0xB8), emit64(e, (uintptr_t)ins->execute);   /* mov rax, handler */
+    emit8(e, 0xFF), emit8(e, 0xD0);                     /* call rax */
+    emit8(e, 0x58);                                     /* pop rax */
+    emit8(e, 0xC3);                                     /* ret */
+    return JIT_EXIT;
+}
+
+/* Emits 00EE. With an empty stack, it leaves the block right before it */
+static int emit_return_from(Emitter *e, uint16_t addr)
+{
+    emit8(e, 0x0F), emit_mem(e, 0xB7, AL, SP_DISP);     /* movzx eax, sp */
+    emit8(e, 0x85), emit8(e, 0xC0);                     /* test eax, eax */
+    size_t nonempty = emit_jcc8(e, CC_NE);
+    emit_exit(e, addr, before(e, addr));
+    land(e, nonempty);
+
+    emit8(e, 0xFF), emit8(e, 0xC8);                     /* dec eax */
+    emit8(e, 0x66), emit_mem(e, 0x89, AL, SP_DISP);     /* mov sp, ax */
+    emit8(e, 0x0F), emit_indexed(e, 0xB7, AL, 2, STACK_DISP);  /* movzx eax, stack[rax] */
+    emit8(e, 0x83), emit8(e, 0xC0), emit8(e, 2);        /* add eax, 2 */
+    emit8(e, 0x66), emit_mem(e, 0x89, AL, PC_DISP);     /* mov pc, ax */
+    emit_return(e, before(e, addr) + 1);
+    return JIT_EXIT;
+}
+
+/* Emits 2NNN. With a full stack, it leaves the block right before it */
+static int emit_call(Emitter *e, uint16_t addr, uint16_t nnn)
+{
+    emit8(e, 0x0F), emit_mem(e, 0xB7, AL, SP_DISP);     /* movzx eax, sp */
+    emit8(e, 0x83), emit8(e, 0xF8), emit8(e, MAX_STACK_LEVELS);  /* cmp eax, 16 */
+    size_t room = emit_jcc8(e, CC_NE);
+    emit_exit(e, addr, before(e, addr));
+    land(e, room);
+
+    emit8(e, 0x66), emit_indexed(e, 0xC7, 0, 2, STACK_DISP);  /* mov stack[rax], addr */
+    emit16(e, addr);
+    emit8(e, 0xFF), emit8(e, 0xC0);                     /* inc eax */
+    emit8(e, 0x66), emit_mem(e, 0x89, AL, SP_DISP);     /* mov sp, ax */
+    emit_exit(e, nnn, before(e, addr) + 1);
+    return JIT_EXIT;
+}
+
+/* Emits the code of the 8XYN family. The C code of family_8 is translated
+ * literally, including the order in which VF is written, so the results
+ * are the same as the interpreter's when X or Y is F */
+static int emit_family_8(Emitter *e, uint8_t x, uint8_t y, uint8_t n)
+{
+    switch (n) {
+        case 0x0:
+            emit_mem(e, 0x8A, AL, V_DISP(y));     /* mov al, VY */
+            emit_mem(e, 0x88, AL, V_DISP(x));     /* mov VX, al */
+            break;
+
+        case 0x1:
+        case 0x2:
+        case 0x3: {
+            /* or/and/xor VX, al */
+            static const uint8_t ops[] = { 0, 0x08, 0x20, 0x30 };
+            emit_mem(e, 0x8A, AL, V_DISP(y));
+            emit_mem(e, ops[n], AL, V_DISP(x));
+            break;
+        }
+
+        case 0x4:
+            emit_mem(e, 0x8A, AL, V_DISP(x));     /* mov al, VX */
+            emit_mem(e, 0x02, AL, V_DISP(y));     /* add al, VY */
+            emit8(e, 0x0F), emit8(e, 0x92), emit8(e, 0xC0);  /* setc al */
+            emit_mem(e, 0x88, AL, V_DISP(0xF));   /* mov VF, al */
+            emit_mem(e, 0x8A, AL, V_DISP(x));
+            emit_mem(e, 0x02, AL, V_DISP(y));
+            emit_mem(e, 0x88, AL, V_DISP(x));
+            break;
+
+        case 0x5:
+        case 0x7: {
+            /* VX = VX - VY or VX = VY - VX. VF = 1 if there's no borrow */
+            uint8_t minuend = (n == 0x5) ? x : y;
+            uint8_t subtrahend = (n == 0x5) ? y : x;
+            emit_mem(e, 0x8A, AL, V_DISP(minuend));
+            emit_mem(e, 0x3A, AL, V_DISP(subtrahend));    /* cmp */
+            emit8(e, 0x0F), emit8(e, 0x93), emit8(e, 0xC0);  /* setae al */
+            emit_mem(e, 0x88, AL, V_DISP(0xF));
+            emit_mem(e, 0x8A, AL, V_DISP(minuend));
+            emit_mem(e, 0x2A, AL, V_DISP(subtrahend));    /* sub */
+            emit_mem(e, 0x88, AL, V_DISP(x));
+            break;
+        }
+
+        case 0x6:
+        case 0xE:
+            /* VF = bit shifted out of VX, VY = VX = VY shifted */
+            emit_mem(e, 0x8A, AL, V_DISP(x));
+            emit8(e, 0x24), emit8(e, (n == 0x6) ? 0x01 : 0x80);  /* and al, imm8 */
+            emit_mem(e, 0x88, AL, V_DISP(0xF));
+            emit_mem(e, 0x8A, AL, V_DISP(y));
+            emit8(e, 0xD0), emit8(e, (n == 0x6) ? 0xE8 : 0xE0);  /* shr/shl al, 1 */
+            emit_mem(e, 0x88, AL, V_DISP(y));
+            emit_mem(e, 0x88, AL, V_DISP(x));
+            break;
+
+        default:
+            return JIT_UNSUPPORTED;
+    }
+    return JIT_NEXT;
+}
+
+/* Emits the code of the instruction at addr */
+static int emit_instruction(Emitter *e, uint16_t opcode, uint16_t addr)
+{
+    uint16_t nnn = opcode & 0x0FFF;
+    uint8_t nn = opcode & 0x00FF;
+    uint8_t n = opcode & 0x000F;
+    uint8_t x = (opcode & 0x0F00) >> 8;
+    uint8_t y = (opcode & 0x00F0) >> 4;
+
+    switch (opcode >> 12) {
+        case 0x0:
+            if (opcode == 0x00E0)
+                return emit_handler_exit(e, opcode, addr);
+            if (opcode == 0x00EE)
+                return emit_return_from(e, addr);
+            return JIT_UNSUPPORTED;
+
+        /* 1NNN. Bad addresses are left to the interpreter, which faults */
+        case 0x1:
+            if (nnn < 0x200)
+                return JIT_UNSUPPORTED;
+            emit_exit(e, nnn, before(e, addr) + 1);
+            return JIT_EXIT;
+
+        /* 2NNN. The same */
+        case 0x2:
+            if (nnn < 0x200)
+                return JIT_UNSUPPORTED;
+            return emit_call(e, addr, nnn);
+
+        /* 3XNN and 4XNN: cmp byte VX, imm8 */
+        case 0x3:
+        case 0x4:
+            emit_mem(e, 0x80, 7, V_DISP(x));
+            emit8(e, nn);
+            return emit_skip(e, addr, (opcode >> 12) == 0x3 ? CC_NE : CC_E);
+
+        /* 5XY0 and 9XY0 */
+        case 0x5:
+        case 0x9:
+            if (n != 0)
+                return JIT_UNSUPPORTED;
+            emit_mem(e, 0x8A, AL, V_DISP(x));
+            emit_mem(e, 0x3A, AL, V_DISP(y));
+            return emit_skip(e, addr, (opcode >> 12) == 0x5 ? CC_NE : CC_E);
+
+        /* 6XNN: mov byte VX, imm8 */
+        case 0x6:
+            emit_mem(e, 0xC6, 0, V_DISP(x));
+            emit8(e, nn);
+            return JIT_NEXT;
+
+        /* 7XNN: add byte VX, imm8 */
+        case 0x7:
+            emit_mem(e, 0x80, 0, V_DISP(x));
+            emit8(e, nn);
+            return JIT_NEXT;
+
+        case 0x8:
+            return emit_family_8(e, x, y, n);
+
+        /* ANNN */
+        case 0xA:
+            emit_store16(e, I_DISP, nnn);
+            return JIT_NEXT;
+
+        /* BNNN: pc = NNN + V0 */
+        case 0xB:
+            emit8(e, 0x0F), emit_mem(e, 0xB6, AL, V_DISP(0));   /* movzx eax, V0 */
+            emit8(e, 0x05), emit32(e, nnn);                     /* add eax, nnn */
+            emit8(e, 0x66), emit_mem(e, 0x89, AL, PC_DISP);     /* mov pc, ax */
+            emit_return(e, before(e, addr) + 1);
+            return JIT_EXIT;
+
+        /* CXNN, with the generator of chip8_random() */
+        case 0xC:
+            emit_mem(e, 0x8B, AL, RNG_DISP);                    /* mov eax, rng */
+            emit8(e, 0x69), emit8(e, 0xC0), emit32(e, 1664525u);    /* imul eax, eax, imm32 */
+            emit8(e, 0x05), emit32(e, 1013904223u);             /* add eax, imm32 */
+            emit_mem(e, 0x89, AL, RNG_DISP);                    /* mov rng, eax */
+            emit8(e, 0xC1), emit8(e, 0xE8), emit8(e, 24);       /* shr eax, 24 */
+            emit8(e, 0x24), emit8(e, nn);                       /* and al, nn */
+            emit_mem(e, 0x88, AL, V_DISP(x));
+            return JIT_NEXT;
+
+        case 0xD:
+            return emit_handler_exit(e, opcode, addr);
+
+        case 0xE:
+            if (nn == 0x9E || nn == 0xA1)
+                return emit_skip_key(e, addr, x, nn == 0x9E);
+            return JIT_UNSUPPORTED;
+
+        case 0xF:
+            if (nn == 0x1E) {
+                emit8(e, 0x0F), emit_mem(e, 0xB7, AL, I_DISP);      /* movzx eax, I */
+                emit8(e, 0x0F), emit_mem(e, 0xB6, CL, V_DISP(x));   /* movzx ecx, VX */
+                emit8(e, 0x01), emit8(e, 0xC8);                     /* add eax, ecx */
+                emit8(e, 0x3D), emit32(e, 0xFFF);                   /* cmp eax, 0xFFF */
+                emit8(e, 0x0F), emit8(e, 0x97), emit8(e, 0xC2);     /* seta dl */
+                emit_mem(e, 0x88, DL, V_DISP(0xF));
+                emit8(e, 0x0F), emit_mem(e, 0xB6, CL, V_DISP(x));
+                emit8(e, 0x66), emit_mem(e, 0x01, CL, I_DISP);      /* add I, cx */
+                return JIT_NEXT;
+            }
+            if (nn == 0x29) {
+                emit8(e, 0x0F), emit_mem(e, 0xB6, AL, V_DISP(x));   /* movzx eax, VX */
+                emit8(e, 0x8D), emit8(e, 0x04), emit8(e, 0x80);     /* lea eax, [rax + rax * 4] */
+                emit8(e, 0x66), emit_mem(e, 0x89, AL, I_DISP);      /* mov I, ax */
+                return JIT_NEXT;
+            }
+            return JIT_UNSUPPORTED;
+
+        default:
+            return JIT_UNSUPPORTED;
+    }
+}
+
+/* Forgets every translated block */
+static void flush(Jit *jit)
+{
+    jit->used = 0;
+    memset(jit->entry, 0, sizeof(jit->entry));
+    memset(jit->untranslatable, 0, sizeof(jit->untranslatable));
+    memset(jit->translated, 0, sizeof(jit->translated));
+}
+
+/* Makes the branches to addr land at offset at of the code */
+static void resolve(Emitter *e, uint16_t addr, size_t at)
+{
+    for (int i = 0; i < e->pending_count; i++) {
+        if (e->pending[i].target != addr)
+            continue;
+        uint32_t rel = at - (e->pending[i].at + 4);
+        memcpy(&e->buf[e->pending[i].at], &rel, 4);
+        e->pending[i--] = e->pending[--e->pending_count];
+    }
+}
+
+/* Whether a branch still has to land at addr or after it */
+static bool reachable(const Emitter *e, uint16_t addr)
+{
+    for (int i = 0; i < e->pending_count; i++) {
+        if (e->pending[i].target >= addr)
+            return true;
+    }
+    return false;
+}
+
+/* Translates the block that starts at address start. Returns false if its
+ * first instruction can't be translated */
+static bool translate(Jit *jit, const Chip8 *chip8, uint16_t start)
+{
+    Emitter e;
+    uint16_t addr = start;
+    int count = 0;
+    bool falls_through = true;
+
+    e.len = 0;
+    e.start = start;
+    e.pending_count = 0;
+    emit8(&e, 0x31), emit8(&e, 0xF6);                   /* xor esi, esi */
+
+    while (count < JIT_MAX_BLOCK && addr + 1 < CHIP8_MEMSIZE) {
+        /* After an exit, only a skip can get here */
+        if (!falls_through && !reachable(&e, addr))
+            break;
+
+        uint16_t opcode = (chip8->memory[addr] << 8) | chip8->memory[addr + 1];
+        size_t len = e.len;
+        int result = emit_instruction(&e, opcode, addr);
+
+        if (result == JIT_UNSUPPORTED) {
+            e.len = len;
+            break;
+        }
+        resolve(&e, addr, len);
+
+        falls_through = (result == JIT_NEXT);
+        addr += 2;
+        count++;
+    }
+
+    if (count == 0) {
+        jit->untranslatable[start] = true;
+        return false;
+    }
+
+    /* Fell through into an instruction for the interpreter */
+    if (falls_through) {
+        resolve(&e, addr, e.len);
+        emit_exit(&e, addr, before(&e, addr));
+    }
+
+    /* Skips that land past the last instruction translated */
+    while (e.pending_count > 0) {
+        uint16_t target = e.pending[0].target;
+        resolve(&e, target, e.len);
+        emit_exit(&e, target, before(&e, target));
+    }
+
+    if (jit->used + e.len > JIT_CODE_SIZE)
+        flush(jit);
+
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE);
+    memcpy(jit->code + jit->used, e.buf, e.len);
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+    jit->entry[start] = (Block)(jit->code + jit->used);
+    jit->used += e.len;
+
+    for (int i = start; i < addr; i++) {
+        jit->translated[i] = true;
+    }
+
+    return true;
+}
+
+/* Enables the recompiler for this instance. Returns false if the executable
+ * memory could not be allocated */
+bool jit_enable(Chip8 *chip8)
+{
+    if (chip8->jit)
+        return true;
+
+    Jit *jit = malloc(sizeof(Jit));
+    if (!jit)
+        return false;
+
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return false;
+    }
+
+    flush(jit);
+    chip8->jit = jit;
+    return true;
+}
+
+/* Frees the translated code. The instance goes back to the interpreter */
+void jit_disable(Chip8 *chip8)
+{
+    if (!chip8->jit)
+        return;
+
+    munmap(chip8->jit->code, JIT_CODE_SIZE);
+    free(chip8->jit);
+    chip8->jit = NULL;
+}
+
+/* Runs the block at pc, translating it first if needed. Returns the number
+ * of instructions executed, or 0 if the interpreter must run the
+ * instruction at pc */
+int jit_execute(Chip8 *chip8)
+{
+    Jit *jit = chip8->jit;
+    uint16_t pc = chip8->pc;
+
+    if (!jit || pc >= CHIP8_MEMSIZE || jit->untranslatable[pc])
+        return 0;
+
+    if (!jit->entry[pc] && !translate(jit, chip8, pc))
+        return 0;
+
+    return jit->entry[pc](chip8);
+}
+
+/* Called when memory[first] to memory[last] was written. If any of these
+ * bytes was translated, all the blocks are thrown away. Self modifying code
+ * is rare enough that it's not worth tracking which blocks to keep. Only
+ * the bytes written count: blocks often end right before data, which the
+ * program writes all the time */
+void jit_invalidate(Chip8 *chip8, int first, int last)
+{
+    Jit *jit = chip8->jit;
+
+    if (!jit)
+        return;
+
+    for (int i = first; i <= last; i++) {
+        if (jit->translated[i]) {
+            flush(jit);
+            return;
+        }
+    }
+
+    /* The instruction that starts one byte before is a different one now */
+    for (int i = first > 0 ? first - 1 : 0; i <= last; i++) {
+        jit->untranslatable[i] = false;
+    }
+}
+
+#else
+
+/* There is no recompiler for this platform, everything is interpreted */
+
+bool jit_enable(Chip8 *chip8)
+{
+    return false;
+}
+
+void jit_disable(Chip8 *chip8)
+{
+}
+
+int jit_execute(Chip8 *chip8)
+{
+    return 0;
+}
+
+void jit_invalidate(Chip8 *chip8, int first, int last)
+{
+}
+
+#endif
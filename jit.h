@@ -0,0 +1,12 @@
+#ifndef _JIT_HEADER_
+#define _JIT_HEADER_
+
+#include <stdbool.h>
+#include "chip8.h"
+
+bool jit_enable(Chip8 *);
+void jit_disable(Chip8 *);
+int  jit_execute(Chip8 *);
+void jit_invalidate(Chip8 *, int, int);
+
+#endif /* _JIT_HEADER_ */
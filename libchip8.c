@@ -0,0 +1,151 @@
+/* Batches of machines for programs that embed the interpreter (see
+ * libchip8.h). The machines are kept in a single array, and a step runs
+ * them one after another with run_cycles() */
+
+#include <stdlib.h>
+#include <string.h>
+#include "libchip8.h"
+
+struct chip8_batch {
+    Chip8 *machines;
+    int count;
+    uint8_t program[CHIP8_MEMSIZE - 512];
+    size_t program_size;
+    uint32_t seed;                     /* Machine n is seeded with seed + n */
+    Chip8Reward reward;
+    void *reward_data;
+};
+
+/* Creates count machines that run the program given (size bytes, copied),
+ * with their random number generators seeded from seed, so the same batch
+ * always behaves the same. Returns NULL if the program doesn't fit in
+ * memory or there is not enough memory for the machines */
+Chip8Batch *chip8_batch_create(int count, const uint8_t *program, size_t size, uint32_t seed)
+{
+    if (count <= 0 || size > CHIP8_MEMSIZE - 512)
+        return NULL;
+
+    Chip8Batch *batch = malloc(sizeof(Chip8Batch));
+    if (!batch)
+        return NULL;
+
+    batch->machines = malloc(count * sizeof(Chip8));
+    if (!batch->machines) {
+        free(batch);
+        return NULL;
+    }
+
+    batch->count = count;
+    memcpy(batch->program, program, size);
+    batch->program_size = size;
+    batch->seed = seed;
+    batch->reward = NULL;
+    batch->reward_data = NULL;
+
+    for (int i = 0; i < count; i++) {
+        chip8_batch_reset(batch, i);
+    }
+    return batch;
+}
+
+void chip8_batch_destroy(Chip8Batch *batch)
+{
+    if (!batch)
+        return;
+
+    free(batch->machines);
+    free(batch);
+}
+
+/* Starts machine index over, as it was when the batch was created */
+void chip8_batch_reset(Chip8Batch *batch, int index)
+{
+    Chip8 *machine = &batch->machines[index];
+
+    init_chip8(machine);
+    machine->rng = batch->seed + index;
+    load_program(machine, batch->program, batch->program_size);
+}
+
+/* Sets the function that computes the rewards of chip8_batch_step(). data
+ * is passed to it as is */
+void chip8_batch_set_reward(Chip8Batch *batch, Chip8Reward reward, void *data)
+{
+    batch->reward = reward;
+    batch->reward_data = data;
+}
+
+/* The pixels of each byte of a row, one per byte */
+#define SPREAD(b)   { (b) >> 7 & 1, (b) >> 6 & 1, (b) >> 5 & 1, (b) >> 4 & 1, \
+                      (b) >> 3 & 1, (b) >> 2 & 1, (b) >> 1 & 1, (b) & 1 }
+#define SPREAD4(b)  SPREAD(b), SPREAD((b) + 1), SPREAD((b) + 2), SPREAD((b) + 3)
+#define SPREAD16(b) SPREAD4(b), SPREAD4((b) + 4), SPREAD4((b) + 8), SPREAD4((b) + 12)
+#define SPREAD64(b) SPREAD16(b), SPREAD16((b) + 16), SPREAD16((b) + 32), SPREAD16((b) + 48)
+
+static const uint8_t spread[256][8] = {
+    SPREAD64(0), SPREAD64(64), SPREAD64(128), SPREAD64(192)
+};
+
+/* Writes the screen of a machine to observation, in the format given */
+static void observe(const Chip8 *machine, Chip8Observation format, void *observation)
+{
+    if (format == CHIP8_OBSERVE_BITS) {
+        memcpy(observation, machine->gfx, sizeof(machine->gfx));
+        return;
+    }
+
+    /* 8 pixels at a time (see spread) */
+    uint8_t *pixels = observation;
+    for (int row = 0; row < CHIP8_DISPLAY_HEIGHT; row++) {
+        const uint64_t bits = machine->gfx[row];
+        for (int shift = CHIP8_DISPLAY_WIDTH - 8; shift >= 0; shift -= 8) {
+            memcpy(pixels, spread[(bits >> shift) & 0xFF], 8);
+            pixels += 8;
+        }
+    }
+}
+
+/* Runs every machine for the given number of instructions, with the keys
+ * of its action held down (actions[n] is the keys of machine n, bit k is
+ * key k). Then writes the observation of machine n at observations +
+ * n * CHIP8_OBSERVATION_SIZE(format), and its reward (if there is a reward
+ * function) at rewards[n]. observations and rewards may be NULL */
+void chip8_batch_step(Chip8Batch *batch, const uint16_t *actions, unsigned long instructions,
+        Chip8Observation format, void *observations, float *rewards)
+{
+    const size_t observation_size = CHIP8_OBSERVATION_SIZE(format);
+
+    for (int i = 0; i < batch->count; i++) {
+        Chip8 *machine = &batch->machines[i];
+
+        for (int key = 0; key < MAX_KEYPAD_KEYS; key++) {
+            machine->key[key] = (actions[i] >> key) & 1;
+        }
+
+        /* Nobody draws the screen, so there's no need to stop for that */
+        unsigned long done = 0;
+        while (done < instructions) {
+            unsigned long executed;
+            run_cycles(machine, instructions - done, &executed);
+            machine->shouldDraw = false;
+            done += executed;
+        }
+
+        if (observations)
+            observe(machine, format, (uint8_t *)observations + i * observation_size);
+        if (rewards && batch->reward)
+            rewards[i] = batch->reward(machine, i, batch->reward_data);
+    }
+}
+
+int chip8_batch_count(const Chip8Batch *batch)
+{
+    return batch->count;
+}
+
+/* Returns a read only view of machine index. It stays valid until the
+ * batch is destroyed */
+const Chip8 *chip8_batch_machine(const Chip8Batch *batch, int index)
+{
+    return &batch->machines[index];
+}
@@ -0,0 +1,43 @@
+#ifndef _LIBCHIP8_HEADER_
+#define _LIBCHIP8_HEADER_
+
+/* libchip8: runs many CHIP-8 machines at once, for programs that drive
+ * them (an agent being trained, for instance) instead of a person. Build
+ * it with make lib, which makes libchip8.a and libchip8.so.
+ *
+ * A batch holds count machines running the same program. Every step, each
+ * one holds down the keys of its action for a number of instructions, and
+ * then its screen (the observation) is written straight into a buffer of
+ * the caller that holds the observations of the whole batch one after
+ * another. Nothing is allocated or copied in between. Rewards are computed
+ * by a function of the caller that gets a read only view of each machine,
+ * so it can look at V, memory... without copying them */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8.h"
+
+/* How observations are written */
+typedef enum chip8_observation {
+    CHIP8_OBSERVE_BITS,                /* The rows of the screen as stored (see CHIP8_PIXEL) */
+    CHIP8_OBSERVE_BYTES                /* One byte per pixel, 0 or 1, row by row */
+} Chip8Observation;
+
+/* Size of the observation of one machine, in bytes */
+#define CHIP8_OBSERVATION_SIZE(format) \
+    ((format) == CHIP8_OBSERVE_BITS ? sizeof(uint64_t) * CHIP8_DISPLAY_HEIGHT : CHIP8_DISPLAY_SIZE)
+
+/* Returns the reward of machine index after a step */
+typedef float (*Chip8Reward)(const Chip8 *machine, int index, void *data);
+
+typedef struct chip8_batch Chip8Batch;
+
+Chip8Batch *chip8_batch_create(int, const uint8_t *, size_t, uint32_t);
+void chip8_batch_destroy(Chip8Batch *);
+void chip8_batch_reset(Chip8Batch *, int);
+void chip8_batch_set_reward(Chip8Batch *, Chip8Reward, void *);
+void chip8_batch_step(Chip8Batch *, const uint16_t *, unsigned long, Chip8Observation, void *, float *);
+int chip8_batch_count(const Chip8Batch *);
+const Chip8 *chip8_batch_machine(const Chip8Batch *, int);
+
+#endif /* _LIBCHIP8_HEADER_ */
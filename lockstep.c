@@ -0,0 +1,568 @@
+/* Runs many machines with the same program at once, for sweeps over
+ * seeds, inputs... (see lockstep.h). Each step takes the lanes at the
+ * lowest pc among the ones that still have instructions to run (lanes
+ * that took different paths tend to meet again at the lower address),
+ * keeps those with the same opcode there as the first of them, and runs
+ * that instruction for all of them at once: a loop over the lanes, where
+ * the ones that don't take part are masked out. Most of these loops have
+ * no branches, so the compiler turns them into vector instructions (SSE,
+ * AVX2...) that do many lanes at a time.
+ *
+ * Every lane ends up the same as a Chip8 that ran the same number of
+ * instructions with the same seed and keys. An instruction that faults
+ * stops its lane (see faulted), like it stops the Chip8 */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lockstep.h"
+#include "opcode_functions.h"
+
+#define LANE_ALIGN 64   /* Each array starts at a multiple of this (from the block) */
+
+/* For every lane, all ones if it takes part in the step, zero if not */
+static inline uint16_t mask16(uint8_t mask) { return -(uint16_t)(mask & 1); }
+static inline uint32_t mask32(uint8_t mask) { return -(uint32_t)(mask & 1); }
+static inline uint64_t mask64(uint8_t mask) { return -(uint64_t)(mask & 1); }
+
+/* a where mask is set, b where it's not */
+#define BLEND(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+/* Returns the next array of the block, or NULL if block is NULL (which is
+ * used to find how big it has to be) */
+static void *carve(uint8_t *block, size_t *offset, size_t size)
+{
+    void *array = block ? block + *offset : NULL;
+    *offset += (size + LANE_ALIGN - 1) & ~(size_t)(LANE_ALIGN - 1);
+    return array;
+}
+
+/* Points the arrays of lockstep to block. Returns the size of the block */
+static size_t layout(Lockstep *lockstep, uint8_t *block)
+{
+    const size_t n = lockstep->count;
+    size_t offset = 0;
+
+    lockstep->memory = carve(block, &offset, CHIP8_MEMSIZE * n);
+    for (int i = 0; i < REGISTERS; i++) {
+        lockstep->V[i] = carve(block, &offset, n);
+    }
+    lockstep->I = carve(block, &offset, n * sizeof(uint16_t));
+    lockstep->pc = carve(block, &offset, n * sizeof(uint16_t));
+    lockstep->sp = carve(block, &offset, n * sizeof(uint16_t));
+    for (int i = 0; i < MAX_STACK_LEVELS; i++) {
+        lockstep->stack[i] = carve(block, &offset, n * sizeof(uint16_t));
+    }
+    for (int i = 0; i < CHIP8_DISPLAY_HEIGHT; i++) {
+        lockstep->gfx[i] = carve(block, &offset, n * sizeof(uint64_t));
+    }
+    lockstep->delay_timer = carve(block, &offset, n);
+    lockstep->sound_timer = carve(block, &offset, n);
+    lockstep->timer_phase = carve(block, &offset, n * sizeof(uint32_t));
+    lockstep->ticks = carve(block, &offset, n * sizeof(uint32_t));
+    lockstep->rng = carve(block, &offset, n * sizeof(uint32_t));
+    lockstep->keys = carve(block, &offset, n * sizeof(uint16_t));
+    lockstep->remaining = carve(block, &offset, n * sizeof(uint32_t));
+    lockstep->faulted = carve(block, &offset, n);
+    lockstep->mask = carve(block, &offset, n);
+    return offset;
+}
+
+/* Creates count lanes that run the program given (size bytes), with their
+ * random number generators seeded with seed + lane. Returns NULL if the
+ * program doesn't fit in memory or there is not enough memory */
+Lockstep *lockstep_create(int count, const uint8_t *program, size_t size, uint32_t seed)
+{
+    if (count <= 0)
+        return NULL;
+
+    Lockstep *lockstep = malloc(sizeof(Lockstep));
+    Chip8 *first = malloc(sizeof(Chip8));
+    if (!lockstep || !first) {
+        free(lockstep);
+        free(first);
+        return NULL;
+    }
+
+    /* Every lane starts like a freshly loaded machine */
+    init_chip8(first);
+    if (!load_program(first, program, size)) {
+        free(lockstep);
+        free(first);
+        return NULL;
+    }
+
+    lockstep->count = count;
+    uint8_t *block = calloc(1, layout(lockstep, NULL));
+    if (!block) {
+        free(lockstep);
+        free(first);
+        return NULL;
+    }
+    layout(lockstep, block);
+
+    lockstep->ips = first->ips;
+    for (int addr = 0; addr < CHIP8_MEMSIZE; addr++) {
+        memset(&lockstep->memory[(size_t)addr * count], first->memory[addr], count);
+    }
+    for (int l = 0; l < count; l++) {
+        lockstep->pc[l] = first->pc;
+        lockstep->rng[l] = seed + l;
+    }
+    lockstep->steps = 0;
+    lockstep->executed = 0;
+
+    free(first);
+    return lockstep;
+}
+
+void lockstep_destroy(Lockstep *lockstep)
+{
+    if (!lockstep)
+        return;
+
+    /* The memory of the lanes is the start of the block */
+    free(lockstep->memory);
+    free(lockstep);
+}
+
+/* Stops a lane for good, as a Chip8 would die */
+static inline void fault(Lockstep *lockstep, int l)
+{
+    lockstep->faulted[l] = 1;
+    lockstep->remaining[l] = 0;
+    lockstep->mask[l] = 0;
+}
+
+/* Stops all the lanes of the step */
+static void fault_all(Lockstep *lockstep)
+{
+    for (int l = 0; l < lockstep->count; l++) {
+        if (lockstep->mask[l])
+            fault(lockstep, l);
+    }
+}
+
+/* DXYN for lane l. See opcode_D() */
+static void draw(Lockstep *lockstep, const Instruction *ins, int l)
+{
+    const size_t n = lockstep->count;
+    const int x = lockstep->V[ins->x][l] % CHIP8_DISPLAY_WIDTH;
+    const int y = lockstep->V[ins->y][l] % CHIP8_DISPLAY_HEIGHT;
+    int height = ins->n;
+    uint64_t collision = 0;
+
+    if (y + height > CHIP8_DISPLAY_HEIGHT)
+        height = CHIP8_DISPLAY_HEIGHT - y;
+
+    for (int row = 0; row < height; row++) {
+        uint16_t addr = (lockstep->I[l] + row) & (CHIP8_MEMSIZE - 1);
+        uint64_t sprite = (uint64_t)lockstep->memory[addr * n + l] << 56 >> x;
+        collision |= lockstep->gfx[y + row][l] & sprite;
+        lockstep->gfx[y + row][l] ^= sprite;
+    }
+
+    lockstep->V[0xF][l] = collision != 0;
+}
+
+/* Runs ins on the lanes of the step (see mask). Each case does the same
+ * as the function of the instruction in opcode_functions.c, in the same
+ * order, so it gives the same results when X or Y is F */
+static void execute(Lockstep *lockstep, const Instruction *ins)
+{
+    const int n = lockstep->count;
+    const size_t stride = n;
+    uint8_t * const mask = lockstep->mask;
+    uint16_t * const pc = lockstep->pc;
+    uint16_t * const I = lockstep->I;
+    uint8_t * const vx = lockstep->V[ins->x];
+    uint8_t * const vy = lockstep->V[ins->y];
+    uint8_t * const vf = lockstep->V[0xF];
+    const uint8_t nn = ins->nn;
+    const uint16_t nnn = ins->nnn;
+
+    switch (ins->op) {
+        case OP_00E0:
+            for (int row = 0; row < CHIP8_DISPLAY_HEIGHT; row++) {
+                uint64_t * const gfx = lockstep->gfx[row];
+                for (int l = 0; l < n; l++) {
+                    gfx[l] &= ~mask64(mask[l]);
+                }
+            }
+            break;
+
+        case OP_00EE:
+            for (int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                if (lockstep->sp[l] == 0) {
+                    fault(lockstep, l);
+                    continue;
+                }
+                pc[l] = lockstep->stack[--lockstep->sp[l]][l];
+            }
+            break;
+
+        case OP_1NNN:
+            if (nnn < 0x200) {
+                fault_all(lockstep);
+                return;
+            }
+            for (int l = 0; l < n; l++) {
+                pc[l] = BLEND(mask16(mask[l]), nnn, pc[l]);
+            }
+            return;
+
+        case OP_2NNN:
+            if (nnn < 0x200) {
+                fault_all(lockstep);
+                return;
+            }
+            for (int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                if (lockstep->sp[l] == MAX_STACK_LEVELS) {
+                    fault(lockstep, l);
+                    continue;
+                }
+                lockstep->stack[lockstep->sp[l]++][l] = pc[l];
+                pc[l] = nnn;
+            }
+            return;
+
+        case OP_3XNN:
+            for (int l = 0; l < n; l++) {
+                pc[l] += mask[l] & (vx[l] == nn ? 4 : 2);
+            }
+            return;
+
+        case OP_4XNN:
+            for (int l = 0; l < n; l++) {
+                pc[l] += mask[l] & (vx[l] != nn ? 4 : 2);
+            }
+            return;
+
+        case OP_5XY0:
+            for (int l = 0; l < n; l++) {
+                pc[l] += mask[l] & (vx[l] == vy[l] ? 4 : 2);
+            }
+            return;
+
+        case OP_9XY0:
+            for (int l = 0; l < n; l++) {
+                pc[l] += mask[l] & (vx[l] != vy[l] ? 4 : 2);
+            }
+            return;
+
+        case OP_6XNN:
+            for (int l = 0; l < n; l++) {
+                vx[l] = BLEND(mask[l], nn, vx[l]);
+            }
+            break;
+
+        case OP_7XNN:
+            for (int l = 0; l < n; l++) {
+                vx[l] += nn & mask[l];
+            }
+            break;
+
+        case OP_8XY0:
+            for (int l = 0; l < n; l++) {
+                vx[l] = BLEND(mask[l], vy[l], vx[l]);
+            }
+            break;
+
+        case OP_8XY1:
+            for (int l = 0; l < n; l++) {
+                vx[l] |= vy[l] & mask[l];
+            }
+            break;
+
+        case OP_8XY2:
+            for (int l = 0; l < n; l++) {
+                vx[l] &= vy[l] | ~mask[l];
+            }
+            break;
+
+        case OP_8XY3:
+            for (int l = 0; l < n; l++) {
+                vx[l] ^= vy[l] & mask[l];
+            }
+            break;
+
+        case OP_8XY4:
+            for (int l = 0; l < n; l++) {
+                vf[l] = BLEND(mask[l], vx[l] + vy[l] > 0xFF, vf[l]);
+                vx[l] += vy[l] & mask[l];
+            }
+            break;
+
+        case OP_8XY5:
+            for (int l = 0; l < n; l++) {
+                vf[l] = BLEND(mask[l], vy[l] <= vx[l], vf[l]);
+                vx[l] -= vy[l] & mask[l];
+            }
+            break;
+
+        case OP_8XY6:
+            for (int l = 0; l < n; l++) {
+                vf[l] = BLEND(mask[l], vx[l] & 0x01, vf[l]);
+                vy[l] = BLEND(mask[l], vy[l] >> 1, vy[l]);
+                vx[l] = BLEND(mask[l], vy[l], vx[l]);
+            }
+            break;
+
+        case OP_8XY7:
+            for (int l = 0; l < n; l++) {
+                vf[l] = BLEND(mask[l], vx[l] <= vy[l], vf[l]);
+                vx[l] = BLEND(mask[l], vy[l] - vx[l], vx[l]);
+            }
+            break;
+
+        case OP_8XYE:
+            for (int l = 0; l < n; l++) {
+                vf[l] = BLEND(mask[l], vx[l] & 0x80, vf[l]);
+                vy[l] = BLEND(mask[l], vy[l] << 1, vy[l]);
+                vx[l] = BLEND(mask[l], vy[l], vx[l]);
+            }
+            break;
+
+        case OP_ANNN:
+            for (int l = 0; l < n; l++) {
+                I[l] = BLEND(mask16(mask[l]), nnn, I[l]);
+            }
+            break;
+
+        case OP_BNNN: {
+            const uint8_t * const v0 = lockstep->V[0];
+            for (int l = 0; l < n; l++) {
+                pc[l] = BLEND(mask16(mask[l]), nnn + v0[l], pc[l]);
+            }
+            return;
+        }
+
+        case OP_CXNN: {
+            uint32_t * const rng = lockstep->rng;
+            for (int l = 0; l < n; l++) {
+                rng[l] = BLEND(mask32(mask[l]), rng[l] * 1664525u + 1013904223u, rng[l]);
+                vx[l] = BLEND(mask[l], (rng[l] >> 24) & nn, vx[l]);
+            }
+            break;
+        }
+
+        case OP_DXYN:
+            for (int l = 0; l < n; l++) {
+                if (mask[l])
+                    draw(lockstep, ins, l);
+            }
+            break;
+
+        case OP_EX9E:
+        case OP_EXA1: {
+            const uint16_t * const keys = lockstep->keys;
+            const bool pressed = ins->op == OP_EX9E;
+            for (int l = 0; l < n; l++) {
+                bool down = vx[l] < MAX_KEYPAD_KEYS && ((keys[l] >> (vx[l] & 0xF)) & 1);
+                pc[l] += mask[l] & (down == pressed ? 4 : 2);
+            }
+            return;
+        }
+
+        case OP_FX07:
+            for (int l = 0; l < n; l++) {
+                vx[l] = BLEND(mask[l], lockstep->delay_timer[l], vx[l]);
+            }
+            break;
+
+        /* Takes the lowest key pressed. Without one, pc stays */
+        case OP_FX0A:
+            for (int l = 0; l < n; l++) {
+                if (!mask[l] || lockstep->keys[l] == 0)
+                    continue;
+                int key = 0;
+                while (!((lockstep->keys[l] >> key) & 1))
+                    key++;
+                vx[l] = key;
+                pc[l] += 2;
+            }
+            return;
+
+        case OP_FX15:
+            for (int l = 0; l < n; l++) {
+                lockstep->delay_timer[l] = BLEND(mask[l], vx[l], lockstep->delay_timer[l]);
+            }
+            break;
+
+        case OP_FX18:
+            for (int l = 0; l < n; l++) {
+                lockstep->sound_timer[l] = BLEND(mask[l], vx[l], lockstep->sound_timer[l]);
+            }
+            break;
+
+        case OP_FX1E:
+            for (int l = 0; l < n; l++) {
+                vf[l] = BLEND(mask[l], I[l] + vx[l] > 0xFFF, vf[l]);
+                I[l] += vx[l] & mask[l];
+            }
+            break;
+
+        case OP_FX29:
+            for (int l = 0; l < n; l++) {
+                I[l] = BLEND(mask16(mask[l]), vx[l] * 5, I[l]);
+            }
+            break;
+
+        case OP_FX33:
+            for (int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                uint8_t *memory = lockstep->memory + l;
+                memory[(I[l] & (CHIP8_MEMSIZE - 1)) * stride] = vx[l] / 100;
+                memory[((I[l] + 1) & (CHIP8_MEMSIZE - 1)) * stride] = (vx[l] % 100) / 10;
+                memory[((I[l] + 2) & (CHIP8_MEMSIZE - 1)) * stride] = vx[l] % 10;
+            }
+            break;
+
+        case OP_FX55:
+            for (int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                for (int i = 0; i <= ins->x; i++) {
+                    lockstep->memory[((I[l] + i) & (CHIP8_MEMSIZE - 1)) * stride + l] = lockstep->V[i][l];
+                }
+                I[l] += ins->x + 1;
+            }
+            break;
+
+        case OP_FX65:
+            for (int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                for (int i = 0; i <= ins->x; i++) {
+                    lockstep->V[i][l] = lockstep->memory[((I[l] + i) & (CHIP8_MEMSIZE - 1)) * stride + l];
+                }
+                I[l] += ins->x + 1;
+            }
+            break;
+
+        default:
+            fault_all(lockstep);
+            return;
+    }
+
+    /* Every instruction that doesn't jump or skip goes on to the next one */
+    for (int l = 0; l < n; l++) {
+        pc[l] += mask[l] & 2;
+    }
+}
+
+/* Counts the instruction just run by the lanes of the step, and updates
+ * their timers like update_timers() in chip8.c. The arrays are parameters
+ * so they can be restrict (they never overlap), which lets the compiler
+ * vectorize the loop */
+static uint32_t account_lanes(int n, uint32_t ips, const uint8_t * restrict mask,
+        uint32_t * restrict timer_phase, uint32_t * restrict ticks, uint8_t * restrict delay_timer,
+        uint8_t * restrict sound_timer, uint32_t * restrict remaining)
+{
+    uint32_t executed = 0;
+
+    for (int l = 0; l < n; l++) {
+        uint32_t phase = timer_phase[l] + (CHIP8_TIMER_HZ & mask32(mask[l]));
+        uint32_t tick = phase >= ips;
+
+        timer_phase[l] = phase - (ips & -tick);
+        ticks[l] += tick;
+        delay_timer[l] -= tick & (delay_timer[l] != 0);
+        sound_timer[l] -= tick & (sound_timer[l] != 0);
+        remaining[l] -= mask[l] & 1;
+        executed += mask[l] & 1;
+    }
+    return executed;
+}
+
+static void account(Lockstep *lockstep)
+{
+    lockstep->executed += account_lanes(lockstep->count, lockstep->ips, lockstep->mask,
+            lockstep->timer_phase, lockstep->ticks, lockstep->delay_timer,
+            lockstep->sound_timer, lockstep->remaining);
+    lockstep->steps++;
+}
+
+/* Runs instructions instructions (at most UINT32_MAX) on every lane that
+ * has not faulted */
+void lockstep_run(Lockstep *lockstep, unsigned long instructions)
+{
+    const int n = lockstep->count;
+    const size_t stride = n;
+    uint32_t * const remaining = lockstep->remaining;
+    uint16_t * const pc = lockstep->pc;
+    uint8_t * const mask = lockstep->mask;
+
+    for (int l = 0; l < n; l++) {
+        remaining[l] = lockstep->faulted[l] ? 0 : instructions;
+    }
+
+    while (1) {
+        /* The lowest pc of the lanes that have to run. The others count
+         * as past any pc */
+        uint32_t lowest = UINT32_MAX;
+        for (int l = 0; l < n; l++) {
+            uint32_t at = pc[l] | (uint32_t)(remaining[l] == 0) << 16;
+            lowest = at < lowest ? at : lowest;
+        }
+        if (lowest > UINT16_MAX)
+            break;
+
+        int first = 0;
+        while (remaining[first] == 0 || pc[first] != lowest)
+            first++;
+
+        const uint8_t *high = &lockstep->memory[(lowest & (CHIP8_MEMSIZE - 1)) * stride];
+        const uint8_t *low = &lockstep->memory[((lowest + 1) & (CHIP8_MEMSIZE - 1)) * stride];
+        const uint8_t opcode_high = high[first], opcode_low = low[first];
+
+        /* Lanes at the same pc may still have different opcodes there, if
+         * they wrote different things. They wait for a later step */
+        for (int l = 0; l < n; l++) {
+            mask[l] = -(uint8_t)((remaining[l] != 0) & (pc[l] == lowest) &
+                    (high[l] == opcode_high) & (low[l] == opcode_low));
+        }
+
+        execute(lockstep, &decode_table[opcode_high << 8 | opcode_low]);
+        account(lockstep);
+    }
+}
+
+/* Stores the state of a lane in chip8, so it can be inspected (or run
+ * further) like any other machine */
+void lockstep_export(const Lockstep *lockstep, int lane, Chip8 *chip8)
+{
+    const size_t stride = lockstep->count;
+
+    init_chip8(chip8);
+    for (int addr = 0; addr < CHIP8_MEMSIZE; addr++) {
+        chip8->memory[addr] = lockstep->memory[addr * stride + lane];
+    }
+    invalidate_instructions(chip8, 0, CHIP8_MEMSIZE);
+
+    for (int i = 0; i < REGISTERS; i++) {
+        chip8->V[i] = lockstep->V[i][lane];
+    }
+    chip8->I = lockstep->I[lane];
+    chip8->pc = lockstep->pc[lane];
+    chip8->sp = lockstep->sp[lane];
+    for (int i = 0; i < MAX_STACK_LEVELS; i++) {
+        chip8->stack[i] = lockstep->stack[i][lane];
+    }
+    for (int row = 0; row < CHIP8_DISPLAY_HEIGHT; row++) {
+        chip8->gfx[row] = lockstep->gfx[row][lane];
+    }
+    for (int key = 0; key < MAX_KEYPAD_KEYS; key++) {
+        chip8->key[key] = (lockstep->keys[lane] >> key) & 1;
+    }
+    chip8->delay_timer = lockstep->delay_timer[lane];
+    chip8->sound_timer = lockstep->sound_timer[lane];
+    chip8->ips = lockstep->ips;
+    chip8->timer_phase = lockstep->timer_phase[lane];
+    chip8->ticks = lockstep->ticks[lane];
+    chip8->rng = lockstep->rng[lane];
+}
@@ -0,0 +1,43 @@
+#ifndef _LOCKSTEP_HEADER_
+#define _LOCKSTEP_HEADER_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8.h"
+
+/* Many machines running the same program in lockstep (see lockstep.c).
+ * Every field of Chip8 is kept as an array with one element per machine
+ * ("lane"), so the same field of all the lanes is contiguous and an
+ * instruction runs on all of them in a single loop */
+typedef struct lockstep {
+    int count;                                 /* Lanes */
+    uint32_t ips;                              /* Same as Chip8.ips, for all the lanes */
+
+    uint8_t *memory;                           /* Byte addr of lane l at memory[addr * count + l] */
+    uint8_t *V[REGISTERS];
+    uint16_t *I;
+    uint16_t *pc;
+    uint16_t *sp;
+    uint16_t *stack[MAX_STACK_LEVELS];
+    uint64_t *gfx[CHIP8_DISPLAY_HEIGHT];
+    uint8_t *delay_timer;
+    uint8_t *sound_timer;
+    uint32_t *timer_phase;
+    uint32_t *ticks;
+    uint32_t *rng;
+    uint16_t *keys;                            /* Bit k set if key k is pressed */
+
+    uint32_t *remaining;                       /* Instructions left to run */
+    uint8_t *faulted;                          /* Ran an invalid instruction, and stopped */
+    uint8_t *mask;                             /* 0xFF for the lanes that run the current step */
+
+    unsigned long steps;                       /* Instructions issued, each for one or more lanes */
+    unsigned long executed;                    /* Instructions run, adding up every lane */
+} Lockstep;
+
+Lockstep *lockstep_create(int, const uint8_t *, size_t, uint32_t);
+void lockstep_destroy(Lockstep *);
+void lockstep_run(Lockstep *, unsigned long);
+void lockstep_export(const Lockstep *, int, Chip8 *);
+
+#endif /* _LOCKSTEP_HEADER_ */
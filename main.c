@@ -1,7 +1,27 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
 #include "SDL2/SDL.h"
 #include "chip8.h"
+#include "snapshot.h"
+#include "replay.h"
+#ifdef JIT
+#include "jit.h"
+#endif
+#ifdef FUSION
+#include "fusion.h"
+#endif
+#ifdef PROFILE
+#include <signal.h>
+#include "profile.h"
+#endif
+#ifdef TRACER
+#include "tracer.h"
+#endif
+#ifdef DEBUG
+#include "debugger.h"
+#endif
 
 #define WINDOW_WIDTH 1024
 #define WINDOW_HEIGHT 512
@@ -9,9 +29,107 @@
 #define COLOR_BLACK 0x00000000
 #define COLOR_WHITE 0xFFFFFFFF
 
-static void handle_input(Chip8 *, SDL_Event *);
-static void handle_key_down(Chip8 *, SDL_Event *);
-static void handle_key_up(Chip8 *, SDL_Event *);
+#define FRAME_RATE        60       /* The screen is presented at most once per frame */
+#define MIN_IPS           700
+#define MAX_IPS           1000000
+#define MAX_SPEED         64       /* Highest multiple of the normal speed for turbo */
+#define TURBO_KEY         SDLK_TAB /* Switches turbo on and off */
+#define REWIND_KEY        SDLK_BACKSPACE /* Goes back in time while held down */
+#define SAVE_STATE_KEY    SDLK_F5
+#define LOAD_STATE_KEY    SDLK_F9
+#define DEBUGGER_KEY      SDLK_F12 /* Stops the debug build in the debugger */
+#define REWIND_BYTES      (4 << 20) /* Memory for the snapshots to rewind */
+#define REWIND_FRAMES     (10 * 60 * FRAME_RATE) /* At most 10 minutes of them */
+#define MAX_LATE_FRAMES   6        /* Frames behind schedule before giving up catching up */
+#define SPIN_MS           2        /* Time before a deadline spent spinning instead of sleeping */
+#define FRAME_BUFFERS     3
+#define FRAME_FRESH       4        /* Flag of TripleBuffer.shared: published and not taken yet */
+#define PROFILE_SIGNAL    SIGUSR1  /* Makes the profile build print (and save) the profile */
+
+/* What the render thread asks the emulation thread to do with the state */
+enum state_request {
+    STATE_NONE,
+    STATE_SAVE,
+    STATE_LOAD
+};
+
+/* Keeps how far some measure (in ms) deviates from what it should be */
+typedef struct jitter {
+    unsigned long count;
+    double sum;
+    double sum_squares;
+    double max;
+} Jitter;
+
+/* Runs the interpreter at a fixed number of instructions per second,
+ * divided in frames. Each frame runs the instructions due by its end, and
+ * then waits for the clock to reach it */
+typedef struct scheduler {
+    uint32_t ips;
+    Uint64 frequency;                  /* Of the performance counter */
+    Uint64 started;                    /* Performance counter at the start */
+    Uint64 origin;                     /* Start of the schedule. Moves forward after a stall */
+    uint32_t speed;                    /* Frames run per frame of real time. 0 runs them as fast as possible */
+    unsigned long frames;              /* Frames run since origin */
+    unsigned long executed;            /* Instructions run since origin */
+    unsigned long total_executed;      /* Instructions run since the start */
+    Jitter lateness;                   /* How late frames end */
+} Scheduler;
+
+/* A picture of the screen, as published by the emulation thread */
+typedef struct frame {
+    uint64_t gfx[CHIP8_DISPLAY_HEIGHT];
+    uint32_t dirty_rows;               /* Rows changed since the frame the render thread took before */
+} Frame;
+
+/* Passes frames from the emulation thread to the render thread without
+ * locks. The emulation thread draws in back and the render thread reads
+ * front, while shared holds the last frame published. Publishing swaps
+ * back and shared, and taking a frame swaps shared and front, so neither
+ * thread ever waits for the other, frames the render thread had no time
+ * for are dropped, and it always gets the newest one */
+typedef struct triple_buffer {
+    Frame frames[FRAME_BUFFERS];
+    SDL_atomic_t shared;               /* Index of the shared frame, | FRAME_FRESH */
+    int back;                          /* Only used by the emulation thread */
+    uint32_t dropped_rows;             /* Dirty rows of the frames dropped. Only used by the emulation thread */
+    int front;                         /* Only used by the render thread */
+} TripleBuffer;
+
+/* The interpreter runs on its own thread, so a slow present never delays
+ * it. This is what it shares with the render thread (the main one, which
+ * also handles the events) */
+typedef struct emulator {
+    Chip8 *chip8;                      /* Only touched by the emulation thread while it runs */
+    Scheduler *scheduler;
+    TripleBuffer screen;
+    SDL_atomic_t keys;                 /* Bit n set if key n is pressed */
+    SDL_atomic_t quit;
+    SDL_sem *key_changed;              /* Posted when keys changes or on quit */
+    Uint32 frame_event;                /* Pushed to the render thread when a frame is published */
+    Jitter present;                    /* Time taken by each present. Only used by the render thread */
+    SDL_atomic_t turbo;                /* Runs at turbo_speed instead of the normal speed */
+    uint32_t turbo_speed;              /* Same as Scheduler.speed */
+    Uint64 published;                  /* When the last frame was published */
+    RewindBuffer *history;             /* A snapshot per frame. NULL if there was no memory for it */
+    SDL_atomic_t rewinding;            /* Goes back a snapshot per frame instead of running it */
+    Uint64 snapshotted;                /* When the last snapshot was taken */
+    Jitter snapshots;                  /* Time taken by each snapshot */
+    SDL_atomic_t state_request;        /* See enum state_request */
+    char state_file[1024];             /* Where the state is saved to and loaded from */
+    Recording *recording;              /* Of the keys pressed. NULL if not recording */
+    const char *recording_file;
+    SDL_atomic_t interrupt;            /* The render thread asks to stop in the debugger */
+} Emulator;
+
+static bool handle_input(Emulator *, SDL_Event *);
+static bool handle_key_down(Emulator *, SDL_Event *);
+static void handle_key_up(Emulator *, SDL_Event *);
+
+#ifdef PROFILE
+static volatile sig_atomic_t profile_requested; /* Set by PROFILE_SIGNAL */
+static const char *profile_file;               /* Where the profile is saved. NULL if only printed */
+#endif
 
 static void die(const char * const msg)
 {
@@ -44,19 +162,149 @@ static void init_SDL(void);
 static void init_window(SDL_Window **, const char * const title);
 static void init_renderer(SDL_Renderer **, SDL_Window *window);
 static void init_texture(SDL_Texture **, SDL_Renderer *renderer);
-static void update_screen(Chip8 *chip8, SDL_Texture *texture, SDL_Renderer *renderer);
+static void update_screen(const Frame *, SDL_Texture *texture, SDL_Renderer *renderer);
 /*static void draw_ascii(Chip8 *);*/
+static void init_scheduler(Scheduler *, uint32_t);
+static void set_speed(Scheduler *, uint32_t);
+static void init_emulator(Emulator *, Chip8 *, Scheduler *);
+static int emulate(void *);
+static void render(Emulator *, SDL_Texture *, SDL_Renderer *);
+static void publish_frame(Emulator *);
+static bool take_frame(TripleBuffer *);
+static void run_frame(Chip8 *, Scheduler *);
+static void pass_frame(Scheduler *);
+static void handle_state_request(Emulator *);
+static void stop_recording(Emulator *, const char * const);
+static void play(const char * const, Chip8 *);
+static void wait_next_frame(Scheduler *, Emulator *, int);
+static void jitter_add(Jitter *, double);
+static void jitter_print(const char * const, const Jitter *);
+static void print_reports(void);
+#ifdef PROFILE
+static void request_profile(int);
+static void dump_profile(const Chip8 *);
+#endif
+
+/* What print_reports() reports about on exit */
+static Emulator *reported;
+
+static void usage(const char * const program)
+{
+    printf("Usage: %s [--ips N] [--turbo N] [--seed N] [--record FILE | --replay FILE] <ROM FILE>\n",
+            program);
+    printf("  --ips N    Instructions per second, %d to %d (default %d)\n",
+            MIN_IPS, MAX_IPS, CHIP8_DEFAULT_IPS);
+    printf("  --turbo N  Start in turbo mode, N times faster (up to %d). 0 runs as fast as\n"
+           "             possible, which is what TAB switches to otherwise\n", MAX_SPEED);
+    printf("  --seed N   Seed of the random number generator (by default, the time)\n");
+    printf("  --record FILE  Record the keys pressed to FILE, to replay the session later\n");
+    printf("  --replay FILE  Replay a recorded session as fast as possible, without graphics,\n"
+           "                 and check that it ends the same\n");
+#ifdef PROFILE
+    printf("  --profile FILE Save the profile to FILE (as JSON if it ends in .json, CSV otherwise)\n"
+           "                 on exit and on SIGUSR1, besides printing it\n");
+#endif
+#ifdef TRACER
+    printf("  --trace FILE   Trace every instruction executed to FILE (see chip8-trace)\n");
+#endif
+    printf("Hold BACKSPACE to rewind. F5 saves the state to <ROM FILE>.state, F9 loads it\n");
+#ifdef DEBUG
+    printf("The debugger takes commands from the terminal (help lists them). F12 stops in it\n");
+#endif
+    exit(EXIT_FAILURE);
+}
 
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        printf("Usage: %s <ROM FILE>\n", *argv);
-        exit(EXIT_FAILURE);
+    const char *rom = NULL;
+    long ips = CHIP8_DEFAULT_IPS;
+    long turbo = -1;
+    long long seed = -1;
+    const char *record = NULL, *replayed = NULL;
+#ifdef TRACER
+    const char *trace = NULL;
+#endif
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+            char *end;
+            ips = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || ips < MIN_IPS || ips > MAX_IPS)
+                usage(*argv);
+        } else if (strcmp(argv[i], "--turbo") == 0 && i + 1 < argc) {
+            char *end;
+            turbo = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || turbo < 0 || turbo > MAX_SPEED)
+                usage(*argv);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            char *end;
+            seed = strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || seed < 0 || seed > UINT32_MAX)
+                usage(*argv);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc && !replayed) {
+            record = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc && !record) {
+            replayed = argv[++i];
+#ifdef PROFILE
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_file = argv[++i];
+#endif
+#ifdef TRACER
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+#endif
+        } else if (argv[i][0] == '-' || rom) {
+            usage(*argv);
+        } else {
+            rom = argv[i];
+        }
     }
-    
+    if (!rom)
+        usage(*argv);
+
     Chip8 chip8;
 	init_chip8(&chip8);
-    load_rom(&chip8, argv[1]);
+    if (!load_rom(&chip8, rom))
+        exit(EXIT_FAILURE);
+    chip8.ips = ips;
+    if (seed >= 0)
+        chip8.rng = seed;
+
+    if (replayed) {
+        play(replayed, &chip8);
+        return 0;
+    }
+
+#ifdef JIT
+    if (!jit_enable(&chip8)) {
+        fprintf(stderr, "JIT NOT AVAILABLE, USING THE INTERPRETER\n");
+    }
+#endif
+
+#ifdef FUSION
+    if (!fusion_enable(&chip8, true)) {
+        fprintf(stderr, "NOT ENOUGH MEMORY TO FUSE INSTRUCTIONS\n");
+    }
+#endif
+
+#ifdef PROFILE
+    if (!profile_enable(&chip8)) {
+        fprintf(stderr, "NOT ENOUGH MEMORY TO PROFILE\n");
+    }
+    signal(PROFILE_SIGNAL, request_profile);
+#endif
+
+#ifdef TRACER
+    if (trace && !tracer_start(&chip8, trace))
+        exit(EXIT_FAILURE);
+#endif
+
+#ifdef DEBUG
+    /* Stops before the first instruction, to set breakpoints */
+    if (!debugger_attach(&chip8, stdin, stdout)) {
+        fprintf(stderr, "NOT ENOUGH MEMORY TO DEBUG\n");
+    }
+#endif
 
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
@@ -64,25 +312,432 @@ int main(int argc, char **argv)
 
     init_graphics(&window, &renderer, &texture);
 
-    while (1) {
-        cycle(&chip8);
+    Scheduler scheduler;
+    init_scheduler(&scheduler, chip8.ips);
+
+    static Emulator emulator;
+    init_emulator(&emulator, &chip8, &scheduler);
+    snprintf(emulator.state_file, sizeof(emulator.state_file), "%s.state", rom);
+    if (record) {
+        emulator.recording = recording_create(&chip8);
+        emulator.recording_file = record;
+        if (!emulator.recording)
+            fprintf(stderr, "NOT ENOUGH MEMORY TO RECORD\n");
+    }
+    if (turbo >= 0) {
+        emulator.turbo_speed = turbo;
+        SDL_AtomicSet(&emulator.turbo, 1);
+    }
 
-        SDL_Event e;
-        while (SDL_PollEvent(&e)) {
-            if (e.type == SDL_QUIT)
-                exit(EXIT_SUCCESS);
+    reported = &emulator;
+    atexit(print_reports);
+
+    SDL_Thread *thread = SDL_CreateThread(emulate, "emulation", &emulator);
+    if (!thread) {
+        die("ERROR CREATING THE EMULATION THREAD\n");
+    }
+
+    render(&emulator, texture, renderer);
+
+    /* Wake the machine up in case it is waiting for a key */
+    SDL_AtomicSet(&emulator.quit, 1);
+    SDL_SemPost(emulator.key_changed);
+    SDL_WaitThread(thread, NULL);
+    stop_recording(&emulator, "QUIT");
+#ifdef TRACER
+    if (chip8.tracer) {
+        printf("TRACED %lu INSTRUCTIONS IN %lu RECORDS TO '%s' (THE INTERPRETER WAITED FOR THE DISK %lu TIMES)\n",
+                (unsigned long)chip8.tracer->at, (unsigned long)chip8.tracer->head, trace, chip8.tracer->stalls);
+        tracer_stop(&chip8);
+    }
+#endif
+
+	return 0;
+}
+
+static void init_emulator(Emulator *emulator, Chip8 *chip8, Scheduler *scheduler)
+{
+    memset(emulator, 0, sizeof(*emulator));
+    emulator->chip8 = chip8;
+    emulator->scheduler = scheduler;
+
+    /* Frame 0 is shared, 1 is drawn and 2 is shown */
+    SDL_AtomicSet(&emulator->screen.shared, 0);
+    emulator->screen.back = 1;
+    emulator->screen.front = 2;
+
+    emulator->turbo_speed = 0;
+    emulator->history = rewind_create(REWIND_BYTES, REWIND_FRAMES);
+    if (!emulator->history) {
+        fprintf(stderr, "NOT ENOUGH MEMORY TO REWIND\n");
+    }
+
+    emulator->key_changed = SDL_CreateSemaphore(0);
+    emulator->frame_event = SDL_RegisterEvents(1);
+    if (!emulator->key_changed || emulator->frame_event == (Uint32)-1) {
+        die("ERROR CREATING THE EMULATION THREAD\n");
+    }
+}
+
+/* Body of the emulation thread. Runs the interpreter frame by frame,
+ * taking the keys pressed before each one and publishing the screen after
+ * it if it changed. In turbo mode frames run faster than the real time,
+ * but no more than FRAME_RATE of them are published per second (timers
+ * still count emulated time). A snapshot is taken after every frame (again
+ * no more than FRAME_RATE per second), and while rewinding the frames go
+ * back to them instead of running */
+static int emulate(void *data)
+{
+    Emulator *emulator = data;
+    Chip8 *chip8 = emulator->chip8;
+    Scheduler *scheduler = emulator->scheduler;
+
+    while (!SDL_AtomicGet(&emulator->quit)) {
+        set_speed(scheduler, SDL_AtomicGet(&emulator->turbo) ? emulator->turbo_speed : 1);
+
+        handle_state_request(emulator);
 
-            handle_input(&chip8, &e);
+#ifdef DEBUG
+        if (SDL_AtomicSet(&emulator->interrupt, 0))
+            debugger_interrupt(chip8);
+#endif
+
+#ifdef PROFILE
+        if (profile_requested) {
+            profile_requested = 0;
+            dump_profile(chip8);
+        }
+#endif
+
+        int keys = SDL_AtomicGet(&emulator->keys);
+        for (int i = 0; i < MAX_KEYPAD_KEYS; i++) {
+            chip8->key[i] = (keys >> i) & 1;
+        }
+        if (emulator->recording && !recording_add(emulator->recording, scheduler->total_executed, keys))
+            stop_recording(emulator, "NOT ENOUGH MEMORY");
+
+        bool rewinding = emulator->history && SDL_AtomicGet(&emulator->rewinding);
+        if (rewinding) {
+            stop_recording(emulator, "REWOUND");
+            rewind_pop(emulator->history, chip8);
+            pass_frame(scheduler);
+        } else {
+            run_frame(chip8, scheduler);
         }
 
-        if (chip8.shouldDraw) {
-            update_screen(&chip8, texture, renderer);
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (!rewinding && emulator->history && (scheduler->speed == 1 ||
+                    now - emulator->snapshotted >= scheduler->frequency / FRAME_RATE)) {
+            rewind_push(emulator->history, chip8);
+            emulator->snapshotted = now;
+            jitter_add(&emulator->snapshots, (double)(SDL_GetPerformanceCounter() - now) * 1000 /
+                    scheduler->frequency);
         }
-        SDL_Delay(1);
+
+        if (chip8->shouldDraw && (scheduler->speed == 1 ||
+                    now - emulator->published >= scheduler->frequency / FRAME_RATE)) {
+            publish_frame(emulator);
+            emulator->published = now;
+        }
+
+        wait_next_frame(scheduler, chip8->waiting_key && !rewinding ? emulator : NULL, keys);
     }
-	return 0;
+    return 0;
 }
 
+/* Saves or loads the state if the render thread asked for it */
+static void handle_state_request(Emulator *emulator)
+{
+    Chip8 *chip8 = emulator->chip8;
+
+    switch (SDL_AtomicSet(&emulator->state_request, STATE_NONE)) {
+        case STATE_SAVE:
+            if (save_state_file(chip8, emulator->state_file))
+                printf("STATE SAVED TO '%s'\n", emulator->state_file);
+            break;
+        case STATE_LOAD:
+            stop_recording(emulator, "STATE LOADED");
+            if (load_state_file(chip8, emulator->state_file)) {
+                /* The rate given in the command line still holds */
+                chip8->ips = emulator->scheduler->ips;
+                printf("STATE LOADED FROM '%s'\n", emulator->state_file);
+            }
+            break;
+    }
+}
+
+/* Saves what was recorded so far, and stops recording. A session can only
+ * be replayed if the machine ran on from the start, so this has to be done
+ * before rewinding or loading a state */
+static void stop_recording(Emulator *emulator, const char * const why)
+{
+    if (!emulator->recording)
+        return;
+
+    recording_finish(emulator->recording, emulator->chip8, emulator->scheduler->total_executed);
+    if (recording_save(emulator->recording, emulator->recording_file))
+        printf("RECORDING STOPPED (%s): %lu INSTRUCTIONS, %zu KEY CHANGES SAVED TO '%s'\n", why,
+                emulator->scheduler->total_executed, emulator->recording->count, emulator->recording_file);
+
+    recording_destroy(emulator->recording);
+    emulator->recording = NULL;
+}
+
+/* Replays the session recorded in filename on chip8, which has its program
+ * loaded, and exits with failure if it doesn't end the same */
+static void play(const char * const filename, Chip8 *chip8)
+{
+    Recording *recording = recording_load(filename);
+    if (!recording)
+        exit(EXIT_FAILURE);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    bool same = replay(recording, chip8);
+    double elapsed = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    printf("REPLAYED %lu INSTRUCTIONS AND %zu KEY CHANGES IN %.3f s (%.2f MIPS): %s\n",
+            (unsigned long)recording->instructions, recording->count, elapsed,
+            elapsed > 0 ? recording->instructions / elapsed / 1e6 : 0,
+            same ? "SAME STATE AS RECORDED" : "DIFFERENT STATE");
+    recording_destroy(recording);
+    if (!same)
+        exit(EXIT_FAILURE);
+}
+
+/* Body of the render thread. Handles the events, including the ones sent
+ * when a frame is published, until the window is closed */
+static void render(Emulator *emulator, SDL_Texture *texture, SDL_Renderer *renderer)
+{
+    SDL_Event e;
+
+    while (SDL_WaitEvent(&e)) {
+        if (e.type == SDL_QUIT || !handle_input(emulator, &e))
+            return;
+
+        if (e.type == emulator->frame_event && take_frame(&emulator->screen)) {
+            Uint64 start = SDL_GetPerformanceCounter();
+            update_screen(&emulator->screen.frames[emulator->screen.front], texture, renderer);
+            jitter_add(&emulator->present, (double)(SDL_GetPerformanceCounter() - start) * 1000 /
+                    SDL_GetPerformanceFrequency());
+        }
+    }
+    die("ERROR WAITING FOR EVENTS\n");
+}
+
+/* Publishes the screen of the machine, and lets the render thread know
+ * unless it still has the previous frame to take */
+static void publish_frame(Emulator *emulator)
+{
+    Chip8 *chip8 = emulator->chip8;
+    TripleBuffer *screen = &emulator->screen;
+
+    memcpy(screen->frames[screen->back].gfx, chip8->gfx, sizeof(chip8->gfx));
+    screen->frames[screen->back].dirty_rows = chip8->dirty_rows | screen->dropped_rows;
+    chip8->shouldDraw = false;
+    chip8->dirty_rows = 0;
+
+    /* The frame must be written before the render thread can see it */
+    SDL_MemoryBarrierRelease();
+    int previous = SDL_AtomicSet(&screen->shared, screen->back | FRAME_FRESH);
+    screen->back = previous & ~FRAME_FRESH;
+
+    /* If the render thread didn't take the frame we get back, the rows it
+     * changed are still to be drawn, so they go with the next one */
+    screen->dropped_rows = previous & FRAME_FRESH ? screen->frames[screen->back].dirty_rows : 0;
+
+    if (!(previous & FRAME_FRESH)) {
+        SDL_Event e;
+        SDL_zero(e);
+        e.type = emulator->frame_event;
+        SDL_PushEvent(&e);
+    }
+}
+
+/* Makes the newest frame published the front one. Returns false if there
+ * is no new frame since the last time */
+static bool take_frame(TripleBuffer *screen)
+{
+    if (!(SDL_AtomicGet(&screen->shared) & FRAME_FRESH))
+        return false;
+
+    screen->front = SDL_AtomicSet(&screen->shared, screen->front) & ~FRAME_FRESH;
+    SDL_MemoryBarrierAcquire();
+    return true;
+}
+
+static void init_scheduler(Scheduler *scheduler, uint32_t ips)
+{
+    scheduler->ips = ips;
+    scheduler->frequency = SDL_GetPerformanceFrequency();
+    scheduler->started = scheduler->origin = SDL_GetPerformanceCounter();
+    scheduler->speed = 1;
+    scheduler->frames = 0;
+    scheduler->executed = 0;
+    scheduler->total_executed = 0;
+    memset(&scheduler->lateness, 0, sizeof(scheduler->lateness));
+}
+
+/* Changes how many frames run per frame of real time. The schedule starts
+ * over from now, as if after a stall */
+static void set_speed(Scheduler *scheduler, uint32_t speed)
+{
+    if (speed == scheduler->speed)
+        return;
+
+    scheduler->speed = speed;
+    scheduler->origin = SDL_GetPerformanceCounter();
+    scheduler->frames = 0;
+    scheduler->executed = 0;
+}
+
+/* Runs the instructions due by the end of the next frame. The count is
+ * computed from the start of the schedule, so fractions of an instruction
+ * per frame are not lost */
+static void run_frame(Chip8 *chip8, Scheduler *scheduler)
+{
+    scheduler->frames++;
+    unsigned long due = (uint64_t)scheduler->frames * scheduler->ips / FRAME_RATE;
+    const bool faulted = chip8->fault != FAULT_NONE;
+
+    while (scheduler->executed < due) {
+        unsigned long executed;
+
+        /* The reasons to stop early don't matter here, the frame is
+         * presented once all of its instructions ran */
+        run_cycles(chip8, due - scheduler->executed, &executed);
+        scheduler->executed += executed;
+        scheduler->total_executed += executed;
+    }
+
+    /* The game stays frozen, but it can still be rewound */
+    if (!faulted && chip8->fault != FAULT_NONE)
+        fprintf(stderr, "%s(): %s AT 0x%03X (OPCODE 0x%04X). THE GAME STOPPED\n",
+                __func__, fault_name(chip8->fault), chip8->pc, chip8->opcode);
+}
+
+/* Lets the time of a frame pass without running it, so the schedule
+ * stays the same */
+static void pass_frame(Scheduler *scheduler)
+{
+    scheduler->frames++;
+    scheduler->executed = (uint64_t)scheduler->frames * scheduler->ips / FRAME_RATE;
+}
+
+/* Waits until the current frame ends. SDL_Delay() may sleep longer than
+ * asked, so it sleeps until SPIN_MS before the end and spins the rest.
+ * While the machine of waiting waits for a key, precision doesn't matter:
+ * it blocks until the end of the frame or until the keys are no longer
+ * keys (the ones the frame ran with), whatever comes first, so a key press
+ * is taken right away. The next frame then starts early, but it still
+ * waits for its own end */
+static void wait_next_frame(Scheduler *scheduler, Emulator *waiting, int keys)
+{
+    if (scheduler->speed == 0)
+        return;
+
+    Uint64 end = scheduler->origin + scheduler->frames * scheduler->frequency /
+        (FRAME_RATE * scheduler->speed);
+    Uint64 now = SDL_GetPerformanceCounter();
+
+    /* After a stall (the window being dragged, the machine suspended...)
+     * the schedule starts over from now instead of running all the frames
+     * it missed at once */
+    if (now > end + MAX_LATE_FRAMES * scheduler->frequency / FRAME_RATE) {
+        scheduler->origin = now;
+        scheduler->frames = 0;
+        scheduler->executed = 0;
+        return;
+    }
+
+    if (waiting) {
+        /* Posts left from keys the frame already ran with */
+        while (SDL_SemTryWait(waiting->key_changed) == 0)
+            ;
+        while (now < end && SDL_AtomicGet(&waiting->keys) == keys && !SDL_AtomicGet(&waiting->quit)) {
+            SDL_SemWaitTimeout(waiting->key_changed, (end - now) * 1000 / scheduler->frequency + 1);
+            now = SDL_GetPerformanceCounter();
+        }
+        return;
+    }
+
+    while (now < end) {
+        Uint64 left_ms = (end - now) * 1000 / scheduler->frequency;
+        if (left_ms > SPIN_MS)
+            SDL_Delay(left_ms - SPIN_MS);
+        now = SDL_GetPerformanceCounter();
+    }
+    jitter_add(&scheduler->lateness, (double)(now - end) * 1000 / scheduler->frequency);
+}
+
+static void jitter_add(Jitter *jitter, double ms)
+{
+    jitter->count++;
+    jitter->sum += ms;
+    jitter->sum_squares += ms * ms;
+    if (ms > jitter->max)
+        jitter->max = ms;
+}
+
+static void jitter_print(const char * const what, const Jitter *jitter)
+{
+    if (jitter->count == 0)
+        return;
+
+    double mean = jitter->sum / jitter->count;
+    double variance = jitter->sum_squares / jitter->count - mean * mean;
+    printf("%s: %.3f ms MEAN, %.3f ms DEVIATION, %.3f ms MAX (%lu SAMPLES)\n", what, mean,
+            variance > 0 ? SDL_sqrt(variance) : 0, jitter->max, jitter->count);
+}
+
+/* Prints the rate the interpreter achieved, how far its timers (the
+ * emulated time) are from the real time, how much of it was idle, how
+ * steady the frames of both threads were, what rewinding cost and which
+ * fused sequences ran. Called on exit */
+static void print_reports(void)
+{
+    const Chip8 *reported_chip8 = reported->chip8;
+    const Scheduler *scheduler = reported->scheduler;
+    double elapsed = (double)(SDL_GetPerformanceCounter() - scheduler->started) / scheduler->frequency;
+    double emulated = (double)reported_chip8->ticks / CHIP8_TIMER_HZ;
+
+    if (elapsed > 0) {
+        printf("RAN %lu INSTRUCTIONS IN %.2f s: %.0f IPS (TARGET %u)\n",
+                scheduler->total_executed, elapsed,
+                scheduler->total_executed / elapsed, scheduler->ips);
+        printf("TIMERS TICKED %lu TIMES: %.2f s OF EMULATED TIME, DRIFT %+.1f ms\n",
+                reported_chip8->ticks, emulated, (emulated - elapsed) * 1000);
+        printf("SKIPPED %lu INSTRUCTIONS OF IDLE LOOPS (%.1f%%)\n", reported_chip8->idle_skipped,
+                scheduler->total_executed ? 100.0 * reported_chip8->idle_skipped / scheduler->total_executed : 0);
+    }
+    jitter_print("EMULATION FRAMES LATE", &scheduler->lateness);
+    jitter_print("PRESENTS TOOK", &reported->present);
+    jitter_print("SNAPSHOTS TOOK", &reported->snapshots);
+    if (reported->history)
+        rewind_report(reported->history, stdout);
+
+#ifdef FUSION
+    fusion_report(reported_chip8, stdout);
+#endif
+#ifdef PROFILE
+    dump_profile(reported_chip8);
+#endif
+}
+
+#ifdef PROFILE
+static void request_profile(int signal)
+{
+    profile_requested = 1;
+}
+
+/* Prints the profile, and saves it to profile_file if there is one */
+static void dump_profile(const Chip8 *chip8)
+{
+    profile_report(chip8, stdout);
+    if (profile_file && profile_dump(chip8, profile_file))
+        printf("PROFILE SAVED TO '%s'\n", profile_file);
+}
+#endif
+
 /* Initializes the graphics system  */
 static void init_graphics(SDL_Window **window, SDL_Renderer **renderer, SDL_Texture **texture)
 {
@@ -146,7 +801,7 @@ void draw_ascii(Chip8 *chip8)
         if (i % 64 == 0) {
             putchar('\n');
         }
-        if (chip8->gfx[i]) {
+        if (CHIP8_PIXEL(chip8, i % 64, i / 64)) {
             putchar('1');
         } else {
             putchar(' ');
@@ -155,54 +810,106 @@ void draw_ascii(Chip8 *chip8)
     putchar('\n');
 }*/
 
-static void handle_input(Chip8 *chip8, SDL_Event *e)
+/* Returns false if the interpreter has to quit */
+static bool handle_input(Emulator *emulator, SDL_Event *e)
 {
     switch (e->type) {
         case SDL_KEYDOWN:
-            handle_key_down(chip8, e);
-            break;
+            return handle_key_down(emulator, e);
         case SDL_KEYUP:
-            handle_key_up(chip8, e);
+            handle_key_up(emulator, e);
             break;
     }
+    return true;
 }
 
-static void handle_key_down(Chip8 *chip8, SDL_Event *e)
+/* The keys are only read by the render thread, which passes them on to the
+ * emulation thread through emulator->keys */
+static bool handle_key_down(Emulator *emulator, SDL_Event *e)
 {
     if (e->key.keysym.sym == SDLK_ESCAPE) {
-        exit(EXIT_SUCCESS);
-        /* Free resources */
+        return false;
+    }
+
+    if (e->key.keysym.sym == REWIND_KEY) {
+        SDL_AtomicSet(&emulator->rewinding, 1);
+        return true;
+    }
+
+    if ((e->key.keysym.sym == SAVE_STATE_KEY || e->key.keysym.sym == LOAD_STATE_KEY) && !e->key.repeat) {
+        SDL_AtomicSet(&emulator->state_request,
+                e->key.keysym.sym == SAVE_STATE_KEY ? STATE_SAVE : STATE_LOAD);
+        return true;
+    }
+
+    if (e->key.keysym.sym == DEBUGGER_KEY && !e->key.repeat) {
+        SDL_AtomicSet(&emulator->interrupt, 1);
+        return true;
+    }
+
+    if (e->key.keysym.sym == TURBO_KEY && !e->key.repeat) {
+        bool turbo = !SDL_AtomicGet(&emulator->turbo);
+        SDL_AtomicSet(&emulator->turbo, turbo);
+        printf("TURBO %s\n", turbo ? "ON" : "OFF");
+        return true;
     }
 
+    /* Repeats don't change anything */
     for (int i = 0; i < 16; i++) {
-        if (e->key.keysym.sym == keymap[i]) {
-            chip8->key[i] = 1;
+        int keys = SDL_AtomicGet(&emulator->keys);
+        if (e->key.keysym.sym == keymap[i] && !(keys & (1 << i))) {
+            SDL_AtomicSet(&emulator->keys, keys | (1 << i));
+            SDL_SemPost(emulator->key_changed);
         }
     }
+    return true;
 }
 
 
-static void handle_key_up(Chip8 *chip8, SDL_Event *e)
+static void handle_key_up(Emulator *emulator, SDL_Event *e)
 {
+    if (e->key.keysym.sym == REWIND_KEY) {
+        SDL_AtomicSet(&emulator->rewinding, 0);
+        return;
+    }
+
     for (int i = 0; i < 16; i++) {
-        if (e->key.keysym.sym == keymap[i]) {
-            chip8->key[i] = 0;
+        int keys = SDL_AtomicGet(&emulator->keys);
+        if (e->key.keysym.sym == keymap[i] && (keys & (1 << i))) {
+            SDL_AtomicSet(&emulator->keys, keys & ~(1 << i));
+            SDL_SemPost(emulator->key_changed);
         }
     }
 }
 
-static void update_screen(Chip8 *chip8, SDL_Texture *texture, SDL_Renderer *renderer)
+/* Draws a frame. Only the dirty rows that differ from the last frame drawn
+ * are converted to ARGB, straight into the memory of the texture, and
+ * nothing is drawn if the picture is the same as the one on the window.
+ * The dirty rows of the frames dropped are in the ones of frame too */
+static void update_screen(const Frame *frame, SDL_Texture *texture, SDL_Renderer *renderer)
 {
-    chip8->shouldDraw = false;
-    uint32_t pixels[CHIP8_DISPLAY_SIZE];
+    static uint64_t shown[CHIP8_DISPLAY_HEIGHT];
+    static bool any_shown = false;
+    int first = 0, last = CHIP8_DISPLAY_HEIGHT - 1;
+
+    /* Sprites are often erased and drawn again at the same place */
+    if (any_shown && !changed_rows(frame->gfx, shown, frame->dirty_rows, &first, &last))
+        return;
 
-    for (int i = 0; i < CHIP8_DISPLAY_SIZE; i++) {
-        uint8_t pixel_is_on = chip8->gfx[i];
-        pixels[i] = pixel_is_on ? COLOR_WHITE : COLOR_BLACK;
+    /* The rows in between are converted too, as they are locked */
+    SDL_Rect rect = { 0, first, CHIP8_DISPLAY_WIDTH, last - first + 1 };
+    void *pixels;
+    int pitch;
+
+    if (SDL_LockTexture(texture, &rect, &pixels, &pitch) < 0) {
+        die("ERROR LOCKING TEXTURE\n");
     }
-    SDL_UpdateTexture(texture, NULL, pixels, 64 * sizeof(Uint32));
+    expand_rows(frame->gfx, shown, first, last, pixels, pitch, COLOR_WHITE, COLOR_BLACK);
+    SDL_UnlockTexture(texture);
+
     SDL_RenderClear(renderer);
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 
+    any_shown = true;
 }
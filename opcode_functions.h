@@ -3,21 +3,173 @@
 
 #include "chip8.h"
 
-void family_0(Chip8 * const);
-void opcode_1(Chip8 * const);
-void opcode_2(Chip8 * const);
-void opcode_3(Chip8 * const);
-void opcode_4(Chip8 * const);
-void opcode_5(Chip8 * const);
-void opcode_6(Chip8 * const);
-void opcode_7(Chip8 * const);
-void family_8(Chip8 * const);
-void opcode_9(Chip8 * const);
-void opcode_A(Chip8 * const);
-void opcode_B(Chip8 * const);
-void opcode_C(Chip8 * const);
-void opcode_D(Chip8 * const);
-void family_E(Chip8 * const);
-void family_F(Chip8 * const);
-
-#endif /* _O6CODE_FUNCTIONS_HEADER_ */
+/* Index of every instruction of the CHIP-8. The decoder stores it in the
+ * Instruction so the threaded interpreter can jump straight to its code */
+enum {
+    OP_INVALID,
+    OP_00E0, OP_00EE,
+    OP_1NNN, OP_2NNN, OP_3XNN, OP_4XNN, OP_5XY0, OP_6XNN, OP_7XNN,
+    OP_8XY0, OP_8XY1, OP_8XY2, OP_8XY3, OP_8XY4, OP_8XY5, OP_8XY6, OP_8XY7, OP_8XYE,
+    OP_9XY0, OP_ANNN, OP_BNNN, OP_CXNN, OP_DXYN,
+    OP_EX9E, OP_EXA1,
+    OP_FX07, OP_FX0A, OP_FX15, OP_FX18, OP_FX1E, OP_FX29, OP_FX33, OP_FX55, OP_FX65,
+    OP_FUSED,                          /* Several instructions at once (see fusion.c) */
+    OP_DEBUG,                          /* An instruction the debugger looks at (see debugger.c) */
+    OPCODE_COUNT
+};
+
+void opcode_invalid(Chip8 * const, const Instruction * const);
+void opcode_00E0(Chip8 * const, const Instruction * const);
+void opcode_00EE(Chip8 * const, const Instruction * const);
+void opcode_1(Chip8 * const, const Instruction * const);
+void opcode_2(Chip8 * const, const Instruction * const);
+void opcode_3(Chip8 * const, const Instruction * const);
+void opcode_4(Chip8 * const, const Instruction * const);
+void opcode_5(Chip8 * const, const Instruction * const);
+void opcode_6(Chip8 * const, const Instruction * const);
+void opcode_7(Chip8 * const, const Instruction * const);
+void opcode_8XY0(Chip8 * const, const Instruction * const);
+void opcode_8XY1(Chip8 * const, const Instruction * const);
+void opcode_8XY2(Chip8 * const, const Instruction * const);
+void opcode_8XY3(Chip8 * const, const Instruction * const);
+void opcode_8XY4(Chip8 * const, const Instruction * const);
+void opcode_8XY5(Chip8 * const, const Instruction * const);
+void opcode_8XY6(Chip8 * const, const Instruction * const);
+void opcode_8XY7(Chip8 * const, const Instruction * const);
+void opcode_8XYE(Chip8 * const, const Instruction * const);
+void opcode_9(Chip8 * const, const Instruction * const);
+void opcode_A(Chip8 * const, const Instruction * const);
+void opcode_B(Chip8 * const, const Instruction * const);
+void opcode_C(Chip8 * const, const Instruction * const);
+void opcode_D(Chip8 * const, const Instruction * const);
+void opcode_EX9E(Chip8 * const, const Instruction * const);
+void opcode_EXA1(Chip8 * const, const Instruction * const);
+void opcode_FX07(Chip8 * const, const Instruction * const);
+void opcode_FX0A(Chip8 * const, const Instruction * const);
+void opcode_FX15(Chip8 * const, const Instruction * const);
+void opcode_FX18(Chip8 * const, const Instruction * const);
+void opcode_FX1E(Chip8 * const, const Instruction * const);
+void opcode_FX29(Chip8 * const, const Instruction * const);
+void opcode_FX33(Chip8 * const, const Instruction * const);
+void opcode_FX55(Chip8 * const, const Instruction * const);
+void opcode_FX65(Chip8 * const, const Instruction * const);
+
+/* What the instructions that only read and write registers do, besides
+ * moving pc past them. The handlers below use them, and so do the
+ * interpreter loops to run these instructions in place, with pc in a local
+ * (see run_cycles()) */
+static inline void exec_6(Chip8 * const chip8, const Instruction * const ins)
+{
+    chip8->V[ins->x] = ins->nn;
+}
+
+static inline void exec_7(Chip8 * const chip8, const Instruction * const ins)
+{
+    chip8->V[ins->x] += ins->nn;
+}
+
+static inline void exec_8XY0(Chip8 * const chip8, const Instruction * const ins)
+{
+    chip8->V[ins->x] = chip8->V[ins->y];
+}
+
+static inline void exec_8XY1(Chip8 * const chip8, const Instruction * const ins)
+{
+    chip8->V[ins->x] |= chip8->V[ins->y];
+}
+
+static inline void exec_8XY2(Chip8 * const chip8, const Instruction * const ins)
+{
+    chip8->V[ins->x] &= chip8->V[ins->y];
+}
+
+static inline void exec_8XY3(Chip8 * const chip8, const Instruction * const ins)
+{
+    chip8->V[ins->x] ^= chip8->V[ins->y];
+}
+
+static inline void exec_8XY4(Chip8 * const chip8, const Instruction * const ins)
+{
+    /* If there's carry, set the VF register to 1 */
+    if ((chip8->V[ins->x] + chip8->V[ins->y]) > 0xFF)
+        chip8->V[0xF] = 1;
+    else
+        chip8->V[0xF] = 0;
+
+    chip8->V[ins->x] += chip8->V[ins->y];
+}
+
+static inline void exec_8XY5(Chip8 * const chip8, const Instruction * const ins)
+{
+    if (chip8->V[ins->y] > chip8->V[ins->x]) {
+        /* Borrow */
+        chip8->V[0xF] = 0;
+    } else {
+        /* No borrow */
+        chip8->V[0xF] = 1;
+    }
+
+    chip8->V[ins->x] -= chip8->V[ins->y];
+}
+
+static inline void exec_8XY6(Chip8 * const chip8, const Instruction * const ins)
+{
+    chip8->V[0xF] = chip8->V[ins->x] & 0x01;
+    chip8->V[ins->y] >>= 1;
+    chip8->V[ins->x] = chip8->V[ins->y];
+}
+
+static inline void exec_8XY7(Chip8 * const chip8, const Instruction * const ins)
+{
+    if (chip8->V[ins->x] > chip8->V[ins->y]) {
+        /* Borrow */
+        chip8->V[0xF] = 0;
+    } else {
+        /* No borrow */
+        chip8->V[0xF] = 1;
+    }
+
+    chip8->V[ins->x] = chip8->V[ins->y] - chip8->V[ins->x];
+}
+
+static inline void exec_8XYE(Chip8 * const chip8, const Instruction * const ins)
+{
+    chip8->V[0xF] = chip8->V[ins->x] & 0x80;
+    chip8->V[ins->y] <<= 1;
+    chip8->V[ins->x] = chip8->V[ins->y];
+}
+
+static inline void exec_A(Chip8 * const chip8, const Instruction * const ins)
+{
+    chip8->I = ins->nnn;
+}
+
+/* Whether 1NNN and 2NNN can go to NNN. The first 512 bytes are not part
+ * of the program */
+static inline bool valid_target(const Instruction * const ins)
+{
+    return ins->nnn >= 0x200 && ins->nnn <= 0xFFF;
+}
+
+/* Whether the skips skip the next instruction */
+static inline bool skips_3(const Chip8 * const chip8, const Instruction * const ins)
+{
+    return chip8->V[ins->x] == ins->nn;
+}
+
+static inline bool skips_4(const Chip8 * const chip8, const Instruction * const ins)
+{
+    return chip8->V[ins->x] != ins->nn;
+}
+
+static inline bool skips_5(const Chip8 * const chip8, const Instruction * const ins)
+{
+    return chip8->V[ins->x] == chip8->V[ins->y];
+}
+
+static inline bool skips_9(const Chip8 * const chip8, const Instruction * const ins)
+{
+    return chip8->V[ins->x] != chip8->V[ins->y];
+}
+
+#endif /* _OPCODE_FUNCTIONS_HEADER_ */
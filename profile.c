@@ -0,0 +1,228 @@
+/* Counts what the interpreter executes, to find out which programs and
+ * which instructions take its time, and where optimizing pays off.
+ *
+ * Built in with PROFILE defined: run_cycles() calls the hooks in
+ * profile.h, which cost a pointer test when profiling is not enabled and
+ * a few increments when it is (nothing is printed until asked, so the
+ * interpreter runs at about the same speed). Without PROFILE they are not
+ * even compiled in.
+ *
+ * profile_report() prints a summary, profile_dump() writes everything,
+ * with the disassembly of every address executed from the hottest one
+ * down, as CSV or JSON */
+
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+#include "disasm.h"
+
+#define REPORT_TOP_ADDRESSES 16
+
+/* Starts profiling. Returns false if there is no memory for it */
+bool profile_enable(Chip8 *chip8)
+{
+    if (chip8->profile)
+        return true;
+
+    chip8->profile = calloc(1, sizeof(Profile));
+    return chip8->profile != NULL;
+}
+
+/* Stops profiling and forgets the counts */
+void profile_disable(Chip8 *chip8)
+{
+    free(chip8->profile);
+    chip8->profile = NULL;
+}
+
+typedef struct count {
+    unsigned long count;
+    uint16_t index;                    /* OP_* or address */
+} Count;
+
+static int compare_counts(const void *a, const void *b)
+{
+    const Count *ca = a, *cb = b;
+
+    if (ca->count != cb->count)
+        return ca->count < cb->count ? 1 : -1;
+    return ca->index - cb->index;
+}
+
+/* Stores in counts the ones in values that are not zero, from the highest
+ * down, and returns how many there are */
+static int sort_counts(const unsigned long *values, int size, Count *counts)
+{
+    int count = 0;
+
+    for (int i = 0; i < size; i++) {
+        if (values[i] == 0)
+            continue;
+        counts[count].count = values[i];
+        counts[count].index = i;
+        count++;
+    }
+    qsort(counts, count, sizeof(Count), compare_counts);
+    return count;
+}
+
+/* Returns the opcode at addr and writes its assembly to text */
+static uint16_t disassemble_at(const Chip8 *chip8, uint16_t addr, char *text, size_t size)
+{
+    uint16_t opcode = chip8->memory[addr] << 8 | chip8->memory[(addr + 1) & (CHIP8_MEMSIZE - 1)];
+
+    disassemble(opcode, text, size);
+    return opcode;
+}
+
+static double percent(unsigned long part, unsigned long total)
+{
+    return total ? 100.0 * part / total : 0;
+}
+
+/* Prints the instructions executed by class, the hottest addresses and
+ * what was drawn and how the timers ticked */
+void profile_report(const Chip8 *chip8, FILE *out)
+{
+    const Profile * const profile = chip8->profile;
+    static Count counts[CHIP8_MEMSIZE];
+    unsigned long dispatches = 0;
+    char text[32];
+
+    if (!profile)
+        return;
+
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        dispatches += profile->ops[op];
+    }
+
+    fprintf(out, "PROFILE: %lu INSTRUCTIONS, %lu DISPATCHES, %lu TRANSLATED BLOCKS\n",
+            profile->instructions, dispatches, profile->blocks);
+    fprintf(out, "  %lu INSTRUCTIONS OF IDLE LOOPS SKIPPED, %lu PASSED WAITING FOR A KEY\n",
+            profile->idle, profile->waited);
+
+    int count = sort_counts(profile->ops, OPCODE_COUNT, counts);
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "  %-6s %12lu (%.1f%%)\n", op_name(counts[i].index), counts[i].count,
+                percent(counts[i].count, dispatches));
+    }
+
+    fprintf(out, "DRAWS: %lu SPRITES (%lu ROWS, %lu COLLISIONS), %lu CLEARS\n",
+            profile->ops[OP_DXYN], profile->sprite_rows, profile->collisions, profile->ops[OP_00E0]);
+    fprintf(out, "TIMERS: %lu TICKS (%lu WITH SOUND), DELAY SET %lu TIMES AND EXPIRED %lu, "
+            "SOUND SET %lu TIMES AND EXPIRED %lu\n", profile->ticks, profile->sound_ticks,
+            profile->ops[OP_FX15], profile->delay_expired, profile->ops[OP_FX18], profile->sound_expired);
+
+    count = sort_counts(profile->hits, CHIP8_MEMSIZE, counts);
+    fprintf(out, "HOTTEST ADDRESSES (%d EXECUTED):\n", count);
+    for (int i = 0; i < count && i < REPORT_TOP_ADDRESSES; i++) {
+        uint16_t opcode = disassemble_at(chip8, counts[i].index, text, sizeof(text));
+        fprintf(out, "  0x%03X  %04X  %-16s %12lu (%.1f%%)\n", counts[i].index, opcode, text,
+                counts[i].count, percent(counts[i].count, profile->instructions));
+    }
+}
+
+/* The totals, in the order they are dumped */
+static const char * const total_names[] = {
+    "instructions", "blocks", "idle_skipped", "waited", "sprites", "sprite_rows",
+    "collisions", "clears", "ticks", "sound_ticks", "delay_expired", "sound_expired"
+};
+
+#define TOTALS (int)(sizeof(total_names) / sizeof(total_names[0]))
+
+static void totals(const Profile *profile, unsigned long values[TOTALS])
+{
+    const unsigned long v[TOTALS] = {
+        profile->instructions, profile->blocks, profile->idle, profile->waited,
+        profile->ops[OP_DXYN], profile->sprite_rows, profile->collisions, profile->ops[OP_00E0],
+        profile->ticks, profile->sound_ticks, profile->delay_expired, profile->sound_expired
+    };
+
+    memcpy(values, v, sizeof(v));
+}
+
+/* One line per count: the totals, the dispatches of each class, and the
+ * instructions executed at each address, hottest first */
+static void dump_csv(const Chip8 *chip8, FILE *out)
+{
+    const Profile * const profile = chip8->profile;
+    static Count counts[CHIP8_MEMSIZE];
+    unsigned long values[TOTALS];
+    char text[32];
+
+    fprintf(out, "kind,name,count,opcode,instruction\n");
+
+    totals(profile, values);
+    for (int i = 0; i < TOTALS; i++) {
+        fprintf(out, "total,%s,%lu,,\n", total_names[i], values[i]);
+    }
+
+    int count = sort_counts(profile->ops, OPCODE_COUNT, counts);
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "op,%s,%lu,,\n", op_name(counts[i].index), counts[i].count);
+    }
+
+    count = sort_counts(profile->hits, CHIP8_MEMSIZE, counts);
+    for (int i = 0; i < count; i++) {
+        uint16_t opcode = disassemble_at(chip8, counts[i].index, text, sizeof(text));
+        fprintf(out, "address,0x%03X,%lu,%04X,\"%s\"\n", counts[i].index, counts[i].count, opcode, text);
+    }
+}
+
+/* The same as dump_csv(), as an object */
+static void dump_json(const Chip8 *chip8, FILE *out)
+{
+    const Profile * const profile = chip8->profile;
+    static Count counts[CHIP8_MEMSIZE];
+    unsigned long values[TOTALS];
+    char text[32];
+
+    fprintf(out, "{\n");
+
+    totals(profile, values);
+    for (int i = 0; i < TOTALS; i++) {
+        fprintf(out, "  \"%s\": %lu,\n", total_names[i], values[i]);
+    }
+
+    int count = sort_counts(profile->ops, OPCODE_COUNT, counts);
+    fprintf(out, "  \"ops\": {");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s\"%s\": %lu", i ? ", " : "", op_name(counts[i].index), counts[i].count);
+    }
+    fprintf(out, "},\n");
+
+    count = sort_counts(profile->hits, CHIP8_MEMSIZE, counts);
+    fprintf(out, "  \"addresses\": [");
+    for (int i = 0; i < count; i++) {
+        uint16_t opcode = disassemble_at(chip8, counts[i].index, text, sizeof(text));
+        fprintf(out, "%s\n    {\"address\": %u, \"count\": %lu, \"opcode\": \"%04X\", \"instruction\": \"%s\"}",
+                i ? "," : "", counts[i].index, counts[i].count, opcode, text);
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+/* Writes the profile to a file, as JSON if its name ends in .json and as
+ * CSV otherwise. Returns false (and says why) if it couldn't */
+bool profile_dump(const Chip8 *chip8, const char * const filename)
+{
+    if (!chip8->profile)
+        return false;
+
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        fprintf(stderr, "%s(): ERROR: COULD NOT OPEN PROFILE FILE '%s'\n", __func__, filename);
+        return false;
+    }
+
+    size_t length = strlen(filename);
+    if (length >= 5 && strcmp(filename + length - 5, ".json") == 0)
+        dump_json(chip8, file);
+    else
+        dump_csv(chip8, file);
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "%s(): ERROR WRITING PROFILE FILE '%s'\n", __func__, filename);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef _PROFILE_HEADER_
+#define _PROFILE_HEADER_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "chip8.h"
+#include "opcode_functions.h"
+
+/* What the interpreter spent its time on. Filled by the hooks below, which
+ * run_cycles() only calls in builds with PROFILE defined */
+typedef struct profile {
+	unsigned long instructions;        /* Executed, one by one or in translated blocks */
+	unsigned long ops[OPCODE_COUNT];   /* Dispatches of each OP_* (a fused sequence counts as OP_FUSED) */
+	unsigned long hits[CHIP8_MEMSIZE]; /* Instructions executed at each address */
+	unsigned long blocks;              /* Translated blocks run (JIT and AOT) */
+	unsigned long idle;                /* Instructions of idle loops skipped */
+	unsigned long waited;              /* Instructions of time passed waiting for a key */
+
+	/* Drawing */
+	unsigned long sprite_rows;         /* Rows of sprites drawn by DXYN */
+	unsigned long collisions;          /* DXYN that erased a pixel */
+
+	/* Timers */
+	unsigned long ticks;
+	unsigned long sound_ticks;         /* Ticks with the sound on */
+	unsigned long delay_expired;
+	unsigned long sound_expired;
+} Profile;
+
+bool profile_enable(Chip8 *);
+void profile_disable(Chip8 *);
+void profile_report(const Chip8 *, FILE *);
+bool profile_dump(const Chip8 *, const char * const);
+
+/* Accounts for ins, which started at pc and just ran count instructions */
+static inline void profile_instruction(Chip8 * const chip8, const Instruction * const ins,
+        uint16_t pc, int count)
+{
+    Profile * const profile = chip8->profile;
+
+    if (!profile)
+        return;
+
+    profile->instructions += count;
+    profile->ops[ins->op]++;
+    profile->hits[pc & (CHIP8_MEMSIZE - 1)] += count;
+    if (ins->op == OP_DXYN) {
+        profile->sprite_rows += ins->n;
+        profile->collisions += chip8->V[0xF];
+    }
+}
+
+/* Accounts for a translated block that started at pc and ran count
+ * instructions */
+static inline void profile_block(Chip8 * const chip8, uint16_t pc, int count)
+{
+    Profile * const profile = chip8->profile;
+
+    if (!profile)
+        return;
+
+    profile->instructions += count;
+    profile->blocks++;
+    profile->hits[pc & (CHIP8_MEMSIZE - 1)] += count;
+}
+
+/* Accounts for count instructions of an idle loop skipped (idle is true) or
+ * of time passed waiting for a key */
+static inline void profile_skip(Chip8 * const chip8, unsigned long count, bool idle)
+{
+    if (!chip8->profile)
+        return;
+
+    if (idle)
+        chip8->profile->idle += count;
+    else
+        chip8->profile->waited += count;
+}
+
+/* Accounts for a tick of the timers, which are about to count down */
+static inline void profile_tick(Chip8 * const chip8)
+{
+    Profile * const profile = chip8->profile;
+
+    if (!profile)
+        return;
+
+    profile->ticks++;
+    profile->sound_ticks += chip8->sound_timer > 0;
+    profile->delay_expired += chip8->delay_timer == 1;
+    profile->sound_expired += chip8->sound_timer == 1;
+}
+
+#endif /* _PROFILE_HEADER_ */
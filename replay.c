@@ -0,0 +1,293 @@
+/* Records sessions and replays them exactly.
+ *
+ * Given the same program, the same seed for the random number generator
+ * and the same keys at the same points, the interpreter always does the
+ * same thing. Points are counted in instructions (timers are too, see
+ * update_timers() in chip8.c), so a session is just where it started from
+ * and the instruction counts at which the keys changed. Replaying it runs
+ * the machine from one change to the next as fast as it can, and at the
+ * end its state must hash to the one recorded.
+ *
+ * The file is a header and the changes, all little endian:
+ *
+ *     "CHIP8REC"  program hash (8 bytes)  seed (4)  ips (4)
+ *     instructions (8)  state hash (8)  changes (4)
+ *
+ * followed by every change: the instructions since the previous one as a
+ * variable length number (7 bits per byte, the last one without bit 7 set)
+ * and the keys (2 bytes). A change every few frames takes 3 or 4 bytes */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+#include "snapshot.h"
+
+#define RECORDING_MAGIC "CHIP8REC"
+#define FNV_OFFSET      0xCBF29CE484222325ULL
+#define FNV_PRIME       0x100000001B3ULL
+
+static uint64_t fnv(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Returns a hash of the state of chip8 (see Snapshot). What depends on how
+ * the interpreter was built rather than on the program is left out: the
+ * idle instructions skipped and the last opcode */
+uint64_t state_hash(const Chip8 *chip8)
+{
+    static Snapshot snapshot;
+
+    save_state(chip8, &snapshot);
+    snapshot.idle_skipped = 0;
+    snapshot.opcode = 0;
+    return fnv(FNV_OFFSET, &snapshot, sizeof(snapshot));
+}
+
+/* Starts recording a session of chip8, from its current state (which has
+ * to be right after loading the program). Returns NULL if there is not
+ * enough memory */
+Recording *recording_create(const Chip8 *chip8)
+{
+    Recording *recording = malloc(sizeof(Recording));
+    if (!recording)
+        return NULL;
+
+    recording->program = fnv(FNV_OFFSET, chip8->memory, sizeof(chip8->memory));
+    recording->seed = chip8->rng;
+    recording->ips = chip8->ips;
+    recording->instructions = 0;
+    recording->state = 0;
+    recording->edges = NULL;
+    recording->count = 0;
+    recording->capacity = 0;
+    return recording;
+}
+
+void recording_destroy(Recording *recording)
+{
+    if (!recording)
+        return;
+
+    free(recording->edges);
+    free(recording);
+}
+
+/* Records that keys are pressed from instruction at on. Nothing is added
+ * if they didn't change. Returns false if there is not enough memory */
+bool recording_add(Recording *recording, uint64_t at, uint16_t keys)
+{
+    uint16_t last = recording->count ? recording->edges[recording->count - 1].keys : 0;
+    if (keys == last)
+        return true;
+
+    if (recording->count == recording->capacity) {
+        size_t capacity = recording->capacity ? recording->capacity * 2 : 256;
+        KeyEdge *edges = realloc(recording->edges, capacity * sizeof(KeyEdge));
+        if (!edges)
+            return false;
+        recording->edges = edges;
+        recording->capacity = capacity;
+    }
+
+    recording->edges[recording->count].at = at;
+    recording->edges[recording->count].keys = keys;
+    recording->count++;
+    return true;
+}
+
+/* Ends the session after instructions instructions, with chip8 in the
+ * state it left */
+void recording_finish(Recording *recording, const Chip8 *chip8, uint64_t instructions)
+{
+    recording->instructions = instructions;
+    recording->state = state_hash(chip8);
+}
+
+static void put(uint8_t **out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        *(*out)++ = value >> (8 * i);
+    }
+}
+
+static uint64_t get(const uint8_t **in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)*(*in)++ << (8 * i);
+    }
+    return value;
+}
+
+/* Writes a recording to a file. Returns false (and says why) if it
+ * couldn't */
+bool recording_save(const Recording *recording, const char * const filename)
+{
+    /* The header, and at most 10 bytes of count and 2 of keys per change */
+    uint8_t *data = malloc(44 + recording->count * 12);
+    if (!data) {
+        fprintf(stderr, "%s(): NOT ENOUGH MEMORY\n", __func__);
+        return false;
+    }
+
+    uint8_t *out = data;
+    memcpy(out, RECORDING_MAGIC, 8);
+    out += 8;
+    put(&out, recording->program, 8);
+    put(&out, recording->seed, 4);
+    put(&out, recording->ips, 4);
+    put(&out, recording->instructions, 8);
+    put(&out, recording->state, 8);
+    put(&out, recording->count, 4);
+
+    uint64_t previous = 0;
+    for (size_t i = 0; i < recording->count; i++) {
+        uint64_t delta = recording->edges[i].at - previous;
+        previous = recording->edges[i].at;
+        while (delta >= 0x80) {
+            *out++ = (delta & 0x7F) | 0x80;
+            delta >>= 7;
+        }
+        *out++ = delta;
+        put(&out, recording->edges[i].keys, 2);
+    }
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "%s(): ERROR: COULD NOT OPEN RECORDING FILE '%s'\n", __func__, filename);
+        free(data);
+        return false;
+    }
+
+    bool written = fwrite(data, out - data, 1, file) == 1;
+    free(data);
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "%s(): ERROR WRITING RECORDING FILE '%s'\n", __func__, filename);
+        return false;
+    }
+    return true;
+}
+
+/* Reads a recording written by recording_save(). Returns NULL (and says
+ * why) if it couldn't */
+Recording *recording_load(const char * const filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "%s(): ERROR: COULD NOT OPEN RECORDING FILE '%s'\n", __func__, filename);
+        return NULL;
+    }
+
+    /* Recordings are small, so it's read at once */
+    size_t size = 0, capacity = 4096;
+    uint8_t *data = malloc(capacity);
+    while (data) {
+        size += fread(data + size, 1, capacity - size, file);
+        if (size < capacity)
+            break;
+        uint8_t *bigger = realloc(data, capacity *= 2);
+        if (!bigger)
+            free(data);
+        data = bigger;
+    }
+    bool failed = ferror(file);
+    fclose(file);
+
+    Recording *recording = data && !failed ? malloc(sizeof(Recording)) : NULL;
+    if (!recording || size < 44 || memcmp(data, RECORDING_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s(): '%s' IS NOT A RECORDING\n", __func__, filename);
+        free(recording);
+        free(data);
+        return NULL;
+    }
+
+    const uint8_t *in = data + 8, *end = data + size;
+    recording->program = get(&in, 8);
+    recording->seed = get(&in, 4);
+    recording->ips = get(&in, 4);
+    recording->instructions = get(&in, 8);
+    recording->state = get(&in, 8);
+    recording->count = recording->capacity = get(&in, 4);
+    recording->edges = malloc(recording->count * sizeof(KeyEdge) + 1);
+
+    bool valid = recording->edges != NULL;
+    uint64_t at = 0;
+    for (size_t i = 0; valid && i < recording->count; i++) {
+        uint64_t delta = 0;
+        int shift = 0;
+        do {
+            valid = in < end && shift < 64;
+            if (valid)
+                delta |= (uint64_t)(*in & 0x7F) << shift;
+            shift += 7;
+        } while (valid && *in++ & 0x80);
+
+        valid = valid && end - in >= 2;
+        if (valid) {
+            at += delta;
+            recording->edges[i].at = at;
+            recording->edges[i].keys = get(&in, 2);
+        }
+    }
+    free(data);
+
+    if (!valid || in != end) {
+        fprintf(stderr, "%s(): RECORDING FILE '%s' IS DAMAGED\n", __func__, filename);
+        recording_destroy(recording);
+        return NULL;
+    }
+    return recording;
+}
+
+static void set_keys(Chip8 *chip8, uint16_t keys)
+{
+    for (int i = 0; i < MAX_KEYPAD_KEYS; i++) {
+        chip8->key[i] = (keys >> i) & 1;
+    }
+}
+
+/* Runs chip8 up to instruction until */
+static void run_until(Chip8 *chip8, uint64_t *done, uint64_t until)
+{
+    while (*done < until) {
+        unsigned long executed;
+        run_cycles(chip8, until - *done, &executed);
+        chip8->shouldDraw = false;
+        *done += executed;
+    }
+}
+
+/* Replays a recording on chip8, which has to have the program of the
+ * recording just loaded, as fast as it can. Returns true if it ended in
+ * the state the recording did. Otherwise (or if the program is not the
+ * same) it says so and returns false */
+bool replay(const Recording *recording, Chip8 *chip8)
+{
+    if (fnv(FNV_OFFSET, chip8->memory, sizeof(chip8->memory)) != recording->program) {
+        fprintf(stderr, "%s(): THE RECORDING IS OF ANOTHER PROGRAM\n", __func__);
+        return false;
+    }
+
+    chip8->rng = recording->seed;
+    chip8->ips = recording->ips;
+    set_keys(chip8, 0);
+
+    uint64_t done = 0;
+    for (size_t i = 0; i < recording->count; i++) {
+        run_until(chip8, &done, recording->edges[i].at);
+        set_keys(chip8, recording->edges[i].keys);
+    }
+    run_until(chip8, &done, recording->instructions);
+
+    if (state_hash(chip8) != recording->state) {
+        fprintf(stderr, "%s(): THE STATE AT THE END IS NOT THE ONE RECORDED\n", __func__);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef _REPLAY_HEADER_
+#define _REPLAY_HEADER_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8.h"
+
+/* The keys pressed from an instruction on */
+typedef struct key_edge {
+	uint64_t at;                       /* Instructions since the start */
+	uint16_t keys;                     /* Bit n set if key n is pressed */
+} KeyEdge;
+
+/* A session: what it started from, every change of the keys, and the state
+ * it ended with, so it can be replayed and checked (see replay.c) */
+typedef struct recording {
+	uint64_t program;                  /* Hash of the memory at the start */
+	uint32_t seed;                     /* Of the random number generator */
+	uint32_t ips;
+	uint64_t instructions;             /* Length of the session */
+	uint64_t state;                    /* Hash of the state at the end (see state_hash()) */
+	KeyEdge *edges;
+	size_t count;
+	size_t capacity;
+} Recording;
+
+Recording *recording_create(const Chip8 *);
+void recording_destroy(Recording *);
+bool recording_add(Recording *, uint64_t, uint16_t);
+void recording_finish(Recording *, const Chip8 *, uint64_t);
+bool recording_save(const Recording *, const char * const);
+Recording *recording_load(const char * const);
+bool replay(const Recording *, Chip8 *);
+uint64_t state_hash(const Chip8 *);
+
+#endif /* _REPLAY_HEADER_ */
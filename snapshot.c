@@ -0,0 +1,400 @@
+/* Saves and loads the state of a machine, and keeps the last snapshots of
+ * one to go back in time (rewind).
+ *
+ * Little changes from one frame to the next, so the rewind buffer doesn't
+ * store snapshots as they are: each one is XORed with a keyframe (a
+ * snapshot taken every REWIND_KEYFRAME_INTERVAL frames), which leaves
+ * zeros wherever they are the same, and only the runs of bytes that are
+ * not zero are stored (run length encoding). Keyframes themselves are
+ * stored against a snapshot of zeros, as most of memory is zero too. Any
+ * snapshot is restored by decoding its keyframe and then itself, so it
+ * doesn't matter how far back it is */
+
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+
+#define REWIND_KEYFRAME_INTERVAL 60   /* Snapshots from one keyframe to the next */
+#define RUN_HEADER               4    /* Bytes before each run (see encode()) */
+#define MIN_GAP                  RUN_HEADER /* Shorter gaps between runs are stored in them */
+#define STATE_MAGIC              "CHIP8STATE1"
+
+/* The most encode() can write: runs of one byte between gaps of MIN_GAP */
+#define MAX_ENCODED_SIZE (sizeof(Snapshot) + RUN_HEADER * (sizeof(Snapshot) / (MIN_GAP + 1) + 1))
+
+static const Snapshot zero_snapshot;
+
+/* Copies the state of chip8 to snapshot */
+void save_state(const Chip8 *chip8, Snapshot *snapshot)
+{
+    /* So the padding is always the same */
+    memset(snapshot, 0, sizeof(Snapshot));
+
+    memcpy(snapshot->memory, chip8->memory, sizeof(snapshot->memory));
+    memcpy(snapshot->gfx, chip8->gfx, sizeof(snapshot->gfx));
+    snapshot->ticks = chip8->ticks;
+    snapshot->idle_skipped = chip8->idle_skipped;
+    snapshot->ips = chip8->ips;
+    snapshot->timer_phase = chip8->timer_phase;
+    snapshot->rng = chip8->rng;
+    memcpy(snapshot->stack, chip8->stack, sizeof(snapshot->stack));
+    snapshot->opcode = chip8->opcode;
+    snapshot->I = chip8->I;
+    snapshot->pc = chip8->pc;
+    snapshot->sp = chip8->sp;
+    memcpy(snapshot->V, chip8->V, sizeof(snapshot->V));
+    memcpy(snapshot->key, chip8->key, sizeof(snapshot->key));
+    snapshot->delay_timer = chip8->delay_timer;
+    snapshot->sound_timer = chip8->sound_timer;
+    snapshot->waiting_key = chip8->waiting_key;
+}
+
+/* Puts chip8 back in the state of snapshot. Only the instructions of the
+ * memory that changed are decoded again */
+void load_state(Chip8 *chip8, const Snapshot *snapshot)
+{
+    const int block = 64;
+
+    for (int addr = 0; addr < CHIP8_MEMSIZE; addr += block) {
+        if (memcmp(&chip8->memory[addr], &snapshot->memory[addr], block) != 0) {
+            memcpy(&chip8->memory[addr], &snapshot->memory[addr], block);
+            invalidate_instructions(chip8, addr, block);
+        }
+    }
+
+    memcpy(chip8->gfx, snapshot->gfx, sizeof(chip8->gfx));
+    chip8->ticks = snapshot->ticks;
+    chip8->idle_skipped = snapshot->idle_skipped;
+    chip8->ips = snapshot->ips;
+    chip8->timer_phase = snapshot->timer_phase;
+    chip8->rng = snapshot->rng;
+    memcpy(chip8->stack, snapshot->stack, sizeof(chip8->stack));
+    chip8->opcode = snapshot->opcode;
+    chip8->I = snapshot->I;
+    chip8->pc = snapshot->pc;
+    chip8->sp = snapshot->sp;
+    memcpy(chip8->V, snapshot->V, sizeof(chip8->V));
+    memcpy(chip8->key, snapshot->key, sizeof(chip8->key));
+    chip8->delay_timer = snapshot->delay_timer;
+    chip8->sound_timer = snapshot->sound_timer;
+    chip8->waiting_key = snapshot->waiting_key;
+
+    /* A machine that faulted faults again on the same instruction */
+    chip8->fault = FAULT_NONE;
+
+    /* The whole screen may be different */
+    chip8->dirty_rows = 0xFFFFFFFF;
+    chip8->shouldDraw = true;
+}
+
+/* Writes the state of chip8 to a file. The file is only meant to be loaded
+ * by the same build on the same kind of machine. Returns false (and says
+ * why) if it couldn't */
+bool save_state_file(const Chip8 *chip8, const char * const filename)
+{
+    static Snapshot snapshot;
+    save_state(chip8, &snapshot);
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "%s(): ERROR: COULD NOT OPEN STATE FILE '%s'\n", __func__, filename);
+        return false;
+    }
+
+    bool written = fwrite(STATE_MAGIC, sizeof(STATE_MAGIC), 1, file) == 1 &&
+        fwrite(&snapshot, sizeof(snapshot), 1, file) == 1;
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "%s(): ERROR WRITING STATE FILE '%s'\n", __func__, filename);
+        return false;
+    }
+    return true;
+}
+
+/* Loads a state written by save_state_file(). Returns false (and says why,
+ * leaving chip8 as it was) if it couldn't */
+bool load_state_file(Chip8 *chip8, const char * const filename)
+{
+    static Snapshot snapshot;
+    char magic[sizeof(STATE_MAGIC)];
+
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "%s(): ERROR: COULD NOT OPEN STATE FILE '%s'\n", __func__, filename);
+        return false;
+    }
+
+    bool read = fread(magic, sizeof(magic), 1, file) == 1 &&
+        memcmp(magic, STATE_MAGIC, sizeof(magic)) == 0 &&
+        fread(&snapshot, sizeof(snapshot), 1, file) == 1 && fgetc(file) == EOF;
+    fclose(file);
+    if (!read) {
+        fprintf(stderr, "%s(): '%s' IS NOT A STATE FILE OF THIS INTERPRETER\n", __func__, filename);
+        return false;
+    }
+
+    load_state(chip8, &snapshot);
+    return true;
+}
+
+/* Returns how many bytes at the start of a and b are the same, up to size.
+ * 8 bytes at a time while they are */
+static size_t same_bytes(const uint8_t *a, const uint8_t *b, size_t size)
+{
+    size_t i = 0;
+
+    while (i + 8 <= size) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa != wb)
+            break;
+        i += 8;
+    }
+    while (i < size && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/* Writes the bytes of now that differ from reference to out, as runs: two
+ * uint16_t (the bytes skipped since the last run, and the length of the
+ * run) followed by the bytes of the run XORed with the reference. Gaps
+ * shorter than MIN_GAP are stored as part of the runs, as a new run would
+ * take more. Returns the size written (0 if they are the same) */
+static size_t encode(const Snapshot *now, const Snapshot *reference, uint8_t *out)
+{
+    const uint8_t *a = (const uint8_t *)now, *b = (const uint8_t *)reference;
+    const size_t total = sizeof(Snapshot);
+    size_t size = 0, done = 0;
+
+    while (done < total) {
+        size_t start = done + same_bytes(a + done, b + done, total - done);
+        if (start == total)
+            break;
+
+        /* The run ends at the first gap long enough */
+        size_t end = start + 1;
+        while (end < total) {
+            size_t gap = same_bytes(a + end, b + end, total - end);
+            if (gap >= MIN_GAP || end + gap == total)
+                break;
+            end += gap + 1;
+        }
+
+        uint16_t header[2] = { start - done, end - start };
+        memcpy(out + size, header, sizeof(header));
+        size += sizeof(header);
+        for (size_t i = start; i < end; i++) {
+            out[size++] = a[i] ^ b[i];
+        }
+        done = end;
+    }
+    return size;
+}
+
+/* Applies the runs written by encode() to snapshot, which has to be the
+ * reference they were encoded against */
+static void decode(const uint8_t *in, size_t size, Snapshot *snapshot)
+{
+    uint8_t *out = (uint8_t *)snapshot;
+    size_t at = 0, read = 0;
+
+    while (read < size) {
+        uint16_t header[2];
+        memcpy(header, in + read, sizeof(header));
+        read += sizeof(header);
+
+        at += header[0];
+        for (int i = 0; i < header[1]; i++) {
+            out[at++] ^= in[read++];
+        }
+    }
+}
+
+/* Creates a rewind buffer that keeps as many snapshots as fit in bytes
+ * (after encoding them) or frames, whatever is less. Returns NULL if there
+ * is not enough memory, or if bytes is too small for even a few keyframes */
+RewindBuffer *rewind_create(size_t bytes, int frames)
+{
+    if (bytes < 4 * MAX_ENCODED_SIZE || frames < 1)
+        return NULL;
+
+    RewindBuffer *buffer = malloc(sizeof(RewindBuffer));
+    if (!buffer)
+        return NULL;
+
+    buffer->data = malloc(bytes);
+    buffer->entries = malloc(frames * sizeof(RewindEntry));
+    buffer->encoded = malloc(MAX_ENCODED_SIZE);
+    if (!buffer->data || !buffer->entries || !buffer->encoded) {
+        rewind_destroy(buffer);
+        return NULL;
+    }
+
+    buffer->capacity = bytes;
+    buffer->next = 0;
+    buffer->max_entries = frames;
+    buffer->first = 0;
+    buffer->count = 0;
+    buffer->pushed = 0;
+    buffer->keyframes = 0;
+    buffer->bytes_pushed = 0;
+    buffer->used = 0;
+    return buffer;
+}
+
+void rewind_destroy(RewindBuffer *buffer)
+{
+    if (!buffer)
+        return;
+
+    free(buffer->data);
+    free(buffer->entries);
+    free(buffer->encoded);
+    free(buffer);
+}
+
+/* Entry back entries before the newest one */
+static RewindEntry *entry(const RewindBuffer *buffer, int back)
+{
+    return &buffer->entries[(buffer->first + buffer->count - 1 - back) % buffer->max_entries];
+}
+
+/* Drops the oldest keyframe and the snapshots stored against it, as they
+ * can't be decoded without it */
+static void evict_oldest(RewindBuffer *buffer)
+{
+    do {
+        buffer->used -= buffer->entries[buffer->first].size;
+        buffer->first = (buffer->first + 1) % buffer->max_entries;
+        buffer->count--;
+    } while (buffer->count > 0 && buffer->entries[buffer->first].keyframe != 0);
+}
+
+static bool overlaps(const RewindEntry *entry, size_t offset, size_t size)
+{
+    return entry->offset < offset + size && offset < entry->offset + entry->size;
+}
+
+/* Makes room for size bytes after the newest entry, dropping the oldest
+ * ones in the way. Returns where they go */
+static size_t reserve(RewindBuffer *buffer, size_t size)
+{
+    size_t offset = buffer->next;
+
+    /* No room at the end: start over from the beginning, where the oldest
+     * entries are once the ones past next are gone */
+    if (offset + size > buffer->capacity) {
+        while (buffer->count > 0 && buffer->entries[buffer->first].offset >= buffer->next)
+            evict_oldest(buffer);
+        offset = 0;
+    }
+
+    while (buffer->count > 0 && (buffer->count == buffer->max_entries ||
+                overlaps(&buffer->entries[buffer->first], offset, size)))
+        evict_oldest(buffer);
+    return offset;
+}
+
+/* Takes a snapshot of chip8 and adds it to the buffer, dropping the oldest
+ * ones if it's full */
+void rewind_push(RewindBuffer *buffer, const Chip8 *chip8)
+{
+    save_state(chip8, &buffer->scratch);
+
+    uint32_t keyframe = buffer->count > 0 ? entry(buffer, 0)->keyframe + 1 : 0;
+    size_t size = 0, offset = 0;
+
+    if (keyframe > 0 && keyframe < REWIND_KEYFRAME_INTERVAL) {
+        size = encode(&buffer->scratch, &buffer->keyframe, buffer->encoded);
+        offset = reserve(buffer, size);
+
+        /* Making room dropped its keyframe */
+        if (buffer->count == 0)
+            keyframe = 0;
+    } else {
+        keyframe = 0;
+    }
+
+    if (keyframe == 0) {
+        buffer->keyframe = buffer->scratch;
+        size = encode(&buffer->scratch, &zero_snapshot, buffer->encoded);
+        offset = reserve(buffer, size);
+        buffer->keyframes++;
+    }
+
+    memcpy(buffer->data + offset, buffer->encoded, size);
+    buffer->count++;
+    RewindEntry *newest = entry(buffer, 0);
+    newest->offset = offset;
+    newest->size = size;
+    newest->keyframe = keyframe;
+    buffer->next = offset + size;
+
+    buffer->used += size;
+    buffer->pushed++;
+    buffer->bytes_pushed += size;
+}
+
+/* Puts chip8 back in the state of the snapshot taken back snapshots before
+ * the newest one. Returns false if there is no such snapshot */
+bool rewind_restore(RewindBuffer *buffer, int back, Chip8 *chip8)
+{
+    if (back < 0 || back >= buffer->count)
+        return false;
+
+    const RewindEntry *wanted = entry(buffer, back);
+    const int keyframe_back = back + wanted->keyframe;
+    const RewindEntry *keyframe = entry(buffer, keyframe_back);
+
+    /* The newest keyframe is already decoded */
+    if (keyframe_back == (int)entry(buffer, 0)->keyframe) {
+        buffer->scratch = buffer->keyframe;
+    } else {
+        buffer->scratch = zero_snapshot;
+        decode(buffer->data + keyframe->offset, keyframe->size, &buffer->scratch);
+    }
+
+    if (wanted != keyframe)
+        decode(buffer->data + wanted->offset, wanted->size, &buffer->scratch);
+
+    load_state(chip8, &buffer->scratch);
+    return true;
+}
+
+/* Goes back one snapshot: drops the newest one, and puts chip8 back in the
+ * state of the one before it. Returns false (leaving chip8 as it is) if
+ * there is none */
+bool rewind_pop(RewindBuffer *buffer, Chip8 *chip8)
+{
+    if (buffer->count < 2)
+        return false;
+
+    RewindEntry *newest = entry(buffer, 0);
+    bool keyframe = newest->keyframe == 0;
+    buffer->next = newest->offset;
+    buffer->used -= newest->size;
+    buffer->count--;
+
+    /* The snapshots pushed from now on are stored against the previous
+     * keyframe */
+    if (keyframe) {
+        const RewindEntry *previous = entry(buffer, entry(buffer, 0)->keyframe);
+        buffer->keyframe = zero_snapshot;
+        decode(buffer->data + previous->offset, previous->size, &buffer->keyframe);
+    }
+
+    return rewind_restore(buffer, 0, chip8);
+}
+
+/* Prints how much history the buffer holds, in how much memory, and how
+ * big snapshots are once encoded */
+void rewind_report(const RewindBuffer *buffer, FILE *out)
+{
+    if (buffer->pushed == 0)
+        return;
+
+    fprintf(out, "REWIND: %d SNAPSHOTS IN %.1f KB OF %.1f KB, %.0f BYTES PER SNAPSHOT "
+            "(%zu RAW), %lu KEYFRAMES\n",
+            buffer->count, buffer->used / 1024.0, buffer->capacity / 1024.0,
+            (double)buffer->bytes_pushed / buffer->pushed, sizeof(Snapshot), buffer->keyframes);
+}
@@ -0,0 +1,74 @@
+#ifndef _SNAPSHOT_HEADER_
+#define _SNAPSHOT_HEADER_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8.h"
+
+/* The state of a machine, without what is derived from it (the predecoded
+ * instructions, the JIT and fusion caches) or only matters to whoever
+ * draws the screen. It has no pointers, so it can be copied, compared and
+ * written to a file as is */
+typedef struct snapshot {
+	uint8_t  memory[CHIP8_MEMSIZE];
+	uint64_t gfx[CHIP8_DISPLAY_HEIGHT];
+	uint64_t ticks;
+	uint64_t idle_skipped;
+	uint32_t ips;
+	uint32_t timer_phase;
+	uint32_t rng;
+	uint16_t stack[MAX_STACK_LEVELS];
+	uint16_t opcode;
+	uint16_t I;
+	uint16_t pc;
+	uint16_t sp;
+	uint8_t  V[REGISTERS];
+	uint8_t  key[MAX_KEYPAD_KEYS];
+	uint8_t  delay_timer;
+	uint8_t  sound_timer;
+	uint8_t  waiting_key;
+} Snapshot;
+
+/* An encoded snapshot in the rewind buffer */
+typedef struct rewind_entry {
+	size_t offset;                     /* Of its bytes in RewindBuffer.data */
+	uint32_t size;
+	uint32_t keyframe;                 /* Entries back to its keyframe. 0 for keyframes */
+} RewindEntry;
+
+/* The last snapshots of a machine, to go back in time. Every one of them
+ * is stored as the bytes that differ from a keyframe (see snapshot.c) */
+typedef struct rewind_buffer {
+	uint8_t *data;                     /* Ring of encoded snapshots */
+	size_t capacity;                   /* Bytes of data */
+	size_t next;                       /* Where the next one goes in data */
+	RewindEntry *entries;              /* Ring of entries, oldest at first */
+	int max_entries;
+	int first;
+	int count;
+	Snapshot keyframe;                 /* The one the newest entries are stored against */
+	Snapshot scratch;
+	uint8_t *encoded;                  /* The snapshot being pushed, encoded */
+
+	/* Statistics */
+	unsigned long pushed;              /* Snapshots pushed, including the ones gone */
+	unsigned long keyframes;
+	uint64_t bytes_pushed;             /* Their encoded size */
+	size_t used;                       /* Bytes of data held by entries */
+} RewindBuffer;
+
+void save_state(const Chip8 *, Snapshot *);
+void load_state(Chip8 *, const Snapshot *);
+bool save_state_file(const Chip8 *, const char * const);
+bool load_state_file(Chip8 *, const char * const);
+
+RewindBuffer *rewind_create(size_t, int);
+void rewind_destroy(RewindBuffer *);
+void rewind_push(RewindBuffer *, const Chip8 *);
+bool rewind_restore(RewindBuffer *, int, Chip8 *);
+bool rewind_pop(RewindBuffer *, Chip8 *);
+void rewind_report(const RewindBuffer *, FILE *);
+
+#endif /* _SNAPSHOT_HEADER_ */
@@ -0,0 +1,259 @@
+/* Reads the traces written by the TRACER build (see tracer.c):
+ *
+ *     chip8-trace dump <TRACE> [FILTERS]
+ *
+ * prints every record, disassembled, and
+ *
+ *     chip8-trace diff <TRACE> <TRACE>
+ *
+ * finds the first record where two traces part ways and prints it with
+ * the ones before it, to find out where two runs (of two versions of the
+ * interpreter with the same dispatch, or the same session played twice)
+ * stopped doing the same */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tracer.h"
+#include "disasm.h"
+
+#define READ_RECORDS  4096            /* Read from the file at once */
+#define DIFF_CONTEXT  8               /* Records printed before the first difference */
+
+/* A trace being read */
+typedef struct trace_file {
+    const char *name;
+    FILE *file;
+    TraceRecord records[READ_RECORDS];
+    size_t count;                      /* Records in records */
+    size_t next;                       /* Next one to return */
+    unsigned long read;                /* Records returned */
+} TraceFile;
+
+/* Which records dump prints */
+typedef struct filter {
+    uint16_t first_pc;
+    uint16_t last_pc;
+    int op;                            /* OP_*, or -1 for all */
+    uint64_t from;                     /* Only the instructions from..to */
+    uint64_t to;
+    bool writes;                       /* Only the ones that write memory */
+} Filter;
+
+static const char * const kind_names[TRACE_KINDS] = {
+    [TRACE_EXECUTED] = "",
+    [TRACE_BLOCK] = "BLOCK",
+    [TRACE_IDLE] = "IDLE",
+    [TRACE_WAIT] = "WAIT"
+};
+
+static void usage(const char * const program)
+{
+    printf("Usage: %s dump <TRACE> [--pc ADDR[-ADDR]] [--op OP] [--from N] [--to N] [--writes]\n", program);
+    printf("       %s diff <TRACE> <TRACE>\n", program);
+    printf("  dump prints the records of a trace, the ones executed at ADDR (or between both\n"
+           "  addresses), the instructions OP (like 8XY4), the ones from instruction N on or\n"
+           "  up to instruction N, or the ones that write memory\n");
+    printf("  diff prints where two traces start to differ, and exits with 1 if they do\n");
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t get32(const uint8_t *in)
+{
+    return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+/* Opens a trace and checks its header. Exits (saying why) if it can't */
+static void open_trace(TraceFile *trace, const char * const filename)
+{
+    uint8_t header[16];
+
+    trace->name = filename;
+    trace->count = trace->next = trace->read = 0;
+    trace->file = fopen(filename, "rb");
+    if (!trace->file) {
+        fprintf(stderr, "ERROR: COULD NOT OPEN TRACE FILE '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fread(header, sizeof(header), 1, trace->file) != 1 || memcmp(header, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "'%s' IS NOT A TRACE\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    if (get32(header + 12) != sizeof(TraceRecord)) {
+        fprintf(stderr, "'%s' IS A TRACE OF ANOTHER VERSION (RECORDS OF %u BYTES, NOT %zu)\n", filename,
+                get32(header + 12), sizeof(TraceRecord));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Returns the next record of trace, or NULL at the end */
+static const TraceRecord *next_record(TraceFile *trace)
+{
+    if (trace->next == trace->count) {
+        trace->count = fread(trace->records, sizeof(TraceRecord), READ_RECORDS, trace->file);
+        trace->next = 0;
+        if (trace->count == 0) {
+            if (ferror(trace->file)) {
+                fprintf(stderr, "ERROR READING TRACE FILE '%s'\n", trace->name);
+                exit(EXIT_FAILURE);
+            }
+            return NULL;
+        }
+    }
+
+    trace->read++;
+    return &trace->records[trace->next++];
+}
+
+static void print_header(const char * const prefix)
+{
+    printf("%s%12s  %-3s  %-6s  %-16s %-3s  %-6s %-5s %-6s\n", prefix, "INSTRUCTION", "PC", "OPCODE", "ASSEMBLY",
+            "I", "VX", "VF", "WRITE");
+}
+
+static void print_record(const TraceRecord *record, const char * const prefix)
+{
+    char text[32], reg[8] = "", write[8] = "";
+
+    disassemble(record->opcode, text, sizeof(text));
+    if (record->reg != TRACE_NO_REGISTER)
+        snprintf(reg, sizeof(reg), "V%X=%02X", record->reg & 0xF, record->value);
+    if (record->write != TRACE_NO_WRITE)
+        snprintf(write, sizeof(write), "%03X", record->write);
+
+    printf("%s%12llu  %03X  %04X    %-16s %03X  %-6s VF=%02X %-6s", prefix, (unsigned long long)record->at,
+            record->pc, record->opcode, text, record->I, reg, record->vf, write);
+    if (record->kind != TRACE_EXECUTED || record->count != 1)
+        printf(" %s x%u", record->kind < TRACE_KINDS ? kind_names[record->kind] : "?", record->count);
+    printf("\n");
+}
+
+static bool matches(const TraceRecord *record, const Filter *filter)
+{
+    return record->pc >= filter->first_pc && record->pc <= filter->last_pc &&
+        (filter->op < 0 || decode_table[record->opcode].op == filter->op) &&
+        record->at + record->count > filter->from && record->at <= filter->to &&
+        (!filter->writes || record->write != TRACE_NO_WRITE);
+}
+
+static uint64_t parse_number(const char *program, const char *text)
+{
+    char *end;
+    unsigned long long value = strtoull(text, &end, 0);
+
+    if (*end != '\0' || *text == '\0')
+        usage(program);
+    return value;
+}
+
+static int dump(const char *program, int argc, char **argv)
+{
+    Filter filter = {0, CHIP8_MEMSIZE - 1, -1, 0, UINT64_MAX, false};
+    TraceFile *trace = malloc(sizeof(TraceFile));
+    const TraceRecord *record;
+    unsigned long printed = 0;
+
+    if (!trace || argc < 1)
+        usage(program);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--pc") == 0 && i + 1 < argc) {
+            char *dash = strchr(argv[++i], '-');
+            if (dash)
+                *dash = '\0';
+            filter.first_pc = parse_number(program, argv[i]);
+            filter.last_pc = dash ? parse_number(program, dash + 1) : filter.first_pc;
+        } else if (strcmp(argv[i], "--op") == 0 && i + 1 < argc) {
+            i++;
+            for (filter.op = 0; filter.op < OP_FUSED && strcmp(op_name(filter.op), argv[i]) != 0; filter.op++)
+                ;
+            if (filter.op == OP_FUSED)
+                usage(program);
+        } else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            filter.from = parse_number(program, argv[++i]);
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            filter.to = parse_number(program, argv[++i]);
+        } else if (strcmp(argv[i], "--writes") == 0) {
+            filter.writes = true;
+        } else {
+            usage(program);
+        }
+    }
+
+    open_trace(trace, argv[0]);
+    print_header("");
+    while ((record = next_record(trace)) && record->at <= filter.to) {
+        if (matches(record, &filter)) {
+            print_record(record, "");
+            printed++;
+        }
+    }
+    fprintf(stderr, "%lu RECORDS PRINTED\n", printed);
+
+    fclose(trace->file);
+    free(trace);
+    return EXIT_SUCCESS;
+}
+
+static int diff(const char *program, int argc, char **argv)
+{
+    TraceFile *a = malloc(sizeof(TraceFile)), *b = malloc(sizeof(TraceFile));
+    TraceRecord context[DIFF_CONTEXT];
+    const TraceRecord *ra, *rb;
+    unsigned long same = 0;
+
+    if (!a || !b || argc != 2)
+        usage(program);
+
+    open_trace(a, argv[0]);
+    open_trace(b, argv[1]);
+
+    for (;;) {
+        ra = next_record(a);
+        rb = next_record(b);
+        if (!ra || !rb || memcmp(ra, rb, sizeof(TraceRecord)) != 0)
+            break;
+        context[same++ % DIFF_CONTEXT] = *ra;
+    }
+
+    int status = EXIT_SUCCESS;
+    if (!ra && !rb) {
+        printf("SAME %lu RECORDS\n", same);
+    } else {
+        status = EXIT_FAILURE;
+        printf("THE TRACES DIFFER AFTER %lu RECORDS\n", same);
+        print_header("  ");
+        for (unsigned long i = same > DIFF_CONTEXT ? same - DIFF_CONTEXT : 0; i < same; i++) {
+            print_record(&context[i % DIFF_CONTEXT], "  ");
+        }
+        if (ra)
+            print_record(ra, "< ");
+        else
+            printf("< (END OF '%s')\n", a->name);
+        if (rb)
+            print_record(rb, "> ");
+        else
+            printf("> (END OF '%s')\n", b->name);
+    }
+
+    fclose(a->file);
+    fclose(b->file);
+    free(a);
+    free(b);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+        usage(*argv);
+
+    if (strcmp(argv[1], "dump") == 0)
+        return dump(*argv, argc - 2, argv + 2);
+    if (strcmp(argv[1], "diff") == 0)
+        return diff(*argv, argc - 2, argv + 2);
+
+    usage(*argv);
+    return EXIT_FAILURE;
+}
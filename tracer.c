@@ -0,0 +1,145 @@
+/* Traces every instruction the interpreter executes into a file, cheaply
+ * enough to leave it on for long sessions.
+ *
+ * Built in with TRACER defined: run_cycles() calls tracer_record() after
+ * every dispatch, which fills a fixed size record (see TraceRecord) in a
+ * ring and moves on. Nothing is formatted or written by the interpreter:
+ * a thread of the tracer takes the records from the ring and writes them
+ * to the file in large blocks. The ring is a single producer, single
+ * consumer queue: the interpreter only writes head and the records after
+ * it, the flusher only writes tail, and each publishes its index with a
+ * release store once it is done with the records, which the other side
+ * reads with an acquire load. If the flusher falls a whole ring behind,
+ * the interpreter waits for it (see Tracer.stalls), so no record is ever
+ * lost.
+ *
+ * The file is TRACE_MAGIC, the version and the size of a record (4 bytes
+ * each), and the records. chip8-trace (see trace.c) prints, filters and
+ * compares them */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "tracer.h"
+
+#define TRACE_VERSION 1
+#define FLUSH_WAIT_NS 1000000          /* Sleep of the flusher when the ring is empty */
+
+/* Instructions that write VX */
+const bool trace_writes_vx[OPCODE_COUNT] = {
+    [OP_6XNN] = true, [OP_7XNN] = true,
+    [OP_8XY0] = true, [OP_8XY1] = true, [OP_8XY2] = true, [OP_8XY3] = true, [OP_8XY4] = true,
+    [OP_8XY5] = true, [OP_8XY6] = true, [OP_8XY7] = true, [OP_8XYE] = true,
+    [OP_CXNN] = true, [OP_FX07] = true, [OP_FX0A] = true, [OP_FX65] = true
+};
+
+/* Writes the records up to head to the file */
+static void write_records(Tracer *tracer, uint64_t head)
+{
+    while (tracer->tail != head) {
+        size_t start = tracer->tail & (TRACE_RING_SIZE - 1);
+        size_t count = head - tracer->tail;
+
+        if (count > TRACE_RING_SIZE - start)
+            count = TRACE_RING_SIZE - start;
+        if (!tracer->failed && fwrite(&tracer->ring[start], sizeof(TraceRecord), count, tracer->file) != count)
+            tracer->failed = true;
+
+        __atomic_store_n(&tracer->tail, tracer->tail + count, __ATOMIC_RELEASE);
+    }
+}
+
+/* Body of the flusher thread */
+static void *flush(void *data)
+{
+    Tracer *tracer = data;
+    const struct timespec wait = {0, FLUSH_WAIT_NS};
+
+    for (;;) {
+        /* Once stop is set nothing else is put, so the head read after it
+         * is the last one */
+        bool stop = __atomic_load_n(&tracer->stop, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&tracer->head, __ATOMIC_ACQUIRE);
+
+        if (head != tracer->tail)
+            write_records(tracer, head);
+        else if (stop)
+            break;
+        else
+            nanosleep(&wait, NULL);
+    }
+    return NULL;
+}
+
+static void put32(uint8_t *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        out[i] = value >> (8 * i);
+    }
+}
+
+/* Starts tracing chip8 to a file. Returns false (and says why) if it
+ * can't */
+bool tracer_start(Chip8 *chip8, const char * const filename)
+{
+    Tracer *tracer = calloc(1, sizeof(Tracer));
+    if (!tracer) {
+        fprintf(stderr, "%s(): NOT ENOUGH MEMORY TO TRACE\n", __func__);
+        return false;
+    }
+
+    tracer->file = fopen(filename, "wb");
+    if (!tracer->file) {
+        fprintf(stderr, "%s(): ERROR: COULD NOT OPEN TRACE FILE '%s'\n", __func__, filename);
+        free(tracer);
+        return false;
+    }
+
+    uint8_t header[16];
+    memcpy(header, TRACE_MAGIC, 8);
+    put32(header + 8, TRACE_VERSION);
+    put32(header + 12, sizeof(TraceRecord));
+    if (fwrite(header, sizeof(header), 1, tracer->file) != 1 ||
+            pthread_create(&tracer->flusher, NULL, flush, tracer) != 0) {
+        fprintf(stderr, "%s(): ERROR STARTING THE TRACE TO '%s'\n", __func__, filename);
+        fclose(tracer->file);
+        free(tracer);
+        return false;
+    }
+
+    chip8->tracer = tracer;
+    return true;
+}
+
+/* Called by tracer_record() when the ring is full. Waits for the flusher
+ * to make room */
+void tracer_wait(Tracer *tracer)
+{
+    tracer->stalls++;
+    do {
+        sched_yield();
+        tracer->tail_seen = __atomic_load_n(&tracer->tail, __ATOMIC_ACQUIRE);
+    } while (tracer->head - tracer->tail_seen == TRACE_RING_SIZE);
+}
+
+/* Writes what is left in the ring and stops tracing. Has to be called
+ * while chip8 doesn't run */
+void tracer_stop(Chip8 *chip8)
+{
+    Tracer *tracer = chip8->tracer;
+
+    if (!tracer)
+        return;
+
+    __atomic_store_n(&tracer->stop, true, __ATOMIC_RELEASE);
+    pthread_join(tracer->flusher, NULL);
+
+    if (fclose(tracer->file) != 0 || tracer->failed)
+        fprintf(stderr, "%s(): ERROR WRITING THE TRACE\n", __func__);
+
+    free(tracer);
+    chip8->tracer = NULL;
+}
@@ -0,0 +1,109 @@
+#ifndef _TRACER_HEADER_
+#define _TRACER_HEADER_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "chip8.h"
+#include "opcode_functions.h"
+
+#define TRACE_MAGIC       "CHIP8TRC"
+#define TRACE_RING_SIZE   (1 << 16)    /* Records. A power of 2 */
+#define TRACE_NO_WRITE    0xFFFF
+#define TRACE_NO_REGISTER 0xFF
+#define TRACE_CACHE_LINE  64
+
+/* What a record stands for */
+enum {
+    TRACE_EXECUTED,                    /* An instruction (or a fused sequence, if count > 1) */
+    TRACE_BLOCK,                       /* A translated block (JIT or AOT) */
+    TRACE_IDLE,                        /* Iterations of an idle loop skipped */
+    TRACE_WAIT,                        /* Time passed waiting for a key at FX0A */
+    TRACE_KINDS
+};
+
+/* One per dispatch. Written to the file as is, so a trace is only read
+ * on machines with the same byte order */
+typedef struct trace_record {
+	uint64_t at;                       /* Instructions executed before it */
+	uint32_t count;                    /* Instructions it stands for */
+	uint16_t pc;
+	uint16_t opcode;
+	uint16_t I;                        /* After it */
+	uint16_t write;                    /* First address of the memory written. TRACE_NO_WRITE if none */
+	uint8_t  reg;                      /* Register written (VX). TRACE_NO_REGISTER if none */
+	uint8_t  value;                    /* Its value after */
+	uint8_t  vf;                       /* VF after */
+	uint8_t  kind;                     /* TRACE_* */
+} TraceRecord;
+
+/* Records go through a ring from the interpreter (the only producer) to a
+ * thread that writes them to the file (the only consumer). Each side only
+ * writes its own index, so no locks are needed (see tracer.c) */
+typedef struct tracer {
+	TraceRecord ring[TRACE_RING_SIZE];
+	uint64_t head;                     /* Records put. Only written by the interpreter */
+	uint64_t tail_seen;                /* Its last read of tail */
+	uint64_t at;                       /* Instructions traced */
+	unsigned long stalls;              /* Times the ring was full */
+	char pad[TRACE_CACHE_LINE];        /* Keeps the indexes of both sides on their own lines */
+	uint64_t tail;                     /* Records written. Only written by the flusher */
+	bool stop;
+	bool failed;                       /* Writing the file failed. Records are then dropped */
+	FILE *file;
+	pthread_t flusher;
+} Tracer;
+
+extern const bool trace_writes_vx[OPCODE_COUNT];
+
+bool tracer_start(Chip8 *, const char * const);
+void tracer_stop(Chip8 *);
+void tracer_wait(Tracer *);
+
+/* Traces ins, which started at pc and ran count instructions. ins is NULL
+ * for a translated block or time spent waiting for a key */
+static inline void tracer_record(Chip8 * const chip8, const Instruction * const ins,
+        uint16_t pc, uint32_t count, int kind)
+{
+    Tracer * const tracer = chip8->tracer;
+
+    if (!tracer)
+        return;
+
+    if (tracer->head - tracer->tail_seen == TRACE_RING_SIZE) {
+        tracer->tail_seen = __atomic_load_n(&tracer->tail, __ATOMIC_ACQUIRE);
+        if (tracer->head - tracer->tail_seen == TRACE_RING_SIZE)
+            tracer_wait(tracer);
+    }
+
+    TraceRecord * const record = &tracer->ring[tracer->head & (TRACE_RING_SIZE - 1)];
+    record->at = tracer->at;
+    record->count = count;
+    record->pc = pc;
+    record->I = chip8->I;
+    record->vf = chip8->V[0xF];
+    record->kind = kind;
+    record->write = TRACE_NO_WRITE;
+    record->reg = TRACE_NO_REGISTER;
+    record->value = 0;
+    if (ins) {
+        record->opcode = ins->opcode;
+        if (trace_writes_vx[ins->op]) {
+            record->reg = ins->x;
+            record->value = chip8->V[ins->x];
+        }
+        if (ins->op == OP_FX33)
+            record->write = chip8->I;
+        else if (ins->op == OP_FX55)
+            record->write = chip8->I - ins->x - 1;
+    } else {
+        record->opcode = chip8->memory[pc & (CHIP8_MEMSIZE - 1)] << 8 |
+            chip8->memory[(pc + 1) & (CHIP8_MEMSIZE - 1)];
+    }
+
+    tracer->at += count;
+    __atomic_store_n(&tracer->head, tracer->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* _TRACER_HEADER_ */